@@ -1302,6 +1302,12 @@ ngx_close_connection(ngx_connection_t *c)
 
     ngx_reusable_connection(c, 0);
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+    if (c->zerocopy) {
+        ngx_linux_zerocopy_abort(c);
+    }
+#endif
+
     log_error = c->log_error;
 
     ngx_free_connection(c);
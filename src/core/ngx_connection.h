@@ -197,9 +197,17 @@ struct ngx_connection_s {
     unsigned            busy_count:2;
 #endif
 
+#if (NGX_HAVE_MSG_ZEROCOPY || NGX_COMPAT)
+    unsigned            tcp_zerocopy:1;
+#endif
+
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t  *sendfile_task;
 #endif
+
+#if (NGX_HAVE_MSG_ZEROCOPY || NGX_COMPAT)
+    ngx_zerocopy_t     *zerocopy;
+#endif
 };
 
 
@@ -1057,6 +1057,7 @@ ngx_walk_tree(ngx_tree_ctx_t *ctx, ngx_str_t *tree)
             ctx->fs_size = ngx_de_fs_size(&dir);
             ctx->access = ngx_de_access(&dir);
             ctx->mtime = ngx_de_mtime(&dir);
+            ctx->uniq = ngx_de_uniq(&dir);
 
             if (ctx->file_handler(ctx, &file) == NGX_ABORT) {
                 goto failed;
@@ -118,6 +118,7 @@ struct ngx_tree_ctx_s {
     off_t                      fs_size;
     ngx_uint_t                 access;
     time_t                     mtime;
+    ngx_file_uniq_t            uniq;
 
     ngx_tree_init_handler_pt   init_handler;
     ngx_tree_handler_pt        file_handler;
@@ -8,6 +8,11 @@
 #include <ngx_core.h>
 
 
+static const u_char *ngx_murmur_hash3_body(ngx_murmur_hash3_t *ctx,
+    const u_char *data, size_t size);
+static uint64_t ngx_murmur_hash3_fmix(uint64_t k);
+
+
 uint32_t
 ngx_murmur_hash2(u_char *data, size_t len)
 {
@@ -50,3 +55,228 @@ ngx_murmur_hash2(u_char *data, size_t len)
 
     return h;
 }
+
+
+/*
+ * MurmurHash3_x64_128, processed incrementally in the same way
+ * as ngx_md5_t; the result is h1 and h2 in little-endian order
+ */
+
+#define NGX_MURMUR3_C1  0x87c37b91114253d5
+#define NGX_MURMUR3_C2  0x4cf5ad432745937f
+
+#define ngx_murmur3_rotl(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+#if (NGX_HAVE_LITTLE_ENDIAN && NGX_HAVE_NONALIGNED)
+
+#define ngx_murmur3_get(p)  (*(uint64_t *) (p))
+
+#else
+
+#define ngx_murmur3_get(p)                                                    \
+    ((uint64_t) (p)[0] | (uint64_t) (p)[1] << 8                               \
+     | (uint64_t) (p)[2] << 16 | (uint64_t) (p)[3] << 24                      \
+     | (uint64_t) (p)[4] << 32 | (uint64_t) (p)[5] << 40                      \
+     | (uint64_t) (p)[6] << 48 | (uint64_t) (p)[7] << 56)
+
+#endif
+
+
+void
+ngx_murmur_hash3_init(ngx_murmur_hash3_t *ctx)
+{
+    ctx->h1 = 0;
+    ctx->h2 = 0;
+
+    ctx->bytes = 0;
+}
+
+
+void
+ngx_murmur_hash3_update(ngx_murmur_hash3_t *ctx, const void *data, size_t size)
+{
+    size_t  used, free;
+
+    used = (size_t) (ctx->bytes & 0xf);
+    ctx->bytes += size;
+
+    if (used) {
+        free = 16 - used;
+
+        if (size < free) {
+            ngx_memcpy(&ctx->buffer[used], data, size);
+            return;
+        }
+
+        ngx_memcpy(&ctx->buffer[used], data, free);
+        data = (u_char *) data + free;
+        size -= free;
+        (void) ngx_murmur_hash3_body(ctx, ctx->buffer, 16);
+    }
+
+    if (size >= 16) {
+        data = ngx_murmur_hash3_body(ctx, data, size & ~(size_t) 0xf);
+        size &= 0xf;
+    }
+
+    ngx_memcpy(ctx->buffer, data, size);
+}
+
+
+void
+ngx_murmur_hash3_final(u_char result[16], ngx_murmur_hash3_t *ctx)
+{
+    u_char    *p;
+    uint64_t   h1, h2, k1, k2;
+
+    p = ctx->buffer;
+
+    h1 = ctx->h1;
+    h2 = ctx->h2;
+
+    k1 = 0;
+    k2 = 0;
+
+    switch (ctx->bytes & 0xf) {
+    case 15:
+        k2 ^= (uint64_t) p[14] << 48;
+        /* fall through */
+    case 14:
+        k2 ^= (uint64_t) p[13] << 40;
+        /* fall through */
+    case 13:
+        k2 ^= (uint64_t) p[12] << 32;
+        /* fall through */
+    case 12:
+        k2 ^= (uint64_t) p[11] << 24;
+        /* fall through */
+    case 11:
+        k2 ^= (uint64_t) p[10] << 16;
+        /* fall through */
+    case 10:
+        k2 ^= (uint64_t) p[9] << 8;
+        /* fall through */
+    case 9:
+        k2 ^= (uint64_t) p[8];
+        k2 *= NGX_MURMUR3_C2;
+        k2 = ngx_murmur3_rotl(k2, 33);
+        k2 *= NGX_MURMUR3_C1;
+        h2 ^= k2;
+        /* fall through */
+    case 8:
+        k1 ^= (uint64_t) p[7] << 56;
+        /* fall through */
+    case 7:
+        k1 ^= (uint64_t) p[6] << 48;
+        /* fall through */
+    case 6:
+        k1 ^= (uint64_t) p[5] << 40;
+        /* fall through */
+    case 5:
+        k1 ^= (uint64_t) p[4] << 32;
+        /* fall through */
+    case 4:
+        k1 ^= (uint64_t) p[3] << 24;
+        /* fall through */
+    case 3:
+        k1 ^= (uint64_t) p[2] << 16;
+        /* fall through */
+    case 2:
+        k1 ^= (uint64_t) p[1] << 8;
+        /* fall through */
+    case 1:
+        k1 ^= (uint64_t) p[0];
+        k1 *= NGX_MURMUR3_C1;
+        k1 = ngx_murmur3_rotl(k1, 31);
+        k1 *= NGX_MURMUR3_C2;
+        h1 ^= k1;
+    }
+
+    h1 ^= ctx->bytes;
+    h2 ^= ctx->bytes;
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = ngx_murmur_hash3_fmix(h1);
+    h2 = ngx_murmur_hash3_fmix(h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    result[0] = (u_char) h1;
+    result[1] = (u_char) (h1 >> 8);
+    result[2] = (u_char) (h1 >> 16);
+    result[3] = (u_char) (h1 >> 24);
+    result[4] = (u_char) (h1 >> 32);
+    result[5] = (u_char) (h1 >> 40);
+    result[6] = (u_char) (h1 >> 48);
+    result[7] = (u_char) (h1 >> 56);
+    result[8] = (u_char) h2;
+    result[9] = (u_char) (h2 >> 8);
+    result[10] = (u_char) (h2 >> 16);
+    result[11] = (u_char) (h2 >> 24);
+    result[12] = (u_char) (h2 >> 32);
+    result[13] = (u_char) (h2 >> 40);
+    result[14] = (u_char) (h2 >> 48);
+    result[15] = (u_char) (h2 >> 56);
+
+    ngx_memzero(ctx, sizeof(*ctx));
+}
+
+
+static const u_char *
+ngx_murmur_hash3_body(ngx_murmur_hash3_t *ctx, const u_char *data,
+    size_t size)
+{
+    uint64_t  h1, h2, k1, k2;
+
+    h1 = ctx->h1;
+    h2 = ctx->h2;
+
+    do {
+        k1 = ngx_murmur3_get(data);
+        k2 = ngx_murmur3_get(data + 8);
+
+        k1 *= NGX_MURMUR3_C1;
+        k1 = ngx_murmur3_rotl(k1, 31);
+        k1 *= NGX_MURMUR3_C2;
+        h1 ^= k1;
+
+        h1 = ngx_murmur3_rotl(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= NGX_MURMUR3_C2;
+        k2 = ngx_murmur3_rotl(k2, 33);
+        k2 *= NGX_MURMUR3_C1;
+        h2 ^= k2;
+
+        h2 = ngx_murmur3_rotl(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+
+        data += 16;
+        size -= 16;
+
+    } while (size);
+
+    ctx->h1 = h1;
+    ctx->h2 = h2;
+
+    return data;
+}
+
+
+static uint64_t
+ngx_murmur_hash3_fmix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccd;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53;
+    k ^= k >> 33;
+
+    return k;
+}
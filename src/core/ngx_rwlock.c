@@ -16,6 +16,9 @@
 #define NGX_RWLOCK_WLOCK  ((ngx_atomic_uint_t) -1)
 
 
+static void ngx_rwlock_wait(ngx_atomic_t *value);
+
+
 void
 ngx_rwlock_wlock(ngx_atomic_t *lock)
 {
@@ -106,6 +109,100 @@ ngx_rwlock_downgrade(ngx_atomic_t *lock)
 }
 
 
+/*
+ * A lock with per-worker reader slots, each in its own cache line.
+ * Readers only modify their own slot and read the lock word, so they
+ * do not bounce a shared cache line unless a writer is active.
+ * The lock word holds the pid of the writer, so an unlock can tell
+ * the writer from a reader.
+ */
+
+void
+ngx_rwlock_wlock_slots(ngx_atomic_t *lock, ngx_rwlock_slot_t *slots,
+    ngx_uint_t n)
+{
+    ngx_uint_t  i;
+
+    for ( ;; ) {
+
+        if (*lock == 0 && ngx_atomic_cmp_set(lock, 0, ngx_pid)) {
+            break;
+        }
+
+        ngx_rwlock_wait(lock);
+    }
+
+    /* wait for the readers which came before the writer */
+
+    for (i = 0; i < n; i++) {
+        while (slots[i].readers) {
+            ngx_rwlock_wait(&slots[i].readers);
+        }
+    }
+}
+
+
+void
+ngx_rwlock_rlock_slots(ngx_atomic_t *lock, ngx_rwlock_slot_t *slots,
+    ngx_uint_t n)
+{
+    ngx_rwlock_slot_t  *slot;
+
+    slot = &slots[ngx_worker % n];
+
+    for ( ;; ) {
+        (void) ngx_atomic_fetch_add(&slot->readers, 1);
+
+        if (*lock == 0) {
+            return;
+        }
+
+        /* a writer is active, step aside until it is done */
+
+        (void) ngx_atomic_fetch_add(&slot->readers, -1);
+
+        while (*lock) {
+            ngx_rwlock_wait(lock);
+        }
+    }
+}
+
+
+void
+ngx_rwlock_unlock_slots(ngx_atomic_t *lock, ngx_rwlock_slot_t *slots,
+    ngx_uint_t n)
+{
+    if (*lock == (ngx_atomic_uint_t) ngx_pid) {
+        (void) ngx_atomic_cmp_set(lock, ngx_pid, 0);
+    } else {
+        (void) ngx_atomic_fetch_add(&slots[ngx_worker % n].readers, -1);
+    }
+}
+
+
+static void
+ngx_rwlock_wait(ngx_atomic_t *value)
+{
+    ngx_uint_t  i, n;
+
+    if (ngx_ncpu > 1) {
+
+        for (n = 1; n < NGX_RWLOCK_SPIN; n <<= 1) {
+
+            for (i = 0; i < n; i++) {
+                ngx_cpu_pause();
+            }
+
+            if (*value == 0) {
+                return;
+            }
+        }
+    }
+
+    ngx_sched_yield();
+}
+
+
 #else
 
 #if (NGX_HTTP_UPSTREAM_ZONE || NGX_STREAM_UPSTREAM_ZONE)
@@ -13,10 +13,23 @@
 #include <ngx_core.h>
 
 
+typedef struct {
+    ngx_atomic_t  readers;
+    u_char        padding[NGX_CPU_CACHE_LINE - sizeof(ngx_atomic_t)];
+} ngx_rwlock_slot_t;
+
+
 void ngx_rwlock_wlock(ngx_atomic_t *lock);
 void ngx_rwlock_rlock(ngx_atomic_t *lock);
 void ngx_rwlock_unlock(ngx_atomic_t *lock);
 void ngx_rwlock_downgrade(ngx_atomic_t *lock);
 
+void ngx_rwlock_wlock_slots(ngx_atomic_t *lock, ngx_rwlock_slot_t *slots,
+    ngx_uint_t n);
+void ngx_rwlock_rlock_slots(ngx_atomic_t *lock, ngx_rwlock_slot_t *slots,
+    ngx_uint_t n);
+void ngx_rwlock_unlock_slots(ngx_atomic_t *lock, ngx_rwlock_slot_t *slots,
+    ngx_uint_t n);
+
 
 #endif /* _NGX_RWLOCK_H_INCLUDED_ */
@@ -579,6 +579,26 @@ ngx_thread_pool_get(ngx_cycle_t *cycle, ngx_str_t *name)
 }
 
 
+/*
+ * thread pools are started in worker processes on startup, while helper
+ * processes, such as the cache manager, start the pools they use on demand
+ */
+
+ngx_int_t
+ngx_thread_pool_start(ngx_cycle_t *cycle, ngx_thread_pool_t *tp)
+{
+    if (tp->log) {
+        return NGX_OK;
+    }
+
+    if (ngx_thread_pool_done.last == NULL) {
+        ngx_thread_pool_queue_init(&ngx_thread_pool_done);
+    }
+
+    return ngx_thread_pool_init(tp, cycle->log, cycle->pool);
+}
+
+
 static ngx_int_t
 ngx_thread_pool_init_worker(ngx_cycle_t *cycle)
 {
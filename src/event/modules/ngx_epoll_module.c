@@ -97,10 +97,31 @@ struct io_event {
 
 typedef struct {
     ngx_uint_t  events;
+    ngx_uint_t  changes;
     ngx_uint_t  aio_requests;
 } ngx_epoll_conf_t;
 
 
+/*
+ * Connections which are not registered in epoll yet are collected in
+ * the change list and added right before epoll_wait(), so read and write
+ * events are added with a single epoll_ctl(), and no epoll_ctl() is needed
+ * at all if a connection is closed in the same iteration.  The connection
+ * position in the list is kept in c->read->index.
+ *
+ * If a deferred epoll_ctl() fails, the connection events are posted with
+ * the error flag set, and events of such a connection are never deferred
+ * again, so the owner gets the error from its next ngx_handle_*_event().
+ * Listening sockets and channels are always added immediately, as their
+ * handlers do not expect to be called without an event.
+ */
+
+typedef struct {
+    ngx_connection_t  *connection;
+    uint32_t           flags;
+} ngx_epoll_change_t;
+
+
 static ngx_int_t ngx_epoll_init(ngx_cycle_t *cycle, ngx_msec_t timer);
 #if (NGX_HAVE_EVENTFD)
 static ngx_int_t ngx_epoll_notify_init(ngx_log_t *log);
@@ -123,6 +144,12 @@ static ngx_int_t ngx_epoll_notify(ngx_event_handler_pt handler);
 static ngx_int_t ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
     ngx_uint_t flags);
 
+static ngx_uint_t ngx_epoll_deferrable(ngx_connection_t *c);
+static void ngx_epoll_add_change(ngx_connection_t *c, uint32_t flags);
+static ngx_epoll_change_t *ngx_epoll_get_change(ngx_connection_t *c);
+static void ngx_epoll_remove_change(ngx_connection_t *c);
+static void ngx_epoll_flush_changes(ngx_log_t *log);
+
 #if (NGX_HAVE_FILE_AIO)
 static void ngx_epoll_eventfd_handler(ngx_event_t *ev);
 #endif
@@ -134,6 +161,9 @@ static int                  ep = -1;
 static struct epoll_event  *event_list;
 static ngx_uint_t           nevents;
 
+static ngx_epoll_change_t  *change_list;
+static ngx_uint_t           max_changes, nchanges;
+
 #if (NGX_HAVE_EVENTFD)
 static int                  notify_fd = -1;
 static ngx_event_t          notify_event;
@@ -165,6 +195,13 @@ static ngx_command_t  ngx_epoll_commands[] = {
       offsetof(ngx_epoll_conf_t, events),
       NULL },
 
+    { ngx_string("epoll_changes"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_epoll_conf_t, changes),
+      NULL },
+
     { ngx_string("worker_aio_requests"),
       NGX_EVENT_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -364,6 +401,27 @@ ngx_epoll_init(ngx_cycle_t *cycle, ngx_msec_t timer)
 
     nevents = epcf->events;
 
+    if (max_changes != epcf->changes) {
+        if (nchanges) {
+            ngx_epoll_flush_changes(cycle->log);
+        }
+
+        if (change_list) {
+            ngx_free(change_list);
+            change_list = NULL;
+        }
+
+        if (epcf->changes) {
+            change_list = ngx_alloc(sizeof(ngx_epoll_change_t) * epcf->changes,
+                                    cycle->log);
+            if (change_list == NULL) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    max_changes = epcf->changes;
+
     ngx_io = ngx_os_io;
 
     ngx_event_actions = ngx_epoll_module_ctx.actions;
@@ -572,6 +630,14 @@ ngx_epoll_done(ngx_cycle_t *cycle)
 
     event_list = NULL;
     nevents = 0;
+
+    if (change_list) {
+        ngx_free(change_list);
+    }
+
+    change_list = NULL;
+    max_changes = 0;
+    nchanges = 0;
 }
 
 
@@ -583,9 +649,18 @@ ngx_epoll_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
     ngx_event_t         *e;
     ngx_connection_t    *c;
     struct epoll_event   ee;
+    ngx_epoll_change_t  *ch;
 
     c = ev->data;
 
+    ch = ngx_epoll_get_change(c);
+
+    if (ch) {
+        ch->flags |= (uint32_t) flags;
+        ev->active = 1;
+        return NGX_OK;
+    }
+
     events = (uint32_t) event;
 
     if (event == NGX_READ_EVENT) {
@@ -608,6 +683,15 @@ ngx_epoll_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
         events |= prev;
 
     } else {
+        if (!(flags & NGX_EXCLUSIVE_EVENT) && ngx_epoll_deferrable(c)) {
+
+            ngx_epoll_add_change(c, (uint32_t) flags);
+
+            ev->active = 1;
+
+            return NGX_OK;
+        }
+
         op = EPOLL_CTL_ADD;
     }
 
@@ -647,6 +731,25 @@ ngx_epoll_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
     ngx_event_t         *e;
     ngx_connection_t    *c;
     struct epoll_event   ee;
+    ngx_epoll_change_t  *ch;
+
+    c = ev->data;
+
+    ch = ngx_epoll_get_change(c);
+
+    if (ch) {
+        ev->active = 0;
+
+        /* the add flags are kept for the event which is still active */
+
+        if ((flags & NGX_CLOSE_EVENT)
+            || (!c->read->active && !c->write->active))
+        {
+            ngx_epoll_remove_change(c);
+        }
+
+        return NGX_OK;
+    }
 
     /*
      * when the file descriptor is closed, the epoll automatically deletes
@@ -659,8 +762,6 @@ ngx_epoll_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
         return NGX_OK;
     }
 
-    c = ev->data;
-
     if (event == NGX_READ_EVENT) {
         e = c->write;
         prev = EPOLLOUT;
@@ -702,6 +803,15 @@ ngx_epoll_add_connection(ngx_connection_t *c)
 {
     struct epoll_event  ee;
 
+    if (ngx_epoll_deferrable(c)) {
+        ngx_epoll_add_change(c, EPOLLET);
+
+        c->read->active = 1;
+        c->write->active = 1;
+
+        return NGX_OK;
+    }
+
     ee.events = EPOLLIN|EPOLLOUT|EPOLLET|EPOLLRDHUP;
     ee.data.ptr = (void *) ((uintptr_t) c | c->read->instance);
 
@@ -733,7 +843,9 @@ ngx_epoll_del_connection(ngx_connection_t *c, ngx_uint_t flags)
      * before the closing the file descriptor
      */
 
-    if (flags & NGX_CLOSE_EVENT) {
+    if ((flags & NGX_CLOSE_EVENT) || ngx_epoll_get_change(c)) {
+        ngx_epoll_remove_change(c);
+
         c->read->active = 0;
         c->write->active = 0;
         return NGX_OK;
@@ -794,6 +906,10 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
 
     /* NGX_TIMER_INFINITE == INFTIM */
 
+    if (nchanges) {
+        ngx_epoll_flush_changes(cycle->log);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
                    "epoll timer: %M", timer);
 
@@ -801,6 +917,10 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
 
     err = (events == -1) ? ngx_errno : 0;
 
+#if (NGX_STAT_LOOP)
+    ngx_stat_loop_wakeup((events > 0) ? (ngx_uint_t) events : 0);
+#endif
+
     if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
         ngx_time_update();
     }
@@ -936,6 +1056,143 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
 }
 
 
+static ngx_uint_t
+ngx_epoll_deferrable(ngx_connection_t *c)
+{
+    return max_changes
+           && !c->read->accept
+           && !c->read->channel
+           && !c->read->error
+           && !c->write->error;
+}
+
+
+static void
+ngx_epoll_add_change(ngx_connection_t *c, uint32_t flags)
+{
+    ngx_epoll_change_t  *ch;
+
+    if (nchanges >= max_changes) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "epoll change list is filled up");
+
+        ngx_epoll_flush_changes(c->log);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "epoll change: fd:%d fl:%08XD", c->fd, flags);
+
+    ch = &change_list[nchanges];
+
+    ch->connection = c;
+    ch->flags = flags;
+
+    c->read->index = nchanges;
+    nchanges++;
+}
+
+
+static ngx_epoll_change_t *
+ngx_epoll_get_change(ngx_connection_t *c)
+{
+    ngx_uint_t  i;
+
+    i = c->read->index;
+
+    if (i < nchanges && change_list[i].connection == c) {
+        return &change_list[i];
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_epoll_remove_change(ngx_connection_t *c)
+{
+    ngx_uint_t  i;
+
+    i = c->read->index;
+
+    if (i >= nchanges || change_list[i].connection != c) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "epoll change cancelled: fd:%d", c->fd);
+
+    c->read->index = NGX_INVALID_INDEX;
+
+    if (i < --nchanges) {
+        change_list[i] = change_list[nchanges];
+        change_list[i].connection->read->index = i;
+    }
+}
+
+
+static void
+ngx_epoll_flush_changes(ngx_log_t *log)
+{
+    ngx_uint_t           i;
+    ngx_event_t         *rev, *wev;
+    ngx_connection_t    *c;
+    struct epoll_event   ee;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "epoll changes: %ui", nchanges);
+
+    for (i = 0; i < nchanges; i++) {
+        c = change_list[i].connection;
+
+        c->read->index = NGX_INVALID_INDEX;
+
+        ee.events = change_list[i].flags;
+
+        if (c->read->active) {
+            ee.events |= EPOLLIN|EPOLLRDHUP;
+        }
+
+        if (c->write->active) {
+            ee.events |= EPOLLOUT;
+        }
+
+        ee.data.ptr = (void *) ((uintptr_t) c | c->read->instance);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "epoll add event: fd:%d ev:%08XD", c->fd, ee.events);
+
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ee) == 0) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                      "epoll_ctl(EPOLL_CTL_ADD, %d) failed", c->fd);
+
+        rev = c->read;
+        wev = c->write;
+
+        if (rev->active) {
+            rev->active = 0;
+            rev->ready = 1;
+            rev->error = 1;
+            rev->available = -1;
+
+            ngx_post_event(rev, &ngx_posted_events);
+        }
+
+        if (wev->active) {
+            wev->active = 0;
+            wev->ready = 1;
+            wev->error = 1;
+
+            ngx_post_event(wev, &ngx_posted_events);
+        }
+    }
+
+    nchanges = 0;
+}
+
+
 #if (NGX_HAVE_FILE_AIO)
 
 static void
@@ -1033,6 +1290,7 @@ ngx_epoll_create_conf(ngx_cycle_t *cycle)
     }
 
     epcf->events = NGX_CONF_UNSET;
+    epcf->changes = NGX_CONF_UNSET;
     epcf->aio_requests = NGX_CONF_UNSET;
 
     return epcf;
@@ -1045,6 +1303,7 @@ ngx_epoll_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_epoll_conf_t *epcf = conf;
 
     ngx_conf_init_uint_value(epcf->events, 512);
+    ngx_conf_init_uint_value(epcf->changes, 0);
     ngx_conf_init_uint_value(epcf->aio_requests, 32);
 
     return NGX_CONF_OK;
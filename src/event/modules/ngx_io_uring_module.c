@@ -0,0 +1,1295 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The module uses io_uring as a readiness notification mechanism:
+ * each active event is backed by a poll request, multishot for the
+ * edge-triggered events and re-armed oneshot for the level-triggered ones.
+ * Poll requests are not passed to a kernel immediately but are queued
+ * in the submission ring and submitted in a single io_uring_enter()
+ * which also waits for completions.
+ *
+ * Listening sockets may instead be served by a number of accept requests
+ * each with its own address buffer, so a single io_uring_enter() accepts
+ * a batch of connections.  Accepted sockets are passed to ngx_event_accept()
+ * via ngx_io_uring_accept().
+ */
+
+
+typedef struct {
+    ngx_uint_t  entries;
+    ngx_uint_t  accept_requests;
+} ngx_io_uring_conf_t;
+
+
+typedef struct ngx_io_uring_accept_s  ngx_io_uring_accept_t;
+
+typedef struct {
+    ngx_io_uring_accept_t     *accept;
+    ngx_socket_t               fd;
+    ngx_err_t                  err;
+    socklen_t                  socklen;
+    ngx_sockaddr_t             sockaddr;
+
+    unsigned                   posted:1;
+    unsigned                   done:1;
+} ngx_io_uring_accept_slot_t;
+
+
+struct ngx_io_uring_accept_s {
+    ngx_io_uring_accept_t     *next;
+    ngx_event_t               *event;
+    ngx_uint_t                 nslots;
+    ngx_io_uring_accept_slot_t slots[1];
+};
+
+
+typedef struct {
+    volatile uint32_t         *head;
+    volatile uint32_t         *tail;
+    uint32_t                   mask;
+    uint32_t                   entries;
+    uint32_t                  *array;
+    struct io_uring_sqe       *sqes;
+} ngx_io_uring_sq_t;
+
+
+typedef struct {
+    volatile uint32_t         *head;
+    volatile uint32_t         *tail;
+    uint32_t                   mask;
+    struct io_uring_cqe       *cqes;
+} ngx_io_uring_cq_t;
+
+
+static ngx_int_t ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_io_uring_setup(ngx_cycle_t *cycle,
+    ngx_io_uring_conf_t *urcf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify_init(ngx_log_t *log);
+static void ngx_io_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_io_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_io_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_io_uring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+
+static ngx_int_t ngx_io_uring_accept_add(ngx_event_t *ev);
+static ngx_int_t ngx_io_uring_accept_del(ngx_event_t *ev, ngx_uint_t flags);
+static ngx_io_uring_accept_t *ngx_io_uring_accept_get(ngx_event_t *ev);
+static ngx_int_t ngx_io_uring_accept_post(ngx_io_uring_accept_slot_t *slot,
+    ngx_log_t *log);
+static void ngx_io_uring_accept_complete(ngx_io_uring_accept_slot_t *slot,
+    int res, ngx_uint_t flags);
+
+static ngx_int_t ngx_io_uring_poll_add(ngx_event_t *ev, ngx_log_t *log);
+static ngx_int_t ngx_io_uring_poll_remove(ngx_event_t *ev, ngx_log_t *log);
+static struct io_uring_sqe *ngx_io_uring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_io_uring_submit(ngx_log_t *log);
+
+static void *ngx_io_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static int                  ring = -1;
+static ngx_io_uring_sq_t    sq;
+static ngx_io_uring_cq_t    cq;
+static uint32_t             sq_tail;
+static uint32_t             nsubmit;
+
+static void                *ring_ptr = MAP_FAILED;
+static size_t               ring_size;
+static void                *sqes_ptr = MAP_FAILED;
+static size_t               sqes_size;
+
+static ngx_uint_t           accept_requests;
+static ngx_io_uring_accept_t  *accepts;
+
+#if (NGX_HAVE_EVENTFD)
+static int                  notify_fd = -1;
+static ngx_event_t          notify_event;
+#endif
+
+
+extern ngx_module_t  ngx_epoll_module;
+
+
+static ngx_str_t      io_uring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_io_uring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, entries),
+      NULL },
+
+    { ngx_string("io_uring_accept_requests"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_io_uring_conf_t, accept_requests),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_io_uring_module_ctx = {
+    &io_uring_name,
+    ngx_io_uring_create_conf,            /* create configuration */
+    ngx_io_uring_init_conf,              /* init configuration */
+
+    {
+        ngx_io_uring_add_event,          /* add an event */
+        ngx_io_uring_del_event,          /* delete an event */
+        ngx_io_uring_add_event,          /* enable an event */
+        ngx_io_uring_del_event,          /* disable an event */
+        NULL,                            /* add an connection */
+        NULL,                            /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_io_uring_notify,             /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_io_uring_process_events,     /* process the events */
+        ngx_io_uring_init,               /* init the events */
+        ngx_io_uring_done,               /* done the events */
+    }
+};
+
+ngx_module_t  ngx_io_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_io_uring_module_ctx,            /* module context */
+    ngx_io_uring_commands,               /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * to avoid dependency on liburing.
+ */
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t size)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, size);
+}
+
+
+static ngx_int_t
+ngx_io_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_event_module_t   *module;
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_io_uring_module);
+
+    if (ring == -1) {
+
+        switch (ngx_io_uring_setup(cycle, urcf)) {
+
+        case NGX_OK:
+            break;
+
+        case NGX_DECLINED:
+            ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                          "io_uring is not supported, using epoll");
+
+            module = ngx_epoll_module.ctx;
+
+            return module->actions.init(cycle, timer);
+
+        default: /* NGX_ERROR */
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_io_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_io_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        ngx_file_aio = 0;
+#endif
+    }
+
+    accept_requests = urcf->accept_requests;
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_io_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT|NGX_USE_GREEDY_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_setup(ngx_cycle_t *cycle, ngx_io_uring_conf_t *urcf)
+{
+    size_t                  cq_size;
+    uint32_t                i;
+    ngx_err_t               err;
+    struct io_uring_params  p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    p.flags = IORING_SETUP_CLAMP;
+
+    ring = io_uring_setup(urcf->entries, &p);
+
+    if (ring == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOSYS || err == NGX_EPERM || err == NGX_EINVAL) {
+            ngx_log_error(NGX_LOG_INFO, cycle->log, err,
+                          "io_uring_setup() failed");
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, err,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    /*
+     * multishot poll requests appeared in Linux 5.13
+     * along with the IORING_FEAT_RSRC_TAGS feature
+     */
+
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0
+        || (p.features & IORING_FEAT_NODROP) == 0
+        || (p.features & IORING_FEAT_EXT_ARG) == 0
+        || (p.features & IORING_FEAT_RSRC_TAGS) == 0)
+    {
+        ngx_log_error(NGX_LOG_INFO, cycle->log, 0,
+                      "io_uring features %08XD are not sufficient",
+                      p.features);
+        goto declined;
+    }
+
+    ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (ring_size < cq_size) {
+        ring_size = cq_size;
+    }
+
+    ring_ptr = mmap(NULL, ring_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (ring_ptr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(%uz, IORING_OFF_SQ_RING) failed", ring_size);
+        goto failed;
+    }
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqes_ptr = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sqes_ptr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(%uz, IORING_OFF_SQES) failed", sqes_size);
+        goto failed;
+    }
+
+    sq.head = (uint32_t *) ((u_char *) ring_ptr + p.sq_off.head);
+    sq.tail = (uint32_t *) ((u_char *) ring_ptr + p.sq_off.tail);
+    sq.mask = *(uint32_t *) ((u_char *) ring_ptr + p.sq_off.ring_mask);
+    sq.entries = p.sq_entries;
+    sq.array = (uint32_t *) ((u_char *) ring_ptr + p.sq_off.array);
+    sq.sqes = sqes_ptr;
+
+    cq.head = (uint32_t *) ((u_char *) ring_ptr + p.cq_off.head);
+    cq.tail = (uint32_t *) ((u_char *) ring_ptr + p.cq_off.tail);
+    cq.mask = *(uint32_t *) ((u_char *) ring_ptr + p.cq_off.ring_mask);
+    cq.cqes = (struct io_uring_cqe *) ((u_char *) ring_ptr + p.cq_off.cqes);
+
+    /* the submission queue entries are always used in order */
+
+    for (i = 0; i < sq.entries; i++) {
+        sq.array[i] = i;
+    }
+
+    sq_tail = *sq.tail;
+    nsubmit = 0;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   ring, p.sq_entries, p.cq_entries);
+
+    return NGX_OK;
+
+declined:
+
+    ngx_io_uring_done(cycle);
+
+    return NGX_DECLINED;
+
+failed:
+
+    ngx_io_uring_done(cycle);
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_io_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    if (ngx_io_uring_poll_add(&notify_event, log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_io_uring_done(ngx_cycle_t *cycle)
+{
+    if (ring != -1 && close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+    if (sqes_ptr != MAP_FAILED && munmap(sqes_ptr, sqes_size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "munmap(%uz) failed", sqes_size);
+    }
+
+    sqes_ptr = MAP_FAILED;
+
+    if (ring_ptr != MAP_FAILED && munmap(ring_ptr, ring_size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "munmap(%uz) failed", ring_size);
+    }
+
+    ring_ptr = MAP_FAILED;
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1 && close(notify_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "eventfd close() failed");
+    }
+
+    notify_fd = -1;
+
+#endif
+
+    nsubmit = 0;
+}
+
+
+static ngx_int_t
+ngx_io_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    if (ev->accept && accept_requests && !ngx_use_accept_mutex
+        && ((ngx_connection_t *) ev->data)->type == SOCK_STREAM)
+    {
+        return ngx_io_uring_accept_add(ev);
+    }
+
+    if (ev->active) {
+        if (ngx_io_uring_poll_remove(ev, ev->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ev->active = 1;
+
+    /*
+     * edge-triggered events are served by a multishot poll request,
+     * level-triggered ones are re-armed after each notification
+     */
+
+    ev->oneshot = (flags & NGX_CLEAR_EVENT) ? 0 : 1;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d w:%d os:%d",
+                   ngx_event_ident(ev->data), ev->write, ev->oneshot);
+
+    return ngx_io_uring_poll_add(ev, ev->log);
+}
+
+
+static ngx_int_t
+ngx_io_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    /*
+     * a poll request holds a reference to the file, so it has to be
+     * removed explicitly even if the file descriptor is going to be closed
+     */
+
+    if (ev->uring_accept) {
+        return ngx_io_uring_accept_del(ev, flags);
+    }
+
+    if (!ev->active) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d w:%d",
+                   ngx_event_ident(ev->data), ev->write);
+
+    ev->active = 0;
+
+    return ngx_io_uring_poll_remove(ev, ev->log);
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_io_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_io_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                              n, res;
+    uint32_t                         head, tail, cflags, wait;
+    uint64_t                         data;
+    ngx_int_t                        instance;
+    ngx_uint_t                       level, events;
+    ngx_err_t                        err;
+    ngx_event_t                     *ev;
+    ngx_queue_t                     *queue;
+    ngx_connection_t                *c;
+    struct io_uring_cqe             *cqe;
+    struct __kernel_timespec         ts;
+    struct io_uring_getevents_arg    arg;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M, submit: %uD", timer, nsubmit);
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+    }
+
+    /* do not wait if there are completions left from the last iteration */
+
+    wait = (*cq.head == *cq.tail) ? 1 : 0;
+
+    n = io_uring_enter(ring, nsubmit, wait,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+#if (NGX_STAT_LOOP)
+    ngx_stat_loop_wakeup(*cq.tail - *cq.head);
+#endif
+
+    if (n > 0) {
+        nsubmit -= ngx_min((uint32_t) n, nsubmit);
+    }
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else if (err == NGX_ETIME || err == NGX_EBUSY
+                   || err == NGX_EAGAIN)
+        {
+            /* timed out or completion queue overflow */
+            level = 0;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        if (level) {
+            ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    head = *cq.head;
+    tail = *cq.tail;
+
+    ngx_memory_barrier();
+
+    for (events = 0; head != tail; /* void */ ) {
+
+        cqe = &cq.cqes[head & cq.mask];
+
+        data = cqe->user_data;
+        res = cqe->res;
+        cflags = cqe->flags;
+
+        ngx_memory_barrier();
+
+        *cq.head = ++head;
+
+        if (data & 2) {
+            ngx_io_uring_accept_complete((ngx_io_uring_accept_slot_t *)
+                                             (uintptr_t) (data & (uint64_t) ~2),
+                                         res, flags);
+            continue;
+        }
+
+        if (data == 0 || res == -NGX_ECANCELED) {
+
+            /* a poll removal result or a removed poll request */
+
+            continue;
+        }
+
+        events++;
+
+        instance = data & 1;
+        ev = (ngx_event_t *) (uintptr_t) (data & (uint64_t) ~1);
+
+#if (NGX_HAVE_EVENTFD)
+
+        if (ev == &notify_event) {
+
+            if (!(cflags & IORING_CQE_F_MORE) && res >= 0) {
+                if (ngx_io_uring_poll_add(ev, cycle->log) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+
+            if (flags & NGX_POST_EVENTS) {
+                ngx_post_event(ev, &ngx_posted_events);
+
+            } else {
+                ev->handler(ev);
+            }
+
+            continue;
+        }
+
+#endif
+
+        c = ev->data;
+
+        if (c->fd == -1 || ev->instance != instance || !ev->active) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", ev);
+            continue;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: fd:%d w:%d res:%d fl:%uD",
+                       c->fd, ev->write, res, cflags);
+
+        if (res < 0) {
+
+            /* the poll request failed, the handler will get the error */
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, -res,
+                           "io_uring poll error on fd:%d w:%d",
+                           c->fd, ev->write);
+            res = EPOLLERR;
+
+        } else if (!(cflags & IORING_CQE_F_MORE)) {
+
+            /*
+             * the poll request is completed: either it was oneshot,
+             * or the multishot one was terminated by the kernel
+             */
+
+            if (ngx_io_uring_poll_add(ev, cycle->log) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        ev->ready = 1;
+
+        if (ev->write) {
+#if (NGX_THREADS)
+            ev->complete = 1;
+#endif
+
+            queue = &ngx_posted_events;
+
+        } else {
+#if (NGX_HAVE_EPOLLRDHUP)
+            if (res & EPOLLRDHUP) {
+                ev->pending_eof = 1;
+            }
+#endif
+
+            ev->available = -1;
+
+            queue = ev->accept ? &ngx_posted_accept_events
+                               : &ngx_posted_events;
+        }
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(ev, queue);
+
+        } else {
+            ev->handler(ev);
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring events: %ui", events);
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_io_uring_accept_add(ngx_event_t *ev)
+{
+    ngx_uint_t                   i, done;
+    ngx_io_uring_accept_t       *a;
+    ngx_io_uring_accept_slot_t  *slot;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add accept: fd:%d n:%ui",
+                   ngx_event_ident(ev->data), accept_requests);
+
+    a = ngx_io_uring_accept_get(ev);
+    if (a == NULL) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+    ev->uring_accept = 1;
+
+    done = 0;
+
+    for (i = 0; i < a->nslots; i++) {
+        slot = &a->slots[i];
+
+        if (slot->done && slot->fd == (ngx_socket_t) -1) {
+
+            /* an error received before the event was disabled */
+
+            slot->done = 0;
+        }
+
+        if (slot->done) {
+            done++;
+            continue;
+        }
+
+        if (!slot->posted) {
+            if (ngx_io_uring_accept_post(slot, ev->log) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (done) {
+
+        /* connections accepted while the event was disabled */
+
+        ev->ready = 1;
+        ev->available = done;
+
+        ngx_post_event(ev, &ngx_posted_accept_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_accept_del(ngx_event_t *ev, ngx_uint_t flags)
+{
+    ngx_uint_t                   i;
+    ngx_io_uring_accept_t       *a;
+    struct io_uring_sqe         *sqe;
+    ngx_io_uring_accept_slot_t  *slot;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del accept: fd:%d fl:%ui",
+                   ngx_event_ident(ev->data), flags);
+
+    a = ngx_io_uring_accept_get(ev);
+    if (a == NULL) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 0;
+
+    for (i = 0; i < a->nslots; i++) {
+        slot = &a->slots[i];
+
+        if (slot->posted) {
+            sqe = ngx_io_uring_get_sqe(ev->log);
+            if (sqe == NULL) {
+                return NGX_ERROR;
+            }
+
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t) slot | 2;
+        }
+
+        if ((flags & NGX_CLOSE_EVENT) && slot->done) {
+
+            if (slot->fd != (ngx_socket_t) -1
+                && ngx_close_socket(slot->fd) == -1)
+            {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_socket_errno,
+                              ngx_close_socket_n " failed");
+            }
+
+            slot->fd = (ngx_socket_t) -1;
+            slot->done = 0;
+        }
+    }
+
+    if (flags & NGX_CLOSE_EVENT) {
+
+        /*
+         * the requests may still complete after the cancellation,
+         * so the slots are kept until their completions are received
+         */
+
+        ev->uring_accept = 0;
+        a->event = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_io_uring_accept_t *
+ngx_io_uring_accept_get(ngx_event_t *ev)
+{
+    size_t                  size;
+    ngx_uint_t              i, busy;
+    ngx_io_uring_accept_t  *a, *unused;
+
+    unused = NULL;
+
+    for (a = accepts; a; a = a->next) {
+
+        if (a->event == ev) {
+            return a;
+        }
+
+        if (a->event || a->nslots != accept_requests || unused) {
+            continue;
+        }
+
+        busy = 0;
+
+        for (i = 0; i < a->nslots; i++) {
+            if (a->slots[i].posted) {
+                busy = 1;
+                break;
+            }
+        }
+
+        if (!busy) {
+            unused = a;
+        }
+    }
+
+    a = unused;
+
+    if (a == NULL) {
+
+        /*
+         * the slots are referenced by the requests in the kernel
+         * and may outlive the cycle, hence they are not allocated
+         * from the cycle pool
+         */
+
+        size = offsetof(ngx_io_uring_accept_t, slots)
+               + accept_requests * sizeof(ngx_io_uring_accept_slot_t);
+
+        a = ngx_alloc(size, ev->log);
+        if (a == NULL) {
+            return NULL;
+        }
+
+        ngx_memzero(a, size);
+
+        a->nslots = accept_requests;
+
+        for (i = 0; i < a->nslots; i++) {
+            a->slots[i].accept = a;
+            a->slots[i].fd = (ngx_socket_t) -1;
+        }
+
+        a->next = accepts;
+        accepts = a;
+    }
+
+    a->event = ev;
+
+    return a;
+}
+
+
+static ngx_int_t
+ngx_io_uring_accept_post(ngx_io_uring_accept_slot_t *slot, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    slot->socklen = sizeof(ngx_sockaddr_t);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ((ngx_connection_t *) slot->accept->event->data)->fd;
+    sqe->addr = (uintptr_t) &slot->sockaddr;
+    sqe->addr2 = (uintptr_t) &slot->socklen;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = (uintptr_t) slot | 2;
+
+    slot->posted = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_io_uring_accept_complete(ngx_io_uring_accept_slot_t *slot, int res,
+    ngx_uint_t flags)
+{
+    ngx_event_t  *ev;
+
+    slot->posted = 0;
+
+    ev = slot->accept->event;
+
+    if (res == -NGX_ECANCELED) {
+
+        /* the event may be enabled again before the cancellation completes */
+
+        if (ev && ev->active) {
+            (void) ngx_io_uring_accept_post(slot, ev->log);
+        }
+
+        return;
+    }
+
+    if (ev == NULL) {
+
+        /* the listening socket was closed */
+
+        if (res >= 0 && ngx_close_socket(res) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " failed");
+        }
+
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring accept: fd:%d res:%d",
+                   ngx_event_ident(ev->data), res);
+
+    if (res >= 0) {
+        slot->fd = res;
+        slot->err = 0;
+
+    } else {
+        slot->fd = (ngx_socket_t) -1;
+        slot->err = -res;
+    }
+
+    slot->done = 1;
+
+    if (!ev->active) {
+        return;
+    }
+
+    ev->ready = 1;
+
+    if (flags & NGX_POST_EVENTS) {
+        ngx_post_event(ev, &ngx_posted_accept_events);
+
+    } else {
+        ev->handler(ev);
+    }
+}
+
+
+ngx_socket_t
+ngx_io_uring_accept(ngx_event_t *ev, struct sockaddr *sockaddr,
+    socklen_t *socklen)
+{
+    ngx_err_t                    err;
+    ngx_uint_t                   i;
+    ngx_socket_t                 s;
+    ngx_io_uring_accept_t       *a;
+    ngx_io_uring_accept_slot_t  *slot, *found;
+
+    a = ngx_io_uring_accept_get(ev);
+    if (a == NULL) {
+        ngx_set_socket_errno(NGX_ENOMEM);
+        return (ngx_socket_t) -1;
+    }
+
+    /* accepted sockets are returned first, errors are reported once */
+
+    found = NULL;
+    ev->available = 0;
+
+    for (i = 0; i < a->nslots; i++) {
+        slot = &a->slots[i];
+
+        if (!slot->done) {
+            continue;
+        }
+
+        if (slot->fd == (ngx_socket_t) -1) {
+            if (found == NULL) {
+                found = slot;
+            }
+
+            continue;
+        }
+
+        if (found == NULL || found->fd == (ngx_socket_t) -1) {
+            found = slot;
+            continue;
+        }
+
+        ev->available++;
+    }
+
+    if (found == NULL) {
+        ngx_set_socket_errno(NGX_EAGAIN);
+        return (ngx_socket_t) -1;
+    }
+
+    s = found->fd;
+    err = found->err;
+
+    if (s != (ngx_socket_t) -1) {
+        *socklen = ngx_min(*socklen, found->socklen);
+        ngx_memcpy(sockaddr, &found->sockaddr, *socklen);
+
+        found->fd = (ngx_socket_t) -1;
+    }
+
+    for (i = 0; i < a->nslots; i++) {
+        slot = &a->slots[i];
+
+        if (slot != found
+            && (s != (ngx_socket_t) -1 || !slot->done
+                || slot->fd != (ngx_socket_t) -1))
+        {
+            continue;
+        }
+
+        slot->done = 0;
+
+        if (ev->active && ngx_io_uring_accept_post(slot, ev->log) != NGX_OK) {
+            ev->active = 0;
+        }
+    }
+
+    if (s == (ngx_socket_t) -1) {
+        ngx_set_socket_errno(err);
+    }
+
+    return s;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_add(ngx_event_t *ev, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->user_data = (uintptr_t) ev | ev->instance;
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (ev == &notify_event) {
+        sqe->fd = notify_fd;
+        sqe->poll32_events = EPOLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+
+        return NGX_OK;
+    }
+
+#endif
+
+    sqe->fd = ((ngx_connection_t *) ev->data)->fd;
+    sqe->poll32_events = ev->write ? EPOLLOUT : EPOLLIN|EPOLLRDHUP;
+    sqe->len = ev->oneshot ? 0 : IORING_POLL_ADD_MULTI;
+
+    /* remember the request to cancel it if it was not submitted yet */
+
+    ev->index = sq_tail - 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_io_uring_poll_remove(ngx_event_t *ev, ngx_log_t *log)
+{
+    uint64_t              data;
+    struct io_uring_sqe  *sqe;
+
+    data = (uintptr_t) ev | ev->instance;
+
+    if ((uint32_t) (sq_tail - ev->index - 1) < nsubmit) {
+
+        sqe = &sq.sqes[ev->index & sq.mask];
+
+        if (sqe->opcode == IORING_OP_POLL_ADD && sqe->user_data == data) {
+
+            /* the poll request is still not passed to a kernel */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                           "io_uring poll cancelled: %p", ev);
+
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0;
+
+            ev->index = NGX_INVALID_INDEX;
+
+            return NGX_OK;
+        }
+    }
+
+    sqe = ngx_io_uring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = data;
+
+    ev->index = NGX_INVALID_INDEX;
+
+    return NGX_OK;
+}
+
+
+static struct io_uring_sqe *
+ngx_io_uring_get_sqe(ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    if (sq_tail - *sq.head >= sq.entries) {
+
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "io_uring submission queue is filled up");
+
+        if (ngx_io_uring_submit(log) != NGX_OK) {
+            return NULL;
+        }
+    }
+
+    sqe = &sq.sqes[sq_tail & sq.mask];
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    sq_tail++;
+    nsubmit++;
+
+    ngx_memory_barrier();
+
+    *sq.tail = sq_tail;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_io_uring_submit(ngx_log_t *log)
+{
+    int  n;
+
+    n = io_uring_enter(ring, nsubmit, 0, 0, NULL, 0);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    nsubmit -= ngx_min((uint32_t) n, nsubmit);
+
+    if (sq_tail - *sq.head >= sq.entries) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "io_uring submission queue is full");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_io_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_io_uring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_io_uring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+    urcf->accept_requests = NGX_CONF_UNSET;
+
+    return urcf;
+}
+
+
+static char *
+ngx_io_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_io_uring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 1024);
+    ngx_conf_init_uint_value(urcf->accept_requests, 0);
+
+    return NGX_CONF_OK;
+}
@@ -537,6 +537,10 @@ ngx_kqueue_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
 
     err = (events == -1) ? ngx_errno : 0;
 
+#if (NGX_STAT_LOOP)
+    ngx_stat_loop_wakeup((events > 0) ? (ngx_uint_t) events : 0);
+#endif
+
     if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
         ngx_time_update();
     }
@@ -264,6 +264,10 @@ ngx_select_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
 
     err = (ready == -1) ? ngx_errno : 0;
 
+#if (NGX_STAT_LOOP)
+    ngx_stat_loop_wakeup((ready > 0) ? (ngx_uint_t) ready : 0);
+#endif
+
     if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
         ngx_time_update();
     }
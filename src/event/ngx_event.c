@@ -78,6 +78,22 @@ ngx_atomic_t         *ngx_stat_waiting = &ngx_stat_waiting0;
 #endif
 
 
+#if (NGX_STAT_LOOP)
+
+static ngx_stat_loop_t   ngx_stat_loop0;
+ngx_stat_loop_t         *ngx_stat_loop = &ngx_stat_loop0;
+ngx_uint_t               ngx_stat_loop_n = 1;
+
+static ngx_stat_loop_t  *ngx_stat_loop_worker;
+static uint64_t          ngx_stat_loop_wakeup_time;
+static ngx_uint_t        ngx_stat_loop_events;
+
+static uint64_t ngx_stat_loop_time(void);
+static void ngx_stat_loop_add(ngx_stat_histogram_t *h, uint64_t value);
+
+#endif
+
+
 
 static ngx_command_t  ngx_events_commands[] = {
 
@@ -141,6 +157,13 @@ static ngx_command_t  ngx_event_core_commands[] = {
       offsetof(ngx_event_conf_t, multi_accept),
       NULL },
 
+    { ngx_string("timer_wheel"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, timer_wheel),
+      NULL },
+
     { ngx_string("accept_mutex"),
       NGX_EVENT_CONF|NGX_CONF_FLAG,
       ngx_conf_set_flag_slot,
@@ -196,6 +219,9 @@ ngx_process_events_and_timers(ngx_cycle_t *cycle)
 {
     ngx_uint_t  flags;
     ngx_msec_t  timer, delta;
+#if (NGX_STAT_LOOP)
+    uint64_t    posted, expired, done;
+#endif
 
     if (ngx_timer_resolution) {
         timer = NGX_TIMER_INFINITE;
@@ -245,6 +271,10 @@ ngx_process_events_and_timers(ngx_cycle_t *cycle)
 
     delta = ngx_current_msec;
 
+#if (NGX_STAT_LOOP)
+    ngx_stat_loop_wakeup_time = 0;
+#endif
+
     (void) ngx_process_events(cycle, timer, flags);
 
     delta = ngx_current_msec - delta;
@@ -252,18 +282,114 @@ ngx_process_events_and_timers(ngx_cycle_t *cycle)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
                    "timer delta: %M", delta);
 
+#if (NGX_STAT_LOOP)
+    posted = ngx_stat_loop_time();
+#endif
+
     ngx_event_process_posted(cycle, &ngx_posted_accept_events);
 
     if (ngx_accept_mutex_held) {
         ngx_shmtx_unlock(&ngx_accept_mutex);
     }
 
+#if (NGX_STAT_LOOP)
+    expired = ngx_stat_loop_time();
+#endif
+
     ngx_event_expire_timers();
 
+#if (NGX_STAT_LOOP)
+    done = ngx_stat_loop_time();
+    posted = expired - posted;
+    expired = done - expired;
+#endif
+
     ngx_event_process_posted(cycle, &ngx_posted_events);
+
+#if (NGX_STAT_LOOP)
+
+    if (ngx_stat_loop_worker && !ngx_exiting) {
+        ngx_stat_loop_add(&ngx_stat_loop_worker->timers, expired);
+
+        done = ngx_stat_loop_time() - done;
+        ngx_stat_loop_add(&ngx_stat_loop_worker->posted, posted + done);
+
+        if (ngx_stat_loop_wakeup_time) {
+            done = ngx_stat_loop_time() - ngx_stat_loop_wakeup_time;
+            ngx_stat_loop_add(&ngx_stat_loop_worker->busy, done);
+            ngx_stat_loop_add(&ngx_stat_loop_worker->events,
+                              ngx_stat_loop_events);
+        }
+    }
+
+#endif
+}
+
+
+#if (NGX_STAT_LOOP)
+
+void
+ngx_stat_loop_wakeup(ngx_uint_t events)
+{
+    ngx_stat_loop_wakeup_time = ngx_stat_loop_time();
+    ngx_stat_loop_events = events;
+}
+
+
+static uint64_t
+ngx_stat_loop_time(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+#else
+    struct timeval   tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
 }
 
 
+static void
+ngx_stat_loop_add(ngx_stat_histogram_t *h, uint64_t value)
+{
+    ngx_uint_t  n, msb;
+
+    if (value < 4) {
+        n = (ngx_uint_t) value;
+
+    } else {
+        for (msb = 2; msb < 31 && (value >> (msb + 1)); msb++) {
+            /* void */
+        }
+
+        n = (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+
+        if (n >= NGX_STAT_LOOP_BUCKETS) {
+            n = NGX_STAT_LOOP_BUCKETS - 1;
+        }
+    }
+
+    /* each worker updates its own histograms only */
+
+    h->buckets[n]++;
+    h->count++;
+    h->sum += value;
+
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+#endif
+
+
 ngx_int_t
 ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags)
 {
@@ -565,6 +691,12 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_writing */
            + cl;         /* ngx_stat_waiting */
 
+#endif
+
+#if (NGX_STAT_LOOP)
+
+    size += ngx_align(ccf->worker_processes * sizeof(ngx_stat_loop_t), cl);
+
 #endif
 
     shm.size = size;
@@ -611,6 +743,15 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
 
+#endif
+
+#if (NGX_STAT_LOOP)
+
+    ngx_stat_loop = (ngx_stat_loop_t *) (shared + size
+                        - ngx_align(ccf->worker_processes
+                                    * sizeof(ngx_stat_loop_t), cl));
+    ngx_stat_loop_n = ccf->worker_processes;
+
 #endif
 
     return NGX_OK;
@@ -672,6 +813,23 @@ ngx_event_process_init(ngx_cycle_t *cycle)
     ngx_queue_init(&ngx_posted_next_events);
     ngx_queue_init(&ngx_posted_events);
 
+    ngx_use_timer_wheel = ecf->timer_wheel;
+
+#if (NGX_STAT_LOOP)
+
+    if ((ngx_process == NGX_PROCESS_WORKER && ngx_worker < ngx_stat_loop_n)
+        || ngx_process == NGX_PROCESS_SINGLE)
+    {
+        ngx_stat_loop_worker = &ngx_stat_loop[ngx_worker];
+        ngx_memzero(ngx_stat_loop_worker, sizeof(ngx_stat_loop_t));
+        ngx_stat_loop_worker->pid = ngx_pid;
+
+    } else {
+        ngx_stat_loop_worker = NULL;
+    }
+
+#endif
+
     if (ngx_event_timer_init(cycle->log) == NGX_ERROR) {
         return NGX_ERROR;
     }
@@ -1267,6 +1425,7 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->connections = NGX_CONF_UNSET_UINT;
     ecf->use = NGX_CONF_UNSET_UINT;
     ecf->multi_accept = NGX_CONF_UNSET;
+    ecf->timer_wheel = NGX_CONF_UNSET;
     ecf->accept_mutex = NGX_CONF_UNSET;
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
     ecf->name = (void *) NGX_CONF_UNSET;
@@ -1366,6 +1525,7 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_ptr_value(ecf->name, event_module->name->data);
 
     ngx_conf_init_value(ecf->multi_accept, 0);
+    ngx_conf_init_value(ecf->timer_wheel, 0);
     ngx_conf_init_value(ecf->accept_mutex, 0);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
 
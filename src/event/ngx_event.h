@@ -58,6 +58,7 @@ struct ngx_event_s {
 
     unsigned         timedout:1;
     unsigned         timer_set:1;
+    unsigned         timer_wheel:1;
 
     unsigned         delayed:1;
 
@@ -83,9 +84,15 @@ struct ngx_event_s {
     int              kq_errno;
 #endif
 
+#if (NGX_HAVE_IO_URING)
+    /* the connections are accepted by io_uring requests */
+    unsigned         uring_accept:1;
+#endif
+
     /*
      * kqueue only:
-     *   accept:     number of sockets that wait to be accepted
+     *   accept:     number of sockets that wait to be accepted,
+     *               also used by io_uring accept requests
      *   read:       bytes to read when event is ready
      *               or lowat when event is set with NGX_LOWAT_EVENT flag
      *   write:      available space in buffer when event is ready
@@ -431,6 +438,7 @@ typedef struct {
     ngx_uint_t    use;
 
     ngx_flag_t    multi_accept;
+    ngx_flag_t    timer_wheel;
     ngx_flag_t    accept_mutex;
 
     ngx_msec_t    accept_mutex_delay;
@@ -478,6 +486,41 @@ extern ngx_atomic_t  *ngx_stat_waiting;
 #endif
 
 
+#if (NGX_STAT_LOOP)
+
+/*
+ * log-linear histogram: values below 4 have their own buckets,
+ * each next power of two is split into 4 buckets
+ */
+
+#define NGX_STAT_LOOP_BUCKETS  124
+
+
+typedef struct {
+    ngx_atomic_t          count;
+    ngx_atomic_t          sum;
+    ngx_atomic_t          max;
+    ngx_atomic_t          buckets[NGX_STAT_LOOP_BUCKETS];
+} ngx_stat_histogram_t;
+
+
+typedef struct {
+    ngx_atomic_t          pid;
+    ngx_stat_histogram_t  busy;      /* microseconds from wakeup to wait */
+    ngx_stat_histogram_t  posted;    /* microseconds in posted events */
+    ngx_stat_histogram_t  timers;    /* microseconds in timers expiration */
+    ngx_stat_histogram_t  events;    /* events per wakeup */
+} ngx_stat_loop_t;
+
+
+void ngx_stat_loop_wakeup(ngx_uint_t events);
+
+extern ngx_stat_loop_t  *ngx_stat_loop;
+extern ngx_uint_t        ngx_stat_loop_n;
+
+#endif
+
+
 #define NGX_UPDATE_TIME         1
 #define NGX_POST_EVENTS         2
 
@@ -517,6 +560,12 @@ u_char *ngx_acceptex_log_error(ngx_log_t *log, u_char *buf, size_t len);
 ngx_int_t ngx_send_lowat(ngx_connection_t *c, size_t lowat);
 
 
+#if (NGX_HAVE_IO_URING)
+ngx_socket_t ngx_io_uring_accept(ngx_event_t *ev, struct sockaddr *sockaddr,
+    socklen_t *socklen);
+#endif
+
+
 /* used in ngx_log_debugX() */
 #define ngx_event_ident(p)  ((ngx_connection_t *) (p))->fd
 
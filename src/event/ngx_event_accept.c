@@ -58,6 +58,11 @@ ngx_event_accept(ngx_event_t *ev)
     do {
         socklen = sizeof(ngx_sockaddr_t);
 
+#if (NGX_HAVE_IO_URING)
+        if (ev->uring_accept) {
+            s = ngx_io_uring_accept(ev, &sa.sockaddr, &socklen);
+        } else
+#endif
 #if (NGX_HAVE_ACCEPT4)
         if (use_accept4) {
             s = accept4(lc->fd, &sa.sockaddr, &socklen, SOCK_NONBLOCK);
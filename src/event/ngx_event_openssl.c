@@ -1502,6 +1502,32 @@ ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 }
 
 
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
+    }
+
+#if (defined SSL_OP_ENABLE_KTLS && !NGX_WIN32)
+
+    /*
+     * OpenSSL switches the connection to kernel TLS for sending and,
+     * where supported by the kernel and the library, for receiving
+     * as soon as the keys are negotiated
+     */
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "kernel TLS is not supported on this platform, ignored");
+#endif
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *commands)
 {
@@ -1769,6 +1795,16 @@ ngx_ssl_handshake(ngx_connection_t *c)
             c->ssl->sendfile = 1;
         }
 
+#endif
+
+#if (defined BIO_get_ktls_recv && !NGX_WIN32)
+
+        if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)) == 1) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "BIO_get_ktls_recv(): 1");
+            c->ssl->ktls_recv = 1;
+        }
+
 #endif
 
         rc = ngx_ssl_ocsp_validate(c);
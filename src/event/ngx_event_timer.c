@@ -13,6 +13,21 @@
 ngx_rbtree_t              ngx_event_timer_rbtree;
 static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 
+ngx_uint_t                ngx_use_timer_wheel;
+
+/*
+ * the timer wheel slots are circular lists linked via the left (next)
+ * and right (prev) pointers of the timer nodes; the timers of a slot are
+ * moved to the rbtree when the slot start is less than one slot ahead
+ */
+
+static ngx_rbtree_node_t  ngx_event_timer_wheel[NGX_TIMER_WHEEL_SIZE];
+static ngx_uint_t         ngx_event_timer_wheel_n;
+static ngx_msec_t         ngx_event_timer_wheel_next;
+
+
+static void ngx_event_wheel_move_timers(void);
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -22,9 +37,20 @@ static ngx_rbtree_node_t  ngx_event_timer_sentinel;
 ngx_int_t
 ngx_event_timer_init(ngx_log_t *log)
 {
+    ngx_uint_t  i;
+
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    for (i = 0; i < NGX_TIMER_WHEEL_SIZE; i++) {
+        ngx_event_timer_wheel[i].left = &ngx_event_timer_wheel[i];
+        ngx_event_timer_wheel[i].right = &ngx_event_timer_wheel[i];
+    }
+
+    ngx_event_timer_wheel_n = 0;
+
+    ngx_event_wheel_move_timers();
+
     return NGX_OK;
 }
 
@@ -32,11 +58,26 @@ ngx_event_timer_init(ngx_log_t *log)
 ngx_msec_t
 ngx_event_find_timer(void)
 {
-    ngx_msec_int_t      timer;
+    ngx_msec_int_t      timer, wheel;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel_n) {
+
+        /* the time to move the next wheel slot to the rbtree */
+
+        wheel = (ngx_msec_int_t) (ngx_event_timer_wheel_next
+                                  - (1 << NGX_TIMER_WHEEL_SHIFT)
+                                  - ngx_current_msec);
+        if (wheel < 0) {
+            wheel = 0;
+        }
+
+    } else {
+        wheel = -1;
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
-        return NGX_TIMER_INFINITE;
+        return (wheel == -1) ? NGX_TIMER_INFINITE : (ngx_msec_t) wheel;
     }
 
     root = ngx_event_timer_rbtree.root;
@@ -46,7 +87,15 @@ ngx_event_find_timer(void)
 
     timer = (ngx_msec_int_t) (node->key - ngx_current_msec);
 
-    return (ngx_msec_t) (timer > 0 ? timer : 0);
+    if (timer < 0) {
+        timer = 0;
+    }
+
+    if (wheel != -1 && wheel < timer) {
+        timer = wheel;
+    }
+
+    return (ngx_msec_t) timer;
 }
 
 
@@ -56,6 +105,8 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    ngx_event_wheel_move_timers();
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -99,8 +150,21 @@ ngx_event_expire_timers(void)
 ngx_int_t
 ngx_event_no_timers_left(void)
 {
+    ngx_uint_t          i;
     ngx_event_t        *ev;
-    ngx_rbtree_node_t  *node, *root, *sentinel;
+    ngx_rbtree_node_t  *node, *root, *sentinel, *head;
+
+    for (i = 0; ngx_event_timer_wheel_n && i < NGX_TIMER_WHEEL_SIZE; i++) {
+        head = &ngx_event_timer_wheel[i];
+
+        for (node = head->left; node != head; node = node->left) {
+            ev = ngx_rbtree_data(node, ngx_event_t, timer);
+
+            if (!ev->cancelable) {
+                return NGX_AGAIN;
+            }
+        }
+    }
 
     sentinel = ngx_event_timer_rbtree.sentinel;
     root = ngx_event_timer_rbtree.root;
@@ -124,3 +188,94 @@ ngx_event_no_timers_left(void)
 
     return NGX_OK;
 }
+
+
+void
+ngx_event_wheel_add_timer(ngx_event_t *ev)
+{
+    ngx_rbtree_node_t  *node, *head;
+
+    head = &ngx_event_timer_wheel[(ev->timer.key >> NGX_TIMER_WHEEL_SHIFT)
+                                  & (NGX_TIMER_WHEEL_SIZE - 1)];
+    node = &ev->timer;
+
+    node->left = head->left;
+    node->right = head;
+    head->left->right = node;
+    head->left = node;
+
+    ev->timer_wheel = 1;
+    ngx_event_timer_wheel_n++;
+}
+
+
+void
+ngx_event_wheel_del_timer(ngx_event_t *ev)
+{
+    ngx_rbtree_node_t  *node;
+
+    node = &ev->timer;
+
+    node->right->left = node->left;
+    node->left->right = node->right;
+
+    ev->timer_wheel = 0;
+    ngx_event_timer_wheel_n--;
+}
+
+
+static void
+ngx_event_wheel_move_timers(void)
+{
+    ngx_msec_t          limit, slot;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node, *next, *head;
+
+    slot = 1 << NGX_TIMER_WHEEL_SHIFT;
+    limit = ngx_current_msec + slot;
+
+    if (ngx_event_timer_wheel_n == 0) {
+        ngx_event_timer_wheel_next = (limit & ~(slot - 1)) + slot;
+        return;
+    }
+
+    if ((ngx_msec_int_t) (limit - ngx_event_timer_wheel_next)
+        >= (ngx_msec_int_t) (NGX_TIMER_WHEEL_SIZE * slot))
+    {
+        /* each slot is checked at most once */
+
+        ngx_event_timer_wheel_next = (limit & ~(slot - 1))
+                                     - (NGX_TIMER_WHEEL_SIZE - 1) * slot;
+    }
+
+    while ((ngx_msec_int_t) (limit - ngx_event_timer_wheel_next) >= 0) {
+
+        head = &ngx_event_timer_wheel[(ngx_event_timer_wheel_next
+                                       >> NGX_TIMER_WHEEL_SHIFT)
+                                      & (NGX_TIMER_WHEEL_SIZE - 1)];
+
+        for (node = head->left; node != head; node = next) {
+            next = node->left;
+
+            /* the slot may also contain timers of the next wheel turns */
+
+            if ((ngx_msec_int_t) (node->key - ngx_event_timer_wheel_next)
+                >= (ngx_msec_int_t) slot)
+            {
+                continue;
+            }
+
+            ev = ngx_rbtree_data(node, ngx_event_t, timer);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer move: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_wheel_del_timer(ev);
+
+            ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+        }
+
+        ngx_event_timer_wheel_next += slot;
+    }
+}
@@ -18,14 +18,21 @@
 
 #define NGX_TIMER_LAZY_DELAY  300
 
+#define NGX_TIMER_WHEEL_SHIFT  10
+#define NGX_TIMER_WHEEL_SIZE   512
+#define NGX_TIMER_WHEEL_MIN    (2 << NGX_TIMER_WHEEL_SHIFT)
+
 
 ngx_int_t ngx_event_timer_init(ngx_log_t *log);
 ngx_msec_t ngx_event_find_timer(void);
 void ngx_event_expire_timers(void);
 ngx_int_t ngx_event_no_timers_left(void);
+void ngx_event_wheel_add_timer(ngx_event_t *ev);
+void ngx_event_wheel_del_timer(ngx_event_t *ev);
 
 
 extern ngx_rbtree_t  ngx_event_timer_rbtree;
+extern ngx_uint_t    ngx_use_timer_wheel;
 
 
 static ngx_inline void
@@ -35,7 +42,12 @@ ngx_event_del_timer(ngx_event_t *ev)
                    "event timer del: %d: %M",
                     ngx_event_ident(ev->data), ev->timer.key);
 
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    if (ev->timer_wheel) {
+        ngx_event_wheel_del_timer(ev);
+
+    } else {
+        ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
 #if (NGX_DEBUG)
     ev->timer.left = NULL;
@@ -81,7 +93,17 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
                    "event timer add: %d: %M:%M",
                     ngx_event_ident(ev->data), timer, ev->timer.key);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    /*
+     * long timers are kept in the timer wheel with O(1) insertion
+     * and deletion, and are moved to the rbtree shortly before expiration
+     */
+
+    if (ngx_use_timer_wheel && timer >= NGX_TIMER_WHEEL_MIN) {
+        ngx_event_wheel_add_timer(ev);
+
+    } else {
+        ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
     ev->timer_set = 1;
 }
@@ -0,0 +1,230 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_CACHE_STATUS_ZONE_LEN                                       \
+    (sizeof("\"\":{\"policy\":\"tinylfu\",\"shards\":,\"cold\":,\"size\":,"  \
+            "\"max_size\":,\"entries\":,\"memory_size\":,\"hits\":,"         \
+            "\"misses\":,\"rejected\":,\"evicted\":,"                        \
+            "\"packed\":{\"segments\":,\"size\":,\"live\":},"                \
+            "\"manager\":{\"queue\":,\"deleted\":},"                         \
+            "\"refresh\":{\"active\":,\"started\":}},") - 1                  \
+     + 2 + 4 * NGX_OFF_T_LEN + 12 * NGX_ATOMIC_T_LEN)
+
+
+static ngx_int_t ngx_http_cache_status_handler(ngx_http_request_t *r);
+static char *ngx_http_set_cache_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_cache_status_commands[] = {
+
+    { ngx_string("cache_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_set_cache_status,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_cache_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_cache_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_cache_status_module_ctx,     /* module context */
+    ngx_http_cache_status_commands,        /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_cache_status_handler(ngx_http_request_t *r)
+{
+    off_t                           size, packed_size, packed_live;
+    size_t                          len, memory_size;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      i, n, count, hits, misses, rejected,
+                                    evicted, segments;
+    ngx_path_t                    **path;
+    ngx_chain_t                     out;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_shard_t    *shard;
+    ngx_http_file_cache_segment_t  *seg;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("application/json") - 1;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_lowcase = NULL;
+
+    path = ngx_cycle->paths.elts;
+
+    len = sizeof("{\"caches\":{}}\n") - 1;
+
+    for (i = 0; i < ngx_cycle->paths.nelts; i++) {
+        cache = ngx_http_file_cache_from_path(path[i]);
+
+        if (cache) {
+            len += NGX_HTTP_CACHE_STATUS_ZONE_LEN
+                   + cache->shm_zone->shm.name.len;
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    b->last = ngx_cpymem(b->last, "{\"caches\":{", sizeof("{\"caches\":{") - 1);
+
+    for (i = 0; i < ngx_cycle->paths.nelts; i++) {
+        cache = ngx_http_file_cache_from_path(path[i]);
+
+        if (cache == NULL) {
+            continue;
+        }
+
+        size = 0;
+        memory_size = 0;
+        count = 0;
+        hits = 0;
+        misses = 0;
+        rejected = 0;
+        evicted = 0;
+
+        for (n = 0; n < cache->nshards; n++) {
+            shard = &cache->shards[n];
+
+            ngx_shmtx_lock(&shard->shpool->mutex);
+
+            size += shard->sh->size;
+            memory_size += shard->sh->memory_size;
+            count += shard->sh->count;
+            hits += shard->sh->hits;
+            misses += shard->sh->misses;
+            rejected += shard->sh->rejected;
+            evicted += shard->sh->evicted;
+
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+        }
+
+        segments = 0;
+        packed_size = 0;
+        packed_live = 0;
+
+        if (cache->packed) {
+            ngx_shmtx_lock(&cache->shpool->mutex);
+
+            for (n = 0; n < cache->packed->nsegments; n++) {
+                seg = &cache->packed->segments[n];
+
+                if (seg->id) {
+                    segments++;
+                    packed_size += seg->size;
+                    packed_live += seg->live;
+                }
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+        }
+
+        b->last = ngx_sprintf(b->last, "\"%V\":{\"policy\":\"%s\","
+                              "\"shards\":%ui,\"cold\":%d,\"size\":%O,"
+                              "\"max_size\":%O,\"entries\":%ui,"
+                              "\"memory_size\":%uz,\"hits\":%ui,"
+                              "\"misses\":%ui,\"rejected\":%ui,"
+                              "\"evicted\":%ui,\"packed\":{\"segments\":%ui,"
+                              "\"size\":%O,\"live\":%O},"
+                              "\"manager\":{\"queue\":%uA,\"deleted\":%uA},"
+                              "\"refresh\":{\"active\":%uA,\"started\":%uA}},",
+                              &cache->shm_zone->shm.name,
+                              cache->policy == NGX_HTTP_CACHE_POLICY_TINYLFU
+                              ? "tinylfu" : "lru",
+                              cache->nshards, cache->sh->cold ? 1 : 0,
+                              size * cache->bsize,
+                              cache->max_size * cache->bsize,
+                              count, memory_size,
+                              hits, misses, rejected, evicted,
+                              segments, packed_size, packed_live,
+                              cache->sh->manager_queue,
+                              cache->sh->manager_deleted,
+                              cache->sh->refresh_active,
+                              cache->sh->refresh_started);
+    }
+
+    if (b->last[-1] == ',') {
+        b->last--;
+    }
+
+    b->last = ngx_cpymem(b->last, "}}\n", sizeof("}}\n") - 1);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static char *
+ngx_http_set_cache_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_cache_status_handler;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,200 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_LOOP_STATUS_HISTOGRAM_LEN                                   \
+    (sizeof("\"\":{\"count\":,\"sum\":,\"max\":,\"buckets\":[]},") - 1        \
+     + sizeof("timers") - 1 + 3 * NGX_ATOMIC_T_LEN                            \
+     + NGX_STAT_LOOP_BUCKETS * (sizeof("[,],") - 1 + 2 * NGX_ATOMIC_T_LEN))
+
+
+static ngx_int_t ngx_http_loop_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_loop_status_histogram(u_char *p, char *name,
+    ngx_stat_histogram_t *h);
+static char *ngx_http_set_loop_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_loop_status_commands[] = {
+
+    { ngx_string("loop_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_set_loop_status,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_loop_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_loop_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_loop_status_module_ctx,      /* module context */
+    ngx_http_loop_status_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_loop_status_handler(ngx_http_request_t *r)
+{
+    size_t            size;
+    ngx_int_t         rc;
+    ngx_buf_t        *b;
+    ngx_uint_t        i;
+    ngx_chain_t       out;
+    ngx_stat_loop_t  *sl;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("application/json") - 1;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_lowcase = NULL;
+
+    size = sizeof("{\"workers\":[]}\n") - 1
+           + ngx_stat_loop_n * (sizeof("{\"worker\":,\"pid\":},") - 1
+                                + 2 * NGX_ATOMIC_T_LEN
+                                + 4 * NGX_HTTP_LOOP_STATUS_HISTOGRAM_LEN);
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    b->last = ngx_cpymem(b->last, "{\"workers\":[",
+                         sizeof("{\"workers\":[") - 1);
+
+    for (i = 0; i < ngx_stat_loop_n; i++) {
+        sl = &ngx_stat_loop[i];
+
+        if (sl->pid == 0) {
+            continue;
+        }
+
+        b->last = ngx_sprintf(b->last, "{\"worker\":%ui,\"pid\":%uA,", i,
+                              sl->pid);
+
+        b->last = ngx_http_loop_status_histogram(b->last, "busy", &sl->busy);
+        b->last = ngx_http_loop_status_histogram(b->last, "posted",
+                                                 &sl->posted);
+        b->last = ngx_http_loop_status_histogram(b->last, "timers",
+                                                 &sl->timers);
+        b->last = ngx_http_loop_status_histogram(b->last, "events",
+                                                 &sl->events);
+
+        b->last[-1] = '}';
+        *b->last++ = ',';
+    }
+
+    if (b->last[-1] == ',') {
+        b->last--;
+    }
+
+    b->last = ngx_cpymem(b->last, "]}\n", sizeof("]}\n") - 1);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static u_char *
+ngx_http_loop_status_histogram(u_char *p, char *name, ngx_stat_histogram_t *h)
+{
+    uint64_t      min;
+    ngx_uint_t    i;
+    ngx_atomic_t  n;
+
+    p = ngx_sprintf(p, "\"%s\":{\"count\":%uA,\"sum\":%uA,\"max\":%uA,"
+                    "\"buckets\":[", name, h->count, h->sum, h->max);
+
+    /* only non-empty buckets are shown with their lower bounds */
+
+    for (i = 0; i < NGX_STAT_LOOP_BUCKETS; i++) {
+        n = h->buckets[i];
+
+        if (n == 0) {
+            continue;
+        }
+
+        if (i < 4) {
+            min = i;
+
+        } else {
+            min = (uint64_t) (4 + i % 4) << (i / 4 - 1);
+        }
+
+        p = ngx_sprintf(p, "[%uL,%uA],", min, n);
+    }
+
+    if (p[-1] == ',') {
+        p--;
+    }
+
+    return ngx_cpymem(p, "]},", sizeof("]},") - 1);
+}
+
+
+static char *
+ngx_http_set_loop_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_loop_status_handler;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,956 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_HTTP     0
+#define NGX_HTTP_UPSTREAM_HC_TCP      1
+
+#define NGX_HTTP_UPSTREAM_HC_DOWN     0x02
+
+#define NGX_HTTP_UPSTREAM_HC_BUFFER   4096
+
+
+typedef struct {
+    ngx_msec_t                          interval;
+    ngx_msec_t                          timeout;
+    ngx_uint_t                          fails;
+    ngx_uint_t                          passes;
+    in_port_t                           port;
+    ngx_uint_t                          type;
+    ngx_uint_t                          status_min;
+    ngx_uint_t                          status_max;
+    ngx_str_t                           body;
+    ngx_str_t                           request;
+
+    ngx_http_upstream_srv_conf_t       *upstream;
+
+    ngx_event_t                         event;
+    ngx_uint_t                          pending;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct {
+    ngx_array_t                         upstreams;
+                                       /* ngx_http_upstream_hc_srv_conf_t * */
+} ngx_http_upstream_hc_main_conf_t;
+
+
+typedef struct ngx_http_upstream_hc_peer_s  ngx_http_upstream_hc_peer_t;
+
+struct ngx_http_upstream_hc_peer_s {
+    ngx_http_upstream_hc_srv_conf_t    *conf;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_rr_peer_t        *peer;
+
+    ngx_peer_connection_t               pc;
+    ngx_sockaddr_t                      sockaddr;
+    ngx_log_t                           log;
+
+    ngx_buf_t                           buffer;
+    size_t                              sent;
+
+    unsigned                            connected:1;
+
+    ngx_http_upstream_hc_peer_t        *next;
+};
+
+
+static void ngx_http_upstream_hc_start(ngx_event_t *ev);
+static ngx_http_upstream_hc_peer_t *ngx_http_upstream_hc_create_peer(
+    ngx_http_upstream_hc_srv_conf_t *hcf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_hc_connect(ngx_http_upstream_hc_peer_t *hp);
+static void ngx_http_upstream_hc_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_hc_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_hc_test_response(
+    ngx_http_upstream_hc_peer_t *hp);
+static u_char *ngx_http_upstream_hc_log_error(ngx_log_t *log, u_char *buf,
+    size_t len);
+static void ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp,
+    ngx_int_t rc);
+
+static ngx_int_t ngx_http_upstream_hc_init(ngx_conf_t *cf);
+static void *ngx_http_upstream_hc_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hc,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_init,             /* postconfiguration */
+
+    ngx_http_upstream_hc_create_main_conf, /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_hc_module_ctx,      /* module context */
+    ngx_http_upstream_hc_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_hc_start(ngx_event_t *ev)
+{
+    ngx_uint_t                        n;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_peer_t      *hp, *next, *checks;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check upstream \"%V\"", &hcf->upstream->host);
+
+    /*
+     * the peers are referenced under the lock, while connections
+     * are established after it is released, as a failed connection
+     * is finalized immediately and locks the peers again
+     */
+
+    checks = NULL;
+    n = 0;
+
+    for (peers = hcf->upstream->peer.data; peers; peers = peers->next) {
+
+        ngx_http_upstream_rr_peers_rlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            hp = ngx_http_upstream_hc_create_peer(hcf, peers, peer);
+            if (hp == NULL) {
+                break;
+            }
+
+            hp->next = checks;
+            checks = hp;
+            n++;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+    }
+
+    if (n == 0) {
+        ngx_add_timer(ev, hcf->interval);
+        return;
+    }
+
+    hcf->pending = n;
+
+    for (hp = checks; hp; hp = next) {
+        next = hp->next;
+        ngx_http_upstream_hc_connect(hp);
+    }
+}
+
+
+static ngx_http_upstream_hc_peer_t *
+ngx_http_upstream_hc_create_peer(ngx_http_upstream_hc_srv_conf_t *hcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    hp = ngx_alloc(sizeof(ngx_http_upstream_hc_peer_t)
+                   + NGX_HTTP_UPSTREAM_HC_BUFFER, ngx_cycle->log);
+    if (hp == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(hp, sizeof(ngx_http_upstream_hc_peer_t));
+
+    hp->conf = hcf;
+    hp->peers = peers;
+    hp->peer = peer;
+
+    ngx_memcpy(&hp->sockaddr, peer->sockaddr, peer->socklen);
+
+    if (hcf->port) {
+        ngx_inet_set_port(&hp->sockaddr.sockaddr, hcf->port);
+    }
+
+    hp->log = *ngx_cycle->log;
+    hp->log.handler = ngx_http_upstream_hc_log_error;
+    hp->log.data = hp;
+    hp->log.action = "checking upstream health";
+
+    hp->pc.sockaddr = &hp->sockaddr.sockaddr;
+    hp->pc.socklen = peer->socklen;
+    hp->pc.name = &peer->name;
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = &hp->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+
+    hp->buffer.start = (u_char *) &hp[1];
+    hp->buffer.pos = hp->buffer.start;
+    hp->buffer.last = hp->buffer.start;
+    hp->buffer.end = hp->buffer.start + NGX_HTTP_UPSTREAM_HC_BUFFER;
+
+    /* the name and the peer itself stay valid while it is referenced */
+
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+    ngx_http_upstream_rr_peer_ref(peers, peer);
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+
+    return hp;
+}
+
+
+static void
+ngx_http_upstream_hc_connect(ngx_http_upstream_hc_peer_t *hp)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, &hp->log, 0,
+                   "health check connect %V: %i", hp->pc.name, rc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+        return;
+    }
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+
+    c->read->handler = ngx_http_upstream_hc_read_handler;
+    c->write->handler = ngx_http_upstream_hc_write_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, hp->conf->timeout);
+        return;
+    }
+
+    ngx_http_upstream_hc_write_handler(c->write);
+}
+
+
+static void
+ngx_http_upstream_hc_write_handler(ngx_event_t *wev)
+{
+    ssize_t                           n;
+    ngx_str_t                        *request;
+    ngx_connection_t                 *c;
+    ngx_http_upstream_hc_peer_t      *hp;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    c = wev->data;
+    hp = c->data;
+    hcf = hp->conf;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+        return;
+    }
+
+    if (!hp->connected) {
+
+        if (ngx_http_upstream_hc_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+            return;
+        }
+
+        hp->connected = 1;
+
+        if (hcf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+            ngx_http_upstream_hc_finalize(hp, NGX_OK);
+            return;
+        }
+    }
+
+    request = &hcf->request;
+
+    while (hp->sent < request->len) {
+
+        n = c->send(c, request->data + hp->sent, request->len - hp->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (!wev->timer_set) {
+                ngx_add_timer(wev, hcf->timeout);
+            }
+
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        hp->sent += n;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    wev->handler = ngx_http_upstream_hc_dummy_handler;
+
+    ngx_add_timer(c->read, hcf->timeout);
+
+    if (c->read->ready) {
+        ngx_http_upstream_hc_read_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+        return;
+    }
+
+    if (!hp->connected) {
+
+        /* the connection is not yet checked by the write handler */
+
+        if (ngx_http_upstream_hc_test_connect(c) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+        }
+
+        return;
+    }
+
+    b = &hp->buffer;
+
+    /* the response is checked as soon as it is read or the buffer is full */
+
+    while (b->last < b->end) {
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(hp, NGX_ERROR);
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        b->last += n;
+    }
+
+    ngx_http_upstream_hc_finalize(hp, ngx_http_upstream_hc_test_response(hp));
+}
+
+
+static void
+ngx_http_upstream_hc_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check dummy handler");
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_test_response(ngx_http_upstream_hc_peer_t *hp)
+{
+    u_char                           *p, *last;
+    ngx_int_t                         status;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = hp->conf;
+
+    p = hp->buffer.pos;
+    last = hp->buffer.last;
+
+    /* "HTTP/1.1 200 OK" */
+
+    if (last - p < 12 || ngx_strncmp(p, "HTTP/", 5) != 0) {
+        ngx_log_error(NGX_LOG_INFO, &hp->log, 0,
+                      "upstream sent no valid HTTP/1.0 header");
+        return NGX_ERROR;
+    }
+
+    p = ngx_strlchr(p, last, ' ');
+
+    if (p == NULL || last - p < 4) {
+        ngx_log_error(NGX_LOG_INFO, &hp->log, 0,
+                      "upstream sent no valid HTTP/1.0 header");
+        return NGX_ERROR;
+    }
+
+    status = ngx_atoi(p + 1, 3);
+
+    if (status == NGX_ERROR
+        || (ngx_uint_t) status < hcf->status_min
+        || (ngx_uint_t) status > hcf->status_max)
+    {
+        ngx_log_error(NGX_LOG_INFO, &hp->log, 0,
+                      "upstream sent unexpected status \"%*s\"",
+                      (size_t) 3, p + 1);
+        return NGX_ERROR;
+    }
+
+    if (hcf->body.len == 0) {
+        return NGX_OK;
+    }
+
+    p = ngx_strnstr(p, "\r\n\r\n", last - p);
+
+    if (p == NULL
+        || ngx_strnstr(p + 4, (char *) hcf->body.data, last - p - 4) == NULL)
+    {
+        ngx_log_error(NGX_LOG_INFO, &hp->log, 0,
+                      "upstream response does not match \"%V\"", &hcf->body);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_upstream_hc_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                       *p;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+    }
+
+    hp = log->data;
+
+    p = ngx_snprintf(p, len, ", upstream: %V", hp->pc.name);
+
+    return p;
+}
+
+
+static void
+ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp, ngx_int_t rc)
+{
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, &hp->log, 0,
+                   "health check %V: %i", hp->pc.name, rc);
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    hcf = hp->conf;
+    peers = hp->peers;
+    peer = hp->peer;
+
+    /* peers->tries is changed, as in the zone module */
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    /*
+     * an unhealthy peer is marked down with a separate bit, so it is
+     * skipped by all balancers, and excluded from the number of tries
+     * unless it is already down
+     */
+
+    if (peer->zombie) {
+        /* void */
+
+    } else if (rc == NGX_OK) {
+        peer->hc_fails = 0;
+
+        if ((peer->down & NGX_HTTP_UPSTREAM_HC_DOWN)
+            && ++peer->hc_passes >= hcf->passes)
+        {
+            peer->down &= ~NGX_HTTP_UPSTREAM_HC_DOWN;
+            peer->hc_passes = 0;
+
+            if (peer->down == 0) {
+                peers->tries++;
+            }
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "health check passed, upstream server %V "
+                          "in upstream \"%V\" enabled",
+                          &peer->name, &hcf->upstream->host);
+        }
+
+    } else {
+        peer->hc_passes = 0;
+
+        if (!(peer->down & NGX_HTTP_UPSTREAM_HC_DOWN)
+            && ++peer->hc_fails >= hcf->fails)
+        {
+            if (peer->down == 0) {
+                peers->tries--;
+            }
+
+            peer->down |= NGX_HTTP_UPSTREAM_HC_DOWN;
+            peer->hc_fails = 0;
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "health check failed, upstream server %V "
+                          "in upstream \"%V\" disabled",
+                          &peer->name, &hcf->upstream->host);
+        }
+    }
+
+    if (ngx_http_upstream_rr_peer_unref(peers, peer) == NGX_OK) {
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_free(hp);
+
+    if (--hcf->pending == 0 && !ngx_exiting) {
+        ngx_add_timer(&hcf->event, hcf->interval);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                         i;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_upstream_hc_srv_conf_t  **hcfp;
+    ngx_http_upstream_hc_main_conf_t  *hmcf;
+
+    hmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_hc_module);
+
+    hcfp = hmcf->upstreams.elts;
+
+    for (i = 0; i < hmcf->upstreams.nelts; i++) {
+        uscf = hcfp[i]->upstream;
+
+        if (uscf->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui", &uscf->host, uscf->file_name,
+                          uscf->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_main_conf_t  *hmcf;
+
+    hmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_main_conf_t));
+    if (hmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&hmcf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_upstream_hc_srv_conf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return hmcf;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->port = 0;
+     *     conf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+     *     conf->body = { 0, NULL };
+     *     conf->request = { 0, NULL };
+     *     conf->upstream = NULL;
+     *     conf->pending = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf = conf;
+
+    u_char                             *p, *last;
+    ngx_int_t                           n, m;
+    ngx_str_t                          *value, s, uri;
+    ngx_uint_t                          i;
+    ngx_http_upstream_srv_conf_t       *uscf;
+    ngx_http_upstream_hc_srv_conf_t   **hcfp;
+    ngx_http_upstream_hc_main_conf_t   *hmcf;
+
+    if (hcf->upstream) {
+        return "is duplicate";
+    }
+
+    hcf->interval = 5000;
+    hcf->timeout = NGX_CONF_UNSET_MSEC;
+    hcf->fails = 1;
+    hcf->passes = 1;
+    hcf->status_min = 200;
+    hcf->status_max = 399;
+
+    ngx_str_set(&uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+
+            if (n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "type=", 5) == 0) {
+
+            if (ngx_strcmp(&value[i].data[5], "http") == 0) {
+                hcf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+
+            } else if (ngx_strcmp(&value[i].data[5], "tcp") == 0) {
+                hcf->type = NGX_HTTP_UPSTREAM_HC_TCP;
+
+            } else {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            uri.len = value[i].len - 4;
+            uri.data = &value[i].data[4];
+
+            if (uri.len == 0 || uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            p = &value[i].data[7];
+            last = value[i].data + value[i].len;
+
+            s.data = ngx_strlchr(p, last, '-');
+
+            if (s.data) {
+                n = ngx_atoi(p, s.data - p);
+                m = ngx_atoi(s.data + 1, last - s.data - 1);
+
+            } else {
+                n = ngx_atoi(p, last - p);
+                m = n;
+            }
+
+            if (n < 100 || m > 599 || n > m) {
+                goto invalid;
+            }
+
+            hcf->status_min = n;
+            hcf->status_max = m;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+
+            hcf->body.len = value[i].len - 5;
+            hcf->body.data = &value[i].data[5];
+
+            if (hcf->body.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (hcf->timeout == NGX_CONF_UNSET_MSEC) {
+        hcf->timeout = hcf->interval;
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    hcf->upstream = uscf;
+
+    hcf->request.len = sizeof("GET  HTTP/1.0" CRLF) - 1 + uri.len
+                       + sizeof("Host: " CRLF) - 1 + uscf->host.len
+                       + sizeof("Connection: close" CRLF CRLF) - 1;
+
+    hcf->request.data = ngx_pnalloc(cf->pool, hcf->request.len);
+    if (hcf->request.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(hcf->request.data,
+                "GET %V HTTP/1.0" CRLF
+                "Host: %V" CRLF
+                "Connection: close" CRLF CRLF,
+                &uri, &uscf->host);
+
+    hmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_hc_module);
+
+    hcfp = ngx_array_push(&hmcf->upstreams);
+    if (hcfp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *hcfp = hcf;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                         i;
+    ngx_http_upstream_hc_srv_conf_t  **hcfp;
+    ngx_http_upstream_hc_main_conf_t  *hmcf;
+
+    hmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_upstream_hc_module);
+
+    /* checks are run by the first worker only */
+
+    if (hmcf == NULL
+        || hmcf->upstreams.nelts == 0
+        || (ngx_process != NGX_PROCESS_WORKER
+            && ngx_process != NGX_PROCESS_SINGLE)
+        || ngx_worker != 0)
+    {
+        return NGX_OK;
+    }
+
+    hcfp = hmcf->upstreams.elts;
+
+    for (i = 0; i < hmcf->upstreams.nelts; i++) {
+        hcfp[i]->event.handler = ngx_http_upstream_hc_start;
+        hcfp[i]->event.data = hcfp[i];
+        hcfp[i]->event.log = cycle->log;
+        hcfp[i]->event.cancelable = 1;
+
+        ngx_add_timer(&hcfp[i]->event, 0);
+    }
+
+    return NGX_OK;
+}
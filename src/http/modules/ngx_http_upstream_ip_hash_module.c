@@ -83,10 +83,15 @@ static u_char ngx_http_upstream_ip_hash_pseudo_addr[3];
 static ngx_int_t
 ngx_http_upstream_init_ip_hash(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
 {
+    ngx_http_upstream_rr_peers_t  *peers;
+
     if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
         return NGX_ERROR;
     }
 
+    peers = us->peer.data;
+    peers->read_mostly = 1;
+
     us->peer.init = ngx_http_upstream_init_ip_hash_peer;
 
     return NGX_OK;
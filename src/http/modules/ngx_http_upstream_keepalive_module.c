@@ -10,6 +10,29 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_atomic_t                       pid;
+    ngx_atomic_t                       idle;
+    ngx_atomic_t                       want;
+    ngx_atomic_t                       peer;
+} ngx_http_upstream_keepalive_worker_t;
+
+
+typedef struct {
+    ngx_atomic_t                       hits;
+    ngx_atomic_t                       misses;
+    ngx_atomic_t                       passed;
+    ngx_atomic_t                       received;
+
+    ngx_http_upstream_keepalive_worker_t  workers[NGX_MAX_PROCESSES];
+} ngx_http_upstream_keepalive_shctx_t;
+
+
+typedef struct {
+    ngx_array_t                        shared;
+} ngx_http_upstream_keepalive_main_conf_t;
+
+
 typedef struct {
     ngx_uint_t                         max_cached;
     ngx_uint_t                         requests;
@@ -18,6 +41,14 @@ typedef struct {
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
+    ngx_uint_t                         cached;
+
+    ngx_str_t                          name;
+    ngx_int_t                          tag;
+    ngx_shm_zone_t                    *shm_zone;
+    ngx_http_upstream_keepalive_shctx_t   *sh;
+    ngx_http_upstream_keepalive_worker_t  *worker;
+    ngx_uint_t                         nworkers;
 
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
@@ -31,6 +62,7 @@ typedef struct {
     ngx_queue_t                        queue;
     ngx_connection_t                  *connection;
 
+    uint32_t                           hash;
     socklen_t                          socklen;
     ngx_sockaddr_t                     sockaddr;
 
@@ -62,6 +94,16 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static void ngx_http_upstream_keepalive_cache(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+    struct sockaddr *sockaddr, socklen_t socklen);
+static void ngx_http_upstream_keepalive_share(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static ngx_int_t ngx_http_upstream_keepalive_pass(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_connection_t *c,
+    ngx_pid_t pid);
+static void ngx_http_upstream_keepalive_receive(ngx_socket_t s, ngx_int_t tag,
+    ngx_log_t *log);
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
@@ -73,15 +115,26 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_status_handler(
+    ngx_http_request_t *r);
+
+static void *ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static ngx_int_t ngx_http_upstream_keepalive_init_zone(
+    ngx_shm_zone_t *shm_zone, void *data);
+static char *ngx_http_upstream_keepalive_status(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_keepalive_exit_process(ngx_cycle_t *cycle);
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
       ngx_http_upstream_keepalive,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -108,6 +161,13 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("keepalive_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_keepalive_status,
+      0,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -116,7 +176,8 @@ static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
     NULL,                                  /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
+    ngx_http_upstream_keepalive_create_main_conf,
+                                           /* create main configuration */
     NULL,                                  /* init main configuration */
 
     ngx_http_upstream_keepalive_create_conf, /* create server configuration */
@@ -134,10 +195,10 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_upstream_keepalive_exit_process, /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -236,8 +297,10 @@ static ngx_int_t
 ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
+    ngx_http_upstream_keepalive_srv_conf_t   *kcf;
     ngx_http_upstream_keepalive_cache_t      *item;
 
+    uint32_t           hash;
     ngx_int_t          rc;
     ngx_queue_t       *q, *cache;
     ngx_connection_t  *c;
@@ -255,7 +318,8 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 
     /* search cache for suitable connection */
 
-    cache = &kp->conf->cache;
+    kcf = kp->conf;
+    cache = &kcf->cache;
 
     for (q = ngx_queue_head(cache);
          q != ngx_queue_sentinel(cache);
@@ -269,16 +333,48 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
             == 0)
         {
             ngx_queue_remove(q);
-            ngx_queue_insert_head(&kp->conf->free, q);
+            ngx_queue_insert_head(&kcf->free, q);
+
+            kcf->cached--;
 
             goto found;
         }
     }
 
+    if (kcf->sh) {
+        (void) ngx_atomic_fetch_add(&kcf->sh->misses, 1);
+
+        /*
+         * ask siblings to pass their surplus connections to the peer,
+         * misses are counted for the last peer missed
+         */
+
+        if (kcf->worker) {
+            hash = ngx_crc32_short((u_char *) pc->sockaddr, pc->socklen);
+
+            if (kcf->worker->peer != hash) {
+                kcf->worker->peer = hash;
+                kcf->worker->want = 1;
+
+            } else if (kcf->worker->want < kcf->max_cached) {
+                (void) ngx_atomic_fetch_add(&kcf->worker->want, 1);
+            }
+        }
+    }
+
     return NGX_OK;
 
 found:
 
+    if (kcf->sh) {
+        (void) ngx_atomic_fetch_add(&kcf->sh->hits, 1);
+
+        if (kcf->worker) {
+            kcf->worker->idle = kcf->cached;
+            kcf->worker->want = 0;
+        }
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
 
@@ -306,9 +402,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_uint_t state)
 {
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
-    ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
 
@@ -358,30 +452,56 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    pc->connection = NULL;
+
+    ngx_http_upstream_keepalive_cache(kp->conf, c, pc->sockaddr, pc->socklen);
+
+    if (kp->conf->worker) {
+        ngx_http_upstream_keepalive_share(kp->conf);
+    }
+
+invalid:
 
-        q = ngx_queue_last(&kp->conf->cache);
+    kp->original_free_peer(pc, kp->data, state);
+}
+
+
+static void
+ngx_http_upstream_keepalive_cache(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c, struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    if (ngx_queue_empty(&kcf->free)) {
+
+        q = ngx_queue_last(&kcf->cache);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
 
-        ngx_http_upstream_keepalive_close(item->connection);
+        if (kcf->worker == NULL
+            || ngx_http_upstream_keepalive_pass(kcf, item->connection, 0)
+               != NGX_OK)
+        {
+            ngx_http_upstream_keepalive_close(item->connection);
+        }
 
     } else {
-        q = ngx_queue_head(&kp->conf->free);
+        q = ngx_queue_head(&kcf->free);
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        kcf->cached++;
     }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(&kcf->cache, q);
 
     item->connection = c;
 
-    pc->connection = NULL;
-
     c->read->delayed = 0;
-    ngx_add_timer(c->read, kp->conf->timeout);
+    ngx_add_timer(c->read, kcf->timeout);
 
     if (c->write->timer_set) {
         ngx_del_timer(c->write);
@@ -397,16 +517,268 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
+    item->socklen = socklen;
+    ngx_memcpy(&item->sockaddr, sockaddr, socklen);
+
+    if (kcf->worker) {
+        item->hash = ngx_crc32_short((u_char *) sockaddr, socklen);
+        kcf->worker->idle = kcf->cached;
+    }
 
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
+}
 
-invalid:
 
-    kp->original_free_peer(pc, kp->data, state);
+static void
+ngx_http_upstream_keepalive_share(ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    ngx_pid_t                              pid;
+    ngx_uint_t                             i;
+    ngx_queue_t                           *q, *found;
+    ngx_atomic_uint_t                      want, max, peer;
+    ngx_http_upstream_keepalive_cache_t   *item;
+    ngx_http_upstream_keepalive_worker_t  *w, *best;
+
+    /*
+     * an idle connection is passed to a sibling worker which had to open
+     * new connections to the same peer, if the sibling holds fewer idle
+     * connections; the oldest connection to the peer is passed
+     */
+
+    best = NULL;
+    found = NULL;
+    max = 0;
+
+    for (i = 0; i < kcf->nworkers; i++) {
+        w = &kcf->sh->workers[i];
+
+        if (w == kcf->worker || w->pid == 0) {
+            continue;
+        }
+
+        want = w->want;
+
+        if (want <= max || w->idle + 1 >= kcf->cached) {
+            continue;
+        }
+
+        peer = w->peer;
+
+        for (q = ngx_queue_last(&kcf->cache);
+             q != ngx_queue_sentinel(&kcf->cache);
+             q = ngx_queue_prev(q))
+        {
+            item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                                  queue);
+
+            if (item->hash == peer) {
+                best = w;
+                found = q;
+                max = want;
+                break;
+            }
+        }
+    }
+
+    if (best == NULL) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&best->want, max, max - 1)) {
+        return;
+    }
+
+    pid = best->pid;
+
+    q = found;
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    if (ngx_http_upstream_keepalive_pass(kcf, item->connection, pid)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&kcf->free, q);
+
+    kcf->cached--;
+    kcf->worker->idle = kcf->cached;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_pass(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_connection_t *c, ngx_pid_t pid)
+{
+    ngx_uint_t                             i;
+    ngx_atomic_uint_t                      idle, min;
+    ngx_http_upstream_keepalive_worker_t  *w;
+
+    /*
+     * the receiver cannot know how long the connection was used, so only
+     * connections in the first half of their lifetime are passed, and
+     * the receiver accounts them as if they were used for a half
+     */
+
+    if (c->requests >= kcf->requests / 2
+        || ngx_current_msec - c->start_time >= kcf->time / 2
+        || c->tcp_nopush == NGX_TCP_NOPUSH_SET
+        || c->buffered
+#if (NGX_HTTP_SSL)
+        || c->ssl
+#endif
+        )
+    {
+        return NGX_DECLINED;
+    }
+
+    if (pid == 0) {
+
+        /* a surplus connection goes to the sibling with fewest idle ones */
+
+        min = kcf->max_cached;
+
+        for (i = 0; i < kcf->nworkers; i++) {
+            w = &kcf->sh->workers[i];
+
+            if (w == kcf->worker || w->pid == 0) {
+                continue;
+            }
+
+            idle = w->idle;
+
+            if (idle < min) {
+                min = idle;
+                pid = w->pid;
+            }
+        }
+
+        if (pid == 0) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (ngx_pass_connection(pid, c->fd, kcf->tag, ngx_cycle->log) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "keepalive connection %p passed to %P", c, pid);
+
+    (void) ngx_atomic_fetch_add(&kcf->sh->passed, 1);
+
+    /* the socket is still shared with the receiver until it is closed */
+
+    if (ngx_del_conn) {
+        ngx_del_conn(c, 0);
+    }
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_receive(ngx_socket_t s, ngx_int_t tag,
+    ngx_log_t *log)
+{
+    socklen_t                                 socklen;
+    ngx_uint_t                                i;
+    ngx_sockaddr_t                            sockaddr;
+    ngx_connection_t                         *c;
+    ngx_http_upstream_keepalive_srv_conf_t  **kcfp, *kcf;
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                           ngx_http_upstream_keepalive_module);
+
+    kcf = NULL;
+
+    if (kmcf && !ngx_exiting && !ngx_terminate) {
+        kcfp = kmcf->shared.elts;
+
+        for (i = 0; i < kmcf->shared.nelts; i++) {
+            if (kcfp[i]->tag == tag && kcfp[i]->worker) {
+                kcf = kcfp[i];
+                break;
+            }
+        }
+    }
+
+    if (kcf == NULL) {
+        goto close;
+    }
+
+    socklen = sizeof(ngx_sockaddr_t);
+
+    if (getpeername(s, &sockaddr.sockaddr, &socklen) == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno,
+                      "getpeername() of passed connection failed");
+        goto close;
+    }
+
+    c = ngx_get_connection(s, ngx_cycle->log);
+    if (c == NULL) {
+        goto close;
+    }
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    c->type = SOCK_STREAM;
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->sendfile = 1;
+
+    if (sockaddr.sockaddr.sa_family == AF_UNIX) {
+        c->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+        c->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    }
+
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->log_error = NGX_ERROR_ERR;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    c->start_time = ngx_current_msec - kcf->time / 2;
+    c->requests = kcf->requests / 2;
+
+    c->write->ready = 1;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_destroy_pool(c->pool);
+        ngx_close_connection(c);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "keepalive connection %p received, fd:%d", c, s);
+
+    (void) ngx_atomic_fetch_add(&kcf->sh->received, 1);
+
+    ngx_http_upstream_keepalive_cache(kcf, c, &sockaddr.sockaddr, socklen);
+
+    return;
+
+close:
+
+    if (ngx_close_socket(s) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_socket_errno,
+                      ngx_close_socket_n " passed connection failed");
+    }
 }
 
 
@@ -458,6 +830,12 @@ close:
 
     ngx_queue_remove(&item->queue);
     ngx_queue_insert_head(&conf->free, &item->queue);
+
+    conf->cached--;
+
+    if (conf->worker) {
+        conf->worker->idle = conf->cached;
+    }
 }
 
 
@@ -507,6 +885,117 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_status_handler(ngx_http_request_t *r)
+{
+    size_t                                     len;
+    ngx_int_t                                  rc;
+    ngx_buf_t                                 *b;
+    ngx_uint_t                                 i, n, idle;
+    ngx_chain_t                                out;
+    ngx_http_upstream_keepalive_shctx_t       *sh;
+    ngx_http_upstream_keepalive_srv_conf_t   **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t   *kmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    r->headers_out.content_type_len = sizeof("application/json") - 1;
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_lowcase = NULL;
+
+    kmcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_keepalive_module);
+
+    kcfp = kmcf->shared.elts;
+
+    len = sizeof("{\"upstreams\":{}}\n") - 1;
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+        len += sizeof("\"\":{\"idle\":,\"hits\":,\"misses\":,\"passed\":,"
+                      "\"received\":},") - 1
+               + kcfp[i]->name.len + 5 * NGX_ATOMIC_T_LEN;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    b->last = ngx_cpymem(b->last, "{\"upstreams\":{",
+                         sizeof("{\"upstreams\":{") - 1);
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+        sh = kcfp[i]->sh;
+
+        idle = 0;
+
+        for (n = 0; n < NGX_MAX_PROCESSES; n++) {
+            if (sh->workers[n].pid) {
+                idle += sh->workers[n].idle;
+            }
+        }
+
+        b->last = ngx_sprintf(b->last, "\"%V\":{\"idle\":%ui,\"hits\":%uA,"
+                              "\"misses\":%uA,\"passed\":%uA,"
+                              "\"received\":%uA},",
+                              &kcfp[i]->name, idle, sh->hits, sh->misses,
+                              sh->passed, sh->received);
+    }
+
+    if (b->last[-1] == ',') {
+        b->last--;
+    }
+
+    b->last = ngx_cpymem(b->last, "}}\n", sizeof("}}\n") - 1);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void *
+ngx_http_upstream_keepalive_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_keepalive_main_conf_t  *kmcf;
+
+    kmcf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_keepalive_main_conf_t));
+    if (kmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&kmcf->shared, cf->pool, 4,
+                       sizeof(ngx_http_upstream_keepalive_srv_conf_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return kmcf;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -524,6 +1013,10 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->cached = 0;
+     *     conf->shm_zone = NULL;
+     *     conf->sh = NULL;
+     *     conf->worker = NULL;
      */
 
     conf->time = NGX_CONF_UNSET_MSEC;
@@ -537,11 +1030,14 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 static char *
 ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_upstream_srv_conf_t            *uscf;
-    ngx_http_upstream_keepalive_srv_conf_t  *kcf = conf;
+    ngx_http_upstream_srv_conf_t              *uscf;
+    ngx_http_upstream_keepalive_srv_conf_t    *kcf = conf;
+    ngx_http_upstream_keepalive_srv_conf_t   **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t   *kmcf;
 
+    size_t       size;
     ngx_int_t    n;
-    ngx_str_t   *value;
+    ngx_str_t   *value, name;
 
     if (kcf->max_cached) {
         return "is duplicate";
@@ -562,10 +1058,56 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     kcf->max_cached = n;
 
-    /* init upstream handler */
-
     uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
 
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strcmp(value[2].data, "shared") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        /* idle connections are passed between workers via channels */
+
+        kcf->name = uscf->host;
+        kcf->tag = ngx_crc32_short(uscf->host.data, uscf->host.len)
+                   & 0x7fffffff;
+
+        name.len = sizeof("keepalive:") - 1 + uscf->host.len;
+        name.data = ngx_pnalloc(cf->pool, name.len);
+        if (name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(name.data, "keepalive:%V", &uscf->host);
+
+        size = ngx_align(sizeof(ngx_http_upstream_keepalive_shctx_t),
+                         ngx_pagesize)
+               + 8 * ngx_pagesize;
+
+        kcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_upstream_keepalive_module);
+        if (kcf->shm_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        kcf->shm_zone->init = ngx_http_upstream_keepalive_init_zone;
+        kcf->shm_zone->data = kcf;
+
+        kmcf = ngx_http_conf_get_module_main_conf(cf,
+                                           ngx_http_upstream_keepalive_module);
+
+        kcfp = ngx_array_push(&kmcf->shared);
+        if (kcfp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *kcfp = kcf;
+    }
+
+    /* init upstream handler */
+
     kcf->original_init_upstream = uscf->peer.init_upstream
                                   ? uscf->peer.init_upstream
                                   : ngx_http_upstream_init_round_robin;
@@ -574,3 +1116,117 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *okcf = data;
+
+    ngx_slab_pool_t                         *shpool;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = shm_zone->data;
+
+    if (okcf) {
+        kcf->sh = okcf->sh;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        kcf->sh = shpool->data;
+        return NGX_OK;
+    }
+
+    kcf->sh = ngx_slab_calloc(shpool,
+                              sizeof(ngx_http_upstream_keepalive_shctx_t));
+    if (kcf->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = kcf->sh;
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_upstream_keepalive_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_keepalive_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                 i;
+    ngx_core_conf_t                           *ccf;
+    ngx_http_upstream_keepalive_worker_t      *w;
+    ngx_http_upstream_keepalive_srv_conf_t   **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t   *kmcf;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                           ngx_http_upstream_keepalive_module);
+
+    if (kmcf == NULL
+        || kmcf->shared.nelts == 0
+        || ngx_process != NGX_PROCESS_WORKER
+        || ngx_worker >= NGX_MAX_PROCESSES)
+    {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    kcfp = kmcf->shared.elts;
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+        w = &kcfp[i]->sh->workers[ngx_worker];
+
+        w->idle = 0;
+        w->want = 0;
+        w->peer = 0;
+        w->pid = ngx_pid;
+
+        kcfp[i]->worker = w;
+        kcfp[i]->nworkers = ngx_min((ngx_uint_t) ccf->worker_processes,
+                                    NGX_MAX_PROCESSES);
+    }
+
+    ngx_pass_connection_handler = ngx_http_upstream_keepalive_receive;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                                 i;
+    ngx_http_upstream_keepalive_srv_conf_t   **kcfp;
+    ngx_http_upstream_keepalive_main_conf_t   *kmcf;
+
+    kmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                           ngx_http_upstream_keepalive_module);
+
+    if (kmcf == NULL) {
+        return;
+    }
+
+    kcfp = kmcf->shared.elts;
+
+    for (i = 0; i < kmcf->shared.nelts; i++) {
+        if (kcfp[i]->worker) {
+            (void) ngx_atomic_cmp_set(&kcfp[i]->worker->pid, ngx_pid, 0);
+        }
+    }
+}
@@ -17,6 +17,7 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                            two;
+    ngx_msec_t                            decay;
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_uint_t                            config;
 #endif
@@ -47,6 +48,8 @@ static ngx_int_t ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc,
 static ngx_uint_t ngx_http_upstream_peek_random_peer(
     ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp);
+static uint64_t ngx_http_upstream_random_cost(
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t decay);
 static void *ngx_http_upstream_random_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -99,12 +102,22 @@ ngx_module_t  ngx_http_upstream_random_module = {
 static ngx_int_t
 ngx_http_upstream_init_random(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
 {
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_random_srv_conf_t  *rcf;
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init random");
 
     if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
         return NGX_ERROR;
     }
 
+    rcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_random_module);
+
+    if (rcf->two == 0) {
+        peers = us->peer.data;
+        peers->read_mostly = 1;
+    }
+
     us->peer.init = ngx_http_upstream_init_random_peer;
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
@@ -190,6 +203,7 @@ ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
 
     rp->conf = rcf;
     rp->tries = 0;
+    rp->rrp.decay = rcf->decay;
 
     ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
 
@@ -321,6 +335,7 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
     time_t                             now;
     uintptr_t                          m;
+    uint64_t                           cost, prev_cost;
     ngx_uint_t                         i, n, p;
     ngx_http_upstream_rr_peer_t       *peer, *prev;
     ngx_http_upstream_rr_peers_t      *peers;
@@ -332,6 +347,8 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
     rrp = &rp->rrp;
     peers = rrp->peers;
 
+    rrp->start_time = ngx_current_msec;
+
     ngx_http_upstream_rr_peers_wlock(peers);
 
     if (rp->tries > 20 || peers->number < 2) {
@@ -390,7 +407,20 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         if (prev) {
-            if (peer->conns * prev->weight > prev->conns * peer->weight) {
+            if (rp->conf->decay) {
+                cost = ngx_http_upstream_random_cost(peer, rp->conf->decay);
+                prev_cost = ngx_http_upstream_random_cost(prev,
+                                                          rp->conf->decay);
+
+                cost *= prev->weight;
+                prev_cost *= peer->weight;
+
+            } else {
+                cost = (uint64_t) peer->conns * prev->weight;
+                prev_cost = (uint64_t) prev->conns * peer->weight;
+            }
+
+            if (cost > prev_cost) {
                 peer = prev;
                 n = p / (8 * sizeof(uintptr_t));
                 m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
@@ -457,6 +487,24 @@ ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
 }
 
 
+static uint64_t
+ngx_http_upstream_random_cost(ngx_http_upstream_rr_peer_t *peer,
+    ngx_msec_t decay)
+{
+    uint64_t  ewma, elapsed;
+
+    /*
+     * the latency EWMA decays towards zero while the peer is not used,
+     * so a peer which was slow once is eventually probed again
+     */
+
+    elapsed = ngx_current_msec - peer->ewma_time;
+    ewma = (uint64_t) peer->ewma * decay / (decay + elapsed);
+
+    return (ewma + 1) * (peer->conns + 1);
+}
+
+
 static void *
 ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
 {
@@ -471,6 +519,7 @@ ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->two = 0;
+     *     conf->decay = 0;
      */
 
     return conf;
@@ -482,7 +531,8 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_random_srv_conf_t  *rcf = conf;
 
-    ngx_str_t                     *value;
+    ngx_int_t                      d;
+    ngx_str_t                     *value, s;
     ngx_http_upstream_srv_conf_t  *uscf;
 
     uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
@@ -521,11 +571,34 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[2].data, "least_conn") != 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
-        return NGX_CONF_ERROR;
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "ewma") == 0) {
+        rcf->decay = 10000;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[2].data, "ewma=", 5) == 0) {
+
+        s.len = value[2].len - 5;
+        s.data = value[2].data + 5;
+
+        d = ngx_parse_time(&s, 0);
+
+        if (d == NGX_ERROR || d == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid ewma decay time \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        rcf->decay = (ngx_msec_t) d;
+
+        return NGX_CONF_OK;
     }
 
-    return NGX_CONF_OK;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
 }
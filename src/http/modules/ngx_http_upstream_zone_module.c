@@ -269,6 +269,15 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     peers->shpool = shpool;
     peers->config = config;
 
+    if (peers->read_mostly) {
+        peers->nreaders = ngx_ncpu;
+        peers->readers = ngx_slab_calloc(shpool,
+                                         ngx_ncpu * sizeof(ngx_rwlock_slot_t));
+        if (peers->readers == NULL) {
+            return NULL;
+        }
+    }
+
     for (peerp = &peers->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
         peer = ngx_http_upstream_zone_copy_peer(peers, *peerp);
@@ -316,6 +325,15 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     backup->shpool = shpool;
     backup->config = config;
 
+    if (backup->read_mostly) {
+        backup->nreaders = ngx_ncpu;
+        backup->readers = ngx_slab_calloc(shpool,
+                                         ngx_ncpu * sizeof(ngx_rwlock_slot_t));
+        if (backup->readers == NULL) {
+            return NULL;
+        }
+    }
+
     for (peerp = &backup->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
         peer = ngx_http_upstream_zone_copy_peer(backup, *peerp);
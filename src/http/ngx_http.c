@@ -216,6 +216,10 @@ ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
     }
 
+#if (NGX_HTTP_V2 || NGX_HTTP_V3)
+    ngx_http_huff_decode_init();
+#endif
+
     pcf = *cf;
     cf->ctx = ctx;
 
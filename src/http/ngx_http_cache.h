@@ -29,6 +29,12 @@
 
 #define NGX_HTTP_CACHE_VERSION       5
 
+#define NGX_HTTP_CACHE_POLICY_LRU      0
+#define NGX_HTTP_CACHE_POLICY_TINYLFU  1
+
+#define NGX_HTTP_CACHE_KEY_MD5         0
+#define NGX_HTTP_CACHE_KEY_MURMUR3     1
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -36,6 +42,9 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_memory_s  ngx_http_file_cache_memory_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,17 +60,55 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         indexed:1;
+    unsigned                         packed:1;
+    unsigned                         waiters:1;
+    unsigned                         filling:1;
+    unsigned                         refresh:1;
+                                     /* 5 unused bits */
+
+    /*
+     * a packed entry has no file of its own,
+     * it is a record in a segment of the packed storage
+     */
+
+    union {
+        ngx_file_uniq_t              uniq;
+
+        struct {
+            uint32_t                 segment;
+            uint32_t                 offset;
+        } record;
+    } u;
 
-    ngx_file_uniq_t                  uniq;
     time_t                           expire;
     time_t                           valid_sec;
-    size_t                           body_start;
+    uint32_t                         body_start;
+
+    /*
+     * the record length of a packed entry, or the temporary file number
+     * of a response being written, as an entry is not packed while filling
+     */
+
+    union {
+        uint32_t                     length;
+        uint32_t                     fill;
+    } v;
+
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_memory_t    *memory;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_memory_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -86,6 +133,10 @@ struct ngx_http_cache_s {
     off_t                            length;
     off_t                            fs_size;
 
+    uint64_t                         segment;
+    off_t                            offset;
+    ngx_str_t                        segment_name;
+
     ngx_uint_t                       min_uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
@@ -106,9 +157,15 @@ struct ngx_http_cache_s {
     ngx_msec_t                       wait_time;
 
     ngx_event_t                      wait_event;
+    ngx_queue_t                      wait_queue;
+
+    uint32_t                         fill;
 
     unsigned                         lock:1;
     unsigned                         waiting:1;
+    unsigned                         wait_queued:1;
+    unsigned                         filling:1;
+    unsigned                         fill_shared:1;
 
     unsigned                         updated:1;
     unsigned                         updating:1;
@@ -122,6 +179,10 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+    unsigned                         memory:1;
+    unsigned                         packed:1;
+    unsigned                         refresh:1;
+    unsigned                         refreshing:1;
 };
 
 
@@ -144,6 +205,22 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+typedef struct {
+    uint64_t                         id;
+    off_t                            size;
+    off_t                            live;
+    ngx_uint_t                       writers;
+} ngx_http_file_cache_segment_t;
+
+
+typedef struct {
+    uint64_t                         next_id;
+    ngx_uint_t                       active;
+    ngx_uint_t                       nsegments;
+    ngx_http_file_cache_segment_t    segments[1];
+} ngx_http_file_cache_packed_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
@@ -153,13 +230,37 @@ typedef struct {
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+    ngx_queue_t                      memory_queue;
+    size_t                           memory_size;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_mask;
+    ngx_uint_t                       sketch_samples;
+    ngx_uint_t                       hits;
+    ngx_uint_t                       misses;
+    ngx_uint_t                       rejected;
+    ngx_uint_t                       evicted;
+    ngx_http_file_cache_packed_t    *packed;
+    ngx_atomic_t                     manager_queue;
+    ngx_atomic_t                     manager_deleted;
+    ngx_atomic_t                     refresh_active;
+    ngx_atomic_t                     refresh_started;
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_http_file_cache_sh_t        *sh;
+    ngx_slab_pool_t                 *shpool;
+} ngx_http_file_cache_shard_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
 
+    ngx_http_file_cache_shard_t     *shards;
+    ngx_uint_t                       nshards;
+    ngx_uint_t                       manager_shard;
+
     ngx_path_t                      *path;
 
     off_t                            min_free;
@@ -180,10 +281,51 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
 
+#if (NGX_THREADS)
+    ngx_thread_pool_t               *manager_pool;
+    ngx_thread_task_t               *manager_tasks;
+    ngx_uint_t                       manager_queue;
+    ngx_uint_t                       manager_queue_max;
+#endif
+
+    size_t                           memory_size;
+    size_t                           memory_max;
+    ngx_uint_t                       memory_min_uses;
+
+    time_t                           refresh;
+    ngx_uint_t                       refresh_min_uses;
+    ngx_uint_t                       refresh_concurrency;
+    size_t                           refresh_rate;
+
+    ngx_uint_t                       policy;
+    ngx_uint_t                       key_hash;
+    ngx_uint_t                       sketch_size;
+
+    ngx_str_t                        index;
+    ngx_str_t                        index_temp;
+    time_t                           index_interval;
+    time_t                           index_next;
+    ngx_file_t                       index_file;
+    ngx_uint_t                       index_shard;
+    ngx_uint_t                       index_shard_nodes;
+    ngx_uint_t                       index_nodes;
+    ngx_uint_t                       index_entries;
+    u_char                           index_key[NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_http_file_cache_packed_t    *packed;
+    size_t                           packed_max;
+    off_t                            packed_segment;
+    ngx_uint_t                       packed_segments;
+    ngx_uint_t                       compact_slot;
+    uint64_t                         compact_id;
+    off_t                            compact_offset;
+
     ngx_shm_zone_t                  *shm_zone;
 
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
+    ngx_uint_t                       read_while_write;
+                                     /* unsigned read_while_write:1 */
 };
 
 
@@ -194,8 +336,10 @@ ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
+void ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+ngx_http_file_cache_t *ngx_http_file_cache_from_path(ngx_path_t *path);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -11,13 +11,36 @@
 #include <ngx_md5.h>
 
 
+typedef struct {
+    ngx_uint_t                       type;
+
+    union {
+        ngx_md5_t                    md5;
+        ngx_murmur_hash3_t           murmur3;
+    } u;
+} ngx_http_file_cache_hash_t;
+
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_lock_queue(ngx_http_cache_t *c,
+    ngx_msec_t timer);
+static void ngx_http_file_cache_wakeup(ngx_log_t *log);
+static void ngx_http_file_cache_wakeup_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_file_cache_fill_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c, uint32_t fill);
+static ngx_int_t ngx_http_file_cache_fill_send(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_fill_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_fill_write_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_refresh(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -32,23 +55,55 @@ static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
-static ngx_http_file_cache_node_t *
-    ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
+static ngx_http_file_cache_node_t *ngx_http_file_cache_lookup(
+    ngx_http_file_cache_shard_t *shard, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_file_cache_hash_init(ngx_http_file_cache_hash_t *hash,
+    ngx_uint_t type);
+static void ngx_http_file_cache_hash_update(ngx_http_file_cache_hash_t *hash,
+    const void *data, size_t size);
+static void ngx_http_file_cache_hash_final(u_char *result,
+    ngx_http_file_cache_hash_t *hash);
 static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
     size_t len, u_char *hash);
 static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
-    ngx_md5_t *md5, ngx_str_t *name);
+    ngx_http_file_cache_hash_t *hash, ngx_str_t *name);
 static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
-static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_memory_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_memory_add(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_http_file_cache_memory_t *ngx_http_file_cache_memory_alloc(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_shard_t *shard,
+    size_t size);
+static void ngx_http_file_cache_memory_free(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn);
+static size_t ngx_http_file_cache_memory_charge(size_t size);
+static void ngx_http_file_cache_sketch_add(ngx_http_file_cache_shard_t *shard,
+    u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_freq(
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+static ngx_int_t ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_cache_t *c);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard);
+static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_file_cache_delete_post(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, u_char *name);
+static void ngx_http_file_cache_delete_thread(void *data, ngx_log_t *log);
+static void ngx_http_file_cache_delete_event_handler(ngx_event_t *ev);
+#endif
+static ngx_uint_t ngx_http_file_cache_manager_busy(
+    ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -62,7 +117,124 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
-static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_set_watermark(
+    ngx_http_file_cache_shard_t *shard);
+static ngx_int_t ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache);
+static ngx_rbtree_node_t *ngx_http_file_cache_index_next(
+    ngx_http_file_cache_shard_t *shard, u_char *key);
+static ngx_int_t ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache);
+static ngx_http_file_cache_packed_t *ngx_http_file_cache_packed_create(
+    ngx_http_file_cache_t *cache);
+static u_char *ngx_http_file_cache_packed_name(ngx_http_file_cache_t *cache,
+    u_char *name, uint64_t id);
+static ngx_int_t ngx_http_file_cache_packed_alloc(ngx_http_file_cache_t *cache,
+    size_t size, ngx_uint_t *slot, off_t *offset, uint64_t *id);
+static void ngx_http_file_cache_packed_release(ngx_http_file_cache_t *cache,
+    ngx_uint_t slot, off_t dead);
+static uint64_t ngx_http_file_cache_packed_id(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_uint_t slot);
+static ngx_int_t ngx_http_file_cache_packed_write(ngx_http_file_cache_t *cache,
+    u_char *buf, size_t size, ngx_uint_t *slot, off_t *offset, uint64_t *id);
+static ngx_int_t ngx_http_file_cache_packed_store(ngx_http_request_t *r,
+    ngx_temp_file_t *tf, ngx_uint_t *slot, off_t *offset, size_t *length);
+static void ngx_http_file_cache_packed_free(ngx_http_file_cache_t *cache,
+    ngx_uint_t slot, uint64_t id, off_t offset, size_t length);
+static ngx_int_t ngx_http_file_cache_packed_load(ngx_http_file_cache_t *cache,
+    ngx_str_t *path);
+static ngx_int_t ngx_http_file_cache_packed_add(ngx_http_file_cache_t *cache,
+    ngx_uint_t slot, u_char *key, size_t length, off_t offset);
+static ngx_int_t ngx_http_file_cache_packed_compact(
+    ngx_http_file_cache_t *cache);
+
+
+#define NGX_HTTP_FILE_CACHE_INDEX_VERSION  1
+#define NGX_HTTP_FILE_CACHE_INDEX_BATCH    256
+
+#define NGX_HTTP_FILE_CACHE_SKETCH_MAX     15
+
+/* sketch counters are 4-bit, two counters per byte */
+
+#define ngx_http_file_cache_sketch_get(sketch, n)                             \
+    (((sketch)[(n) >> 1] >> (((n) & 1) << 2)) & 0x0f)
+
+#define ngx_http_file_cache_sketch_inc(sketch, n)                             \
+    (sketch)[(n) >> 1] += (u_char) (1 << (((n) & 1) << 2))
+
+#define NGX_HTTP_FILE_CACHE_RECORD_LIVE    0x6576696c
+#define NGX_HTTP_FILE_CACHE_RECORD_DEAD    0x64616564
+
+#define NGX_HTTP_FILE_CACHE_PACKED_NAME_LEN  (sizeof("/packed.") - 1 + 16)
+
+#define NGX_HTTP_FILE_CACHE_FILL_POLL      50
+
+
+#define ngx_http_file_cache_version(cache)                                    \
+    (NGX_HTTP_CACHE_VERSION | (cache)->key_hash << 8)
+
+
+#define ngx_http_file_cache_shard(cache, key)                                 \
+    (&(cache)->shards[(key)[NGX_HTTP_CACHE_KEY_LEN - 1]                        \
+                      & ((cache)->nshards - 1)])
+
+
+/* nodes are allocated from a 128-byte slab chunk */
+
+typedef char  ngx_http_file_cache_node_size_check_t
+                  [sizeof(ngx_http_file_cache_node_t) <= 128 ? 1 : -1];
+
+
+/* the index file is a header followed by entries of cache files known */
+
+typedef struct {
+    ngx_uint_t                       version;
+    size_t                           entry_size;
+    size_t                           bsize;
+    ngx_uint_t                       entries;
+    time_t                           time;
+    u_char                           level[NGX_MAX_PATH_LEVEL];
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    time_t                           valid_sec;
+    size_t                           body_start;
+    off_t                            fs_size;
+    u_short                          uses;
+    u_short                          valid_msec;
+} ngx_http_file_cache_index_entry_t;
+
+
+/*
+ * a segment of the packed storage is a file with records appended to it,
+ * each record is a header followed by the contents of a cache file
+ */
+
+typedef struct {
+    uint32_t                         magic;
+    uint32_t                         length;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+} ngx_http_file_cache_record_t;
+
+
+#define ngx_http_file_cache_record_size(len)                                  \
+    ngx_align(sizeof(ngx_http_file_cache_record_t) + (len), 8)
+
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_http_file_cache_t           *cache;
+    ngx_file_uniq_t                  uniq;
+    ngx_uint_t                       indexed;
+    ngx_err_t                        err;
+    char                            *failed;
+    u_char                          *name;
+} ngx_http_file_cache_delete_ctx_t;
+
+#endif
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -79,14 +251,22 @@ ngx_str_t  ngx_http_cache_status[] = {
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/* requests waiting for cache locks in this process */
+
+static ngx_queue_t  ngx_http_file_cache_waiters;
+static ngx_event_t  ngx_http_file_cache_wakeup_event;
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_file_cache_t  *ocache = data;
 
-    size_t                  len;
-    ngx_uint_t              n;
-    ngx_http_file_cache_t  *cache;
+    size_t                         len;
+    ngx_uint_t                     n;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_packed_t  *packed;
 
     cache = shm_zone->data;
 
@@ -110,9 +290,17 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->nshards != ocache->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different shards",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
+        cache->shards = ocache->shards;
         cache->bsize = ocache->bsize;
 
         cache->max_size /= cache->bsize;
@@ -121,52 +309,161 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             cache->path->loader = NULL;
         }
 
-        return NGX_OK;
+        goto sketch;
     }
 
     cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        cache->sh = cache->shpool->data;
+        cache->shards = cache->shpool->data;
+        cache->sh = cache->shards[0].sh;
         cache->bsize = ngx_fs_bsize(cache->path->name.data);
         cache->max_size /= cache->bsize;
 
-        return NGX_OK;
+        goto sketch;
+    }
+
+    len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
     }
 
-    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_file_cache_sh_t));
-    if (cache->sh == NULL) {
+    ngx_sprintf(cache->shpool->log_ctx, " in cache keys zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    cache->shards = ngx_slab_alloc(cache->shpool,
+                                   cache->nshards
+                                   * sizeof(ngx_http_file_cache_shard_t));
+    if (cache->shards == NULL) {
         return NGX_ERROR;
     }
 
-    cache->shpool->data = cache->sh;
+    cache->shpool->data = cache->shards;
+
+    packed = NULL;
+
+    if (cache->packed_max) {
+        packed = ngx_http_file_cache_packed_create(cache);
+        if (packed == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* the rest of the zone is split evenly between the shards */
 
-    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
-                    ngx_http_file_cache_rbtree_insert_value);
+    len = (cache->shpool->pfree / cache->nshards) << ngx_pagesize_shift;
 
-    ngx_queue_init(&cache->sh->queue);
+    for (n = 0; n < cache->nshards; n++) {
+        shard = &cache->shards[n];
 
-    cache->sh->cold = 1;
-    cache->sh->loading = 0;
-    cache->sh->size = 0;
-    cache->sh->count = 0;
-    cache->sh->watermark = (ngx_uint_t) -1;
+        if (cache->nshards == 1) {
+            shard->shpool = cache->shpool;
+
+        } else {
+            shard->shpool = ngx_slab_alloc(cache->shpool, len);
+            if (shard->shpool == NULL) {
+                return NGX_ERROR;
+            }
+
+            shard->shpool->end = (u_char *) shard->shpool + len;
+            shard->shpool->min_shift = 3;
+            shard->shpool->addr = shard->shpool;
+
+            if (ngx_shmtx_create(&shard->shpool->mutex, &shard->shpool->lock,
+                                 NULL)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ngx_slab_init(shard->shpool);
+
+            shard->shpool->log_ctx = cache->shpool->log_ctx;
+            shard->shpool->log_nomem = 0;
+        }
+
+        shard->sh = ngx_slab_alloc(shard->shpool,
+                                   sizeof(ngx_http_file_cache_sh_t));
+        if (shard->sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&shard->sh->rbtree, &shard->sh->sentinel,
+                        ngx_http_file_cache_rbtree_insert_value);
+
+        ngx_queue_init(&shard->sh->queue);
+        ngx_queue_init(&shard->sh->memory_queue);
+
+        shard->sh->cold = 1;
+        shard->sh->loading = 0;
+        shard->sh->size = 0;
+        shard->sh->count = 0;
+        shard->sh->watermark = (ngx_uint_t) -1;
+        shard->sh->memory_size = 0;
+        shard->sh->sketch = NULL;
+        shard->sh->sketch_mask = 0;
+        shard->sh->sketch_samples = 0;
+        shard->sh->hits = 0;
+        shard->sh->misses = 0;
+        shard->sh->rejected = 0;
+        shard->sh->evicted = 0;
+        shard->sh->packed = NULL;
+        shard->sh->manager_queue = 0;
+        shard->sh->manager_deleted = 0;
+        shard->sh->refresh_active = 0;
+        shard->sh->refresh_started = 0;
+    }
+
+    /* the cache state is kept in the first shard */
+
+    cache->sh = cache->shards[0].sh;
+    cache->sh->packed = packed;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
 
-    len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
+sketch:
 
-    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
-    if (cache->shpool->log_ctx == NULL) {
-        return NGX_ERROR;
+    /* packed entries may be left in the zone when packing was disabled */
+
+    if (cache->packed_max && cache->sh->packed == NULL) {
+        cache->sh->packed = ngx_http_file_cache_packed_create(cache);
+        if (cache->sh->packed == NULL) {
+            return NGX_ERROR;
+        }
     }
 
-    ngx_sprintf(cache->shpool->log_ctx, " in cache keys zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    cache->packed = cache->sh->packed;
+    cache->compact_id = 0;
 
-    cache->shpool->log_nomem = 0;
+    /* deletions are queued by a new cache manager process */
+
+    cache->sh->manager_queue = 0;
+
+    if (cache->policy != NGX_HTTP_CACHE_POLICY_TINYLFU) {
+        return NGX_OK;
+    }
+
+    for (n = 0; n < cache->nshards; n++) {
+        shard = &cache->shards[n];
+
+        if (shard->sh->sketch) {
+            continue;
+        }
+
+        shard->sh->sketch = ngx_slab_calloc(shard->shpool,
+                                            cache->sketch_size / 2);
+        if (shard->sh->sketch == NULL) {
+            return NGX_ERROR;
+        }
+
+        shard->sh->sketch_mask = cache->sketch_size - 1;
+    }
 
     return NGX_OK;
 }
@@ -227,18 +524,18 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
 void
 ngx_http_file_cache_create_key(ngx_http_request_t *r)
 {
-    size_t             len;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_md5_t          md5;
-    ngx_http_cache_t  *c;
+    size_t                       len;
+    ngx_str_t                   *key;
+    ngx_uint_t                   i;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_hash_t   hash;
 
     c = r->cache;
 
     len = 0;
 
     ngx_crc32_init(c->crc32);
-    ngx_md5_init(&md5);
+    ngx_http_file_cache_hash_init(&hash, c->file_cache->key_hash);
 
     key = c->keys.elts;
     for (i = 0; i < c->keys.nelts; i++) {
@@ -248,14 +545,14 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
         len += key[i].len;
 
         ngx_crc32_update(&c->crc32, key[i].data, key[i].len);
-        ngx_md5_update(&md5, key[i].data, key[i].len);
+        ngx_http_file_cache_hash_update(&hash, key[i].data, key[i].len);
     }
 
     c->header_start = sizeof(ngx_http_file_cache_header_t)
                       + sizeof(ngx_http_file_cache_key) + len + 1;
 
     ngx_crc32_final(c->crc32);
-    ngx_md5_final(c->key, &md5);
+    ngx_http_file_cache_hash_final(c->key, &hash);
 
     ngx_memcpy(c->main, c->key, NGX_HTTP_CACHE_KEY_LEN);
 }
@@ -265,6 +562,7 @@ ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
     ngx_int_t                  rc, rv;
+    ngx_str_t                 *name;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
     ngx_pool_cleanup_t        *cln;
@@ -345,6 +643,20 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    c->memory = 0;
+
+    if (c->exists && cache->memory_size) {
+        rc = ngx_http_file_cache_memory_open(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -356,7 +668,23 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     of.directio = NGX_OPEN_FILE_DIRECTIO_OFF;
     of.read_ahead = clcf->read_ahead;
 
-    if (ngx_open_cached_file(clcf->open_file_cache, &c->file.name, &of, r->pool)
+    if (c->packed) {
+        c->segment_name.len = cache->path->name.len
+                              + NGX_HTTP_FILE_CACHE_PACKED_NAME_LEN;
+        c->segment_name.data = ngx_pnalloc(r->pool, c->segment_name.len + 1);
+        if (c->segment_name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        (void) ngx_http_file_cache_packed_name(cache, c->segment_name.data,
+                                               c->segment);
+        name = &c->segment_name;
+
+    } else {
+        name = &c->file.name;
+    }
+
+    if (ngx_open_cached_file(clcf->open_file_cache, name, &of, r->pool)
         != NGX_OK)
     {
         switch (of.err) {
@@ -370,7 +698,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
         default:
             ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
-                          ngx_open_file_n " \"%s\" failed", c->file.name.data);
+                          ngx_open_file_n " \"%s\" failed", name->data);
             return NGX_ERROR;
         }
     }
@@ -380,9 +708,15 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
     c->file.fd = of.fd;
     c->file.log = r->connection->log;
-    c->uniq = of.uniq;
-    c->length = of.size;
-    c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
+
+    if (c->packed) {
+        c->fs_size = c->node->fs_size;
+
+    } else {
+        c->uniq = of.uniq;
+        c->length = of.size;
+        c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
+    }
 
     c->buf = ngx_create_temp_buf(r->pool, c->body_start);
     if (c->buf == NULL) {
@@ -404,8 +738,12 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    uint32_t                      fill;
+    ngx_int_t                     rc;
+    ngx_uint_t                    filling;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
     if (!c->lock) {
         return NGX_DECLINED;
@@ -414,8 +752,12 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     now = ngx_current_msec;
 
     cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    fill = 0;
+    filling = 0;
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     timer = c->node->lock_time - now;
 
@@ -424,13 +766,23 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else if (c->lock_timeout) {
+
+        if (c->node->filling && cache->read_while_write) {
+            fill = c->node->v.fill;
+            filling = 1;
+
+        } else {
+            c->node->waiters = 1;
+        }
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache lock u:%d wt:%M",
-                   c->updating, c->wait_time);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache lock u:%d f:%d wt:%M",
+                   c->updating, filling, c->wait_time);
 
     if (c->updating) {
         return NGX_DECLINED;
@@ -440,6 +792,18 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_HTTP_CACHE_SCARCE;
     }
 
+    if (filling) {
+        rc = ngx_http_file_cache_fill_open(r, c, fill);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+
+        /* the response is written or cannot be used, check again shortly */
+
+        timer = ngx_min(timer, NGX_HTTP_FILE_CACHE_FILL_POLL);
+    }
+
     c->waiting = 1;
 
     if (c->wait_time == 0) {
@@ -450,9 +814,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
-    timer = c->wait_time - now;
-
-    ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+    ngx_http_file_cache_lock_queue(c, timer);
 
     r->main->blocked++;
 
@@ -475,6 +837,11 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http file cache wait: \"%V?%V\"", &r->uri, &r->args);
 
+    if (r->cache->wait_queued) {
+        ngx_queue_remove(&r->cache->wait_queue);
+        r->cache->wait_queued = 0;
+    }
+
     rc = ngx_http_file_cache_lock_wait(r, r->cache);
 
     if (rc == NGX_AGAIN) {
@@ -502,9 +869,9 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_uint_t              wait;
-    ngx_msec_t              now, timer;
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                    wait;
+    ngx_msec_t                    now, timer;
+    ngx_http_file_cache_shard_t  *shard;
 
     now = ngx_current_msec;
 
@@ -517,21 +884,24 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_OK;
     }
 
-    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(c->file_cache, c->key);
     wait = 0;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     timer = c->node->lock_time - now;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+    if (c->node->updating && (ngx_msec_int_t) timer > 0
+        && !(c->node->filling && c->file_cache->read_while_write))
+    {
+        c->node->waiters = 1;
         wait = 1;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
     if (wait) {
-        ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+        ngx_http_file_cache_lock_queue(c, timer);
         return NGX_AGAIN;
     }
 
@@ -539,302 +909,349 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_lock_queue(ngx_http_cache_t *c, ngx_msec_t timer)
 {
-    u_char                        *p;
-    time_t                         now;
-    ssize_t                        n;
-    ngx_str_t                     *key;
-    ngx_int_t                      rc;
-    ngx_uint_t                     i;
-    ngx_http_file_cache_t         *cache;
-    ngx_http_file_cache_header_t  *h;
+    ngx_msec_t  wait;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (ngx_http_file_cache_wakeup_event.handler == NULL) {
+        ngx_queue_init(&ngx_http_file_cache_waiters);
 
-    if (n < 0) {
-        return n;
-    }
+        ngx_http_file_cache_wakeup_event.handler =
+                                            ngx_http_file_cache_wakeup_handler;
+        ngx_http_file_cache_wakeup_event.log = ngx_cycle->log;
 
-    if ((size_t) n < c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" is too small", c->file.name.data);
-        return NGX_DECLINED;
+        ngx_wakeup_event = &ngx_http_file_cache_wakeup_event;
     }
 
-    h = (ngx_http_file_cache_header_t *) c->buf->pos;
+    /*
+     * a waiting request is woken up when the lock is released,
+     * or when either the lock or the lock timeout expires
+     */
 
-    if (h->version != NGX_HTTP_CACHE_VERSION) {
-        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
-                      "cache file \"%s\" version mismatch", c->file.name.data);
-        return NGX_DECLINED;
-    }
+    wait = c->wait_time - ngx_current_msec;
 
-    if (h->crc32 != c->crc32 || (size_t) h->header_start != c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has md5 collision", c->file.name.data);
-        return NGX_DECLINED;
+    if ((ngx_msec_int_t) wait < (ngx_msec_int_t) timer) {
+        timer = ((ngx_msec_int_t) wait > 0) ? wait : 0;
     }
 
-    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
-        + sizeof(ngx_http_file_cache_key);
-
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                          "cache file \"%s\" has md5 collision",
-                          c->file.name.data);
-            return NGX_DECLINED;
-        }
-
-        p += key[i].len;
+    if (!c->wait_queued) {
+        ngx_queue_insert_tail(&ngx_http_file_cache_waiters, &c->wait_queue);
+        c->wait_queued = 1;
     }
 
-    if ((size_t) h->body_start > c->body_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has too long header",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
+    ngx_add_timer(&c->wait_event, timer);
+}
 
-    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary length",
-                      c->file.name.data);
-        return NGX_DECLINED;
-    }
 
-    if (h->vary_len) {
-        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+static void
+ngx_http_file_cache_wakeup(ngx_log_t *log)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, log, 0, "http file cache wakeup");
 
-        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache vary mismatch");
-            return ngx_http_file_cache_reopen(r, c);
-        }
+    if (ngx_http_file_cache_wakeup_event.handler) {
+        ngx_post_event(&ngx_http_file_cache_wakeup_event, &ngx_posted_events);
     }
 
-    c->buf->last += n;
+    ngx_wakeup_workers(log);
+}
 
-    c->valid_sec = h->valid_sec;
-    c->updating_sec = h->updating_sec;
-    c->error_sec = h->error_sec;
-    c->last_modified = h->last_modified;
-    c->date = h->date;
-    c->valid_msec = h->valid_msec;
-    c->body_start = h->body_start;
-    c->etag.len = h->etag_len;
-    c->etag.data = h->etag;
 
-    r->cached = 1;
+static void
+ngx_http_file_cache_wakeup_handler(ngx_event_t *ev)
+{
+    ngx_queue_t       *q;
+    ngx_http_cache_t  *c;
 
-    cache = c->file_cache;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache wakeup handler");
 
-    if (cache->sh->cold) {
+    /* the waiting requests check their locks again */
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    while (!ngx_queue_empty(&ngx_http_file_cache_waiters)) {
+        q = ngx_queue_head(&ngx_http_file_cache_waiters);
+        c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
 
-        if (!c->node->exists) {
-            c->node->uses = 1;
-            c->node->body_start = c->body_start;
-            c->node->exists = 1;
-            c->node->uniq = c->uniq;
-            c->node->fs_size = c->fs_size;
+        ngx_queue_remove(q);
+        c->wait_queued = 0;
 
-            cache->sh->size += c->fs_size;
+        if (c->wait_event.timer_set) {
+            ngx_del_timer(&c->wait_event);
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_post_event(&c->wait_event, &ngx_posted_events);
     }
+}
 
-    now = ngx_time();
 
-    if (c->valid_sec < now) {
-        c->stale_updating = c->valid_sec + c->updating_sec >= now;
-        c->stale_error = c->valid_sec + c->error_sec >= now;
-
-        ngx_shmtx_lock(&cache->shpool->mutex);
+static ngx_int_t
+ngx_http_file_cache_fill_open(ngx_http_request_t *r, ngx_http_cache_t *c,
+    uint32_t fill)
+{
+    u_char                        *p;
+    ssize_t                        n;
+    ngx_fd_t                       fd;
+    ngx_err_t                      err;
+    ngx_str_t                      name, *key;
+    ngx_uint_t                     i;
+    ngx_file_info_t                fi;
+    ngx_pool_cleanup_t            *cln;
+    ngx_pool_cleanup_file_t       *clnf;
+    ngx_http_file_cache_header_t  *h;
 
-        if (c->node->updating) {
-            rc = NGX_HTTP_CACHE_UPDATING;
+    /*
+     * a response is written to a temporary file named after the cache file,
+     * it is read while being written
+     */
 
-        } else {
-            c->node->updating = 1;
-            c->updating = 1;
-            c->lock_time = c->node->lock_time;
-            rc = NGX_HTTP_CACHE_STALE;
-        }
+    name.len = c->file.name.len + 1 + 10;
+    name.data = ngx_pnalloc(r->pool, name.len + 1);
+    if (name.data == NULL) {
+        return NGX_ERROR;
+    }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    (void) ngx_sprintf(name.data, "%V.%010uD%Z", &c->file.name, fill);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache expired: %i %T %T",
-                       rc, c->valid_sec, now);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: \"%s\"", name.data);
 
-        return rc;
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
     }
 
-    return NGX_OK;
-}
+    fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
 
-static ssize_t
-ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
-    ssize_t                    n;
-    ngx_http_core_loc_conf_t  *clcf;
+        if (err == NGX_ENOENT) {
+            return NGX_DECLINED;
+        }
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-#endif
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", name.data);
+        return NGX_ERROR;
+    }
 
-#if (NGX_HAVE_FILE_AIO)
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
 
-    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    clnf->fd = fd;
+    clnf->name = name.data;
+    clnf->log = r->pool->log;
 
-        if (n != NGX_AGAIN) {
-            c->reading = 0;
-            return n;
+    if (c->buf == NULL) {
+        c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+        if (c->buf == NULL) {
+            return NGX_ERROR;
         }
+    }
 
-        c->reading = 1;
-
-        c->file.aio->data = r;
-        c->file.aio->handler = ngx_http_cache_aio_event_handler;
+    c->buf->pos = c->buf->start;
+    c->buf->last = c->buf->start;
 
-        ngx_add_timer(&c->file.aio->event, 60000);
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
 
-        r->main->blocked++;
-        r->aio = 1;
+    n = ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
 
-        return NGX_AGAIN;
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
     }
 
-#endif
+    /* the header is written before the response is available to readers */
 
-#if (NGX_THREADS)
+    h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
-    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
-        c->file.thread_task = c->thread_task;
-        c->file.thread_handler = ngx_http_cache_thread_handler;
-        c->file.thread_ctx = r;
+    if ((size_t) n < c->header_start
+        || h->version != ngx_http_file_cache_version(c->file_cache)
+        || h->crc32 != c->crc32
+        || (size_t) h->header_start != c->header_start
+        || (size_t) h->body_start > (size_t) n
+        || h->vary_len > NGX_HTTP_CACHE_VARY_LEN)
+    {
+        goto declined;
+    }
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
+        + sizeof(ngx_http_file_cache_key);
 
-        c->thread_task = c->file.thread_task;
-        c->reading = (n == NGX_AGAIN);
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
+            goto declined;
+        }
 
-        return n;
+        p += key[i].len;
     }
 
-#endif
-
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
-}
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
 
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            goto declined;
+        }
+    }
 
-#if (NGX_HAVE_FILE_AIO)
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name.data);
+        return NGX_ERROR;
+    }
 
-static void
-ngx_http_cache_aio_event_handler(ngx_event_t *ev)
-{
-    ngx_event_aio_t     *aio;
-    ngx_connection_t    *c;
-    ngx_http_request_t  *r;
+    c->buf->last += n;
 
-    aio = ev->data;
-    r = aio->data;
-    c = r->connection;
+    c->valid_sec = h->valid_sec;
+    c->updating_sec = h->updating_sec;
+    c->error_sec = h->error_sec;
+    c->last_modified = h->last_modified;
+    c->date = h->date;
+    c->valid_msec = h->valid_msec;
+    c->body_start = h->body_start;
+    c->etag.len = h->etag_len;
+    c->etag.data = h->etag;
 
-    ngx_http_set_log_request(c->log, r);
+    /* the length is the part of the response sent so far */
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
+    c->uniq = ngx_file_uniq(&fi);
+    c->length = c->body_start;
+    c->offset = 0;
+    c->memory = 0;
+    c->packed = 0;
 
-    if (ev->timedout) {
-        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                      "aio operation took too long");
-        ev->timedout = 0;
-        return;
-    }
+    c->fill = fill;
+    c->filling = 1;
 
-    if (ev->timer_set) {
-        ngx_del_timer(ev);
-    }
+    r->cached = 1;
 
-    r->main->blocked--;
-    r->aio = 0;
+    return NGX_OK;
 
-    if (r->main->terminated) {
-        /*
-         * trigger connection event handler if the request was
-         * terminated
-         */
+declined:
 
-        c->write->handler(c->write);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill mismatch");
 
-    } else {
-        r->write_event_handler(r);
-        ngx_http_run_posted_requests(c);
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name.data);
     }
-}
 
-#endif
+    cln->handler = NULL;
+    c->file.fd = NGX_INVALID_FILE;
 
+    return NGX_DECLINED;
+}
 
-#if (NGX_THREADS)
 
 static ngx_int_t
-ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+ngx_http_file_cache_fill_send(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_str_t                  name;
-    ngx_thread_pool_t         *tp;
-    ngx_http_request_t        *r;
-    ngx_http_core_loc_conf_t  *clcf;
+    off_t                         size;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_uint_t                    done;
+    ngx_chain_t                   out;
+    ngx_event_t                  *wev;
+    ngx_file_info_t               fi;
+    ngx_http_core_loc_conf_t     *clcf;
+    ngx_http_file_cache_shard_t  *shard;
 
-    r = file->thread_ctx;
+    shard = ngx_http_file_cache_shard(c->file_cache, c->key);
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
-    tp = clcf->thread_pool;
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
-    if (tp == NULL) {
-        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
-            != NGX_OK)
-        {
-            return NGX_ERROR;
-        }
+    done = (!c->node->filling || c->node->v.fill != c->fill);
 
-        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
-        if (tp == NULL) {
+    if (ngx_fd_info(c->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        return NGX_ERROR;
+    }
+
+    size = ngx_file_size(&fi);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill send: %O of %O d:%ui",
+                   c->length, size, done);
+
+    if (done) {
+
+        /* a complete response is renamed to the cache file */
+
+        if (ngx_file_info(c->file.name.data, &fi) == NGX_FILE_ERROR
+            || ngx_file_uniq(&fi) != c->uniq)
+        {
             ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                          "thread pool \"%V\" not found", &name);
+                          "cache file \"%s\" was not completed",
+                          c->file.name.data);
             return NGX_ERROR;
         }
-    }
 
-    task->event.data = r;
-    task->event.handler = ngx_http_cache_thread_event_handler;
+    } else if (size == c->length
+               || r->aio || r->buffered || r->connection->buffered)
+    {
+        ngx_add_timer(&c->wait_event, NGX_HTTP_FILE_CACHE_FILL_POLL);
+        return NGX_DONE;
+    }
 
-    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_add_timer(&task->event, 60000);
+    b->file_pos = c->length;
+    b->file_last = size;
 
-    r->main->blocked++;
-    r->aio = 1;
+    b->in_file = (size > c->length) ? 1 : 0;
+    b->file = &c->file;
 
-    return NGX_OK;
+    if (done) {
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+
+    } else {
+        b->flush = 1;
+    }
+
+    b->sync = (b->last_buf || b->in_file) ? 0 : 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    c->length = size;
+
+    rc = ngx_http_output_filter(r, &out);
+
+    if (done || rc == NGX_ERROR) {
+        return rc;
+    }
+
+    if (r->connection->buffered) {
+        wev = r->connection->write;
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_add_timer(&c->wait_event, NGX_HTTP_FILE_CACHE_FILL_POLL);
+
+    return NGX_DONE;
 }
 
 
 static void
-ngx_http_cache_thread_event_handler(ngx_event_t *ev)
+ngx_http_file_cache_fill_handler(ngx_event_t *ev)
 {
+    ngx_int_t            rc;
     ngx_connection_t    *c;
     ngx_http_request_t  *r;
 
@@ -844,1508 +1261,4237 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
     ngx_http_set_log_request(c->log, r);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
+                   "http file cache fill: \"%V?%V\"", &r->uri, &r->args);
 
-    if (ev->timedout) {
-        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
-                      "thread operation took too long");
-        ev->timedout = 0;
-        return;
-    }
+    rc = ngx_http_file_cache_fill_send(r, r->cache);
 
-    if (ev->timer_set) {
-        ngx_del_timer(ev);
+    if (rc != NGX_DONE) {
+        ngx_http_finalize_request(r, rc);
     }
 
-    r->main->blocked--;
-    r->aio = 0;
-
-    if (r->main->terminated) {
-        /*
-         * trigger connection event handler if the request was
-         * terminated
-         */
-
-        c->write->handler(c->write);
-
-    } else {
-        r->write_event_handler(r);
-        ngx_http_run_posted_requests(c);
-    }
+    ngx_http_run_posted_requests(c);
 }
 
-#endif
-
 
-static ngx_int_t
-ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_fill_write_handler(ngx_http_request_t *r)
 {
-    ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_event_t               *wev;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    c = r->connection;
+    wev = c->write;
 
-    fcn = c->node;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache fill write handler");
 
-    if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
     }
 
-    if (fcn) {
-        ngx_queue_remove(&fcn->queue);
-
-        if (c->node == NULL) {
-            fcn->uses++;
-            fcn->count++;
+    if (!wev->delayed && !r->aio) {
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
         }
+    }
 
-        if (fcn->error) {
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-            if (fcn->valid_sec < ngx_time()) {
-                goto renew;
-            }
+    if (c->buffered) {
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
 
-            rc = NGX_OK;
+    } else if (wev->timer_set && !wev->delayed) {
+        ngx_del_timer(wev);
+    }
 
-            goto done;
-        }
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
+}
 
-        if (fcn->exists || fcn->uses >= c->min_uses) {
 
-            c->exists = fcn->exists;
-            if (fcn->body_start && !c->update_variant) {
-                c->body_start = fcn->body_start;
-            }
+static ngx_int_t
+ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                        *p;
+    time_t                         now;
+    ssize_t                        n;
+    ngx_str_t                     *key;
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_header_t  *h;
 
-            rc = NGX_OK;
+    if (c->memory) {
+        n = c->buf->end - c->buf->pos;
 
-            goto done;
-        }
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
 
-        rc = NGX_AGAIN;
+        if (n < 0) {
+            return n;
+        }
+    }
 
-        goto done;
+    if ((size_t) n < c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" is too small", c->file.name.data);
+        return NGX_DECLINED;
     }
 
-    fcn = ngx_slab_calloc_locked(cache->shpool,
-                                 sizeof(ngx_http_file_cache_node_t));
-    if (fcn == NULL) {
-        ngx_http_file_cache_set_watermark(cache);
+    h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (h->version != ngx_http_file_cache_version(c->file_cache)) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" version mismatch", c->file.name.data);
+        return NGX_DECLINED;
+    }
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+    if (h->crc32 != c->crc32 || (size_t) h->header_start != c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has md5 collision", c->file.name.data);
+        return NGX_DECLINED;
+    }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    p = c->buf->pos + sizeof(ngx_http_file_cache_header_t)
+        + sizeof(ngx_http_file_cache_key);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                          "could not allocate node%s", cache->shpool->log_ctx);
-            rc = NGX_ERROR;
-            goto failed;
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        if (ngx_memcmp(p, key[i].data, key[i].len) != 0) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                          "cache file \"%s\" has md5 collision",
+                          c->file.name.data);
+            return NGX_DECLINED;
         }
+
+        p += key[i].len;
     }
 
-    cache->sh->count++;
+    if ((size_t) h->body_start > c->body_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has too long header",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
 
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary length",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
 
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache vary mismatch");
+            return ngx_http_file_cache_reopen(r, c);
+        }
+    }
 
-    fcn->uses = 1;
-    fcn->count = 1;
+    c->buf->last += n;
 
-renew:
+    c->valid_sec = h->valid_sec;
+    c->updating_sec = h->updating_sec;
+    c->error_sec = h->error_sec;
+    c->last_modified = h->last_modified;
+    c->date = h->date;
+    c->valid_msec = h->valid_msec;
+    c->body_start = h->body_start;
+    c->etag.len = h->etag_len;
+    c->etag.data = h->etag;
 
-    rc = NGX_DECLINED;
+    r->cached = 1;
 
-    fcn->valid_msec = 0;
-    fcn->error = 0;
-    fcn->exists = 0;
-    fcn->valid_sec = 0;
-    fcn->uniq = 0;
-    fcn->body_start = 0;
-    fcn->fs_size = 0;
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-done:
+    if (cache->sh->cold) {
 
-    fcn->expire = ngx_time() + cache->inactive;
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        if (!c->node->exists) {
+            c->node->uses = 1;
+            c->node->body_start = c->body_start;
+            c->node->exists = 1;
+            c->node->u.uniq = c->uniq;
+            c->node->fs_size = c->fs_size;
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+            shard->sh->size += c->fs_size;
+        }
 
-failed:
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    now = ngx_time();
 
-    return rc;
-}
+    if (c->valid_sec < now) {
+        c->stale_updating = c->valid_sec + c->updating_sec >= now;
+        c->stale_error = c->valid_sec + c->error_sec >= now;
 
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
-{
-    u_char            *p;
-    ngx_http_cache_t  *c;
+        if (c->node->updating) {
+            rc = NGX_HTTP_CACHE_UPDATING;
 
-    c = r->cache;
+        } else {
+            c->node->updating = 1;
+            c->updating = 1;
+            c->lock_time = c->node->lock_time;
+            rc = NGX_HTTP_CACHE_STALE;
+        }
 
-    if (c->file.name.len) {
-        return NGX_OK;
-    }
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache expired: %i %T %T",
+                       rc, c->valid_sec, now);
 
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
-        return NGX_ERROR;
+        return rc;
     }
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
-
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
+    if (cache->refresh && c->valid_sec - now < cache->refresh) {
+        rc = ngx_http_file_cache_refresh(r, c);
 
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+    if (cache->memory_size && !c->memory) {
+        ngx_http_file_cache_memory_add(r, c);
+    }
 
     return NGX_OK;
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static ngx_int_t
+ngx_http_file_cache_refresh(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_int_t                     rc;
+    ngx_atomic_uint_t             n;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    /*
+     * a popular entry about to expire is served, and the request
+     * starts a background subrequest to update it
+     */
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    cache = c->file_cache;
+    shard = ngx_http_file_cache_shard(cache, c->key);
 
-    while (node != sentinel) {
+    rc = NGX_OK;
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
+    if (c->node->updating) {
+
+        if (r->background && c->node->refresh) {
+            c->refreshing = 1;
+            rc = NGX_HTTP_CACHE_STALE;
         }
 
-        /* node_key == node->key */
+    } else if (!r->background && c->node->uses >= cache->refresh_min_uses) {
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+        n = cache->sh->refresh_active;
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        if (n < cache->refresh_concurrency
+            && ngx_atomic_cmp_set(&cache->sh->refresh_active, n, n + 1))
+        {
+            c->node->updating = 1;
+            c->node->refresh = 1;
+            c->updating = 1;
+            c->lock_time = c->node->lock_time;
+            c->refresh = 1;
 
-        if (rc == 0) {
-            return fcn;
+            (void) ngx_atomic_fetch_add(&cache->sh->refresh_started, 1);
         }
-
-        node = (rc < 0) ? node->left : node->right;
     }
 
-    /* not found */
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
-    return NULL;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache refresh: %i r:%d %T",
+                   rc, c->refresh, c->valid_sec);
+
+    return rc;
 }
 
 
-static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static ssize_t
+ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
-
-    for ( ;; ) {
+#if (NGX_HAVE_FILE_AIO || NGX_THREADS)
+    ssize_t                    n;
+    ngx_http_core_loc_conf_t  *clcf;
 
-        if (node->key < temp->key) {
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
 
-            p = &temp->left;
+#if (NGX_HAVE_FILE_AIO)
 
-        } else if (node->key > temp->key) {
+    if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
+        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, c->offset,
+                               r->pool);
 
-            p = &temp->right;
+        if (n != NGX_AGAIN) {
+            c->reading = 0;
+            return n;
+        }
 
-        } else { /* node->key == temp->key */
+        c->reading = 1;
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+        c->file.aio->data = r;
+        c->file.aio->handler = ngx_http_cache_aio_event_handler;
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+        ngx_add_timer(&c->file.aio->event, 60000);
 
-        if (*p == sentinel) {
-            break;
-        }
+        r->main->blocked++;
+        r->aio = 1;
 
-        temp = *p;
+        return NGX_AGAIN;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+#endif
+
+#if (NGX_THREADS)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        c->file.thread_task = c->thread_task;
+        c->file.thread_handler = ngx_http_cache_thread_handler;
+        c->file.thread_ctx = r;
+
+        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, c->offset,
+                            r->pool);
+
+        c->thread_task = c->file.thread_task;
+        c->reading = (n == NGX_AGAIN);
+
+        return n;
+    }
+
+#endif
+
+    return ngx_read_file(&c->file, c->buf->pos, c->body_start, c->offset);
 }
 
 
+#if (NGX_HAVE_FILE_AIO)
+
 static void
-ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
-    u_char *hash)
+ngx_http_cache_aio_event_handler(ngx_event_t *ev)
 {
-    u_char     *p, *last;
-    ngx_str_t   name;
-    ngx_md5_t   md5;
-    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+    ngx_event_aio_t     *aio;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache vary: \"%*s\"", len, vary);
+    aio = ev->data;
+    r = aio->data;
+    c = r->connection;
 
-    ngx_md5_init(&md5);
-    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+    ngx_http_set_log_request(c->log, r);
 
-    ngx_strlow(buf, vary, len);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache aio: \"%V?%V\"", &r->uri, &r->args);
 
-    p = buf;
-    last = buf + len;
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "aio operation took too long");
+        ev->timedout = 0;
+        return;
+    }
 
-    while (p < last) {
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
 
-        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+    r->main->blocked--;
+    r->aio = 0;
 
-        name.data = p;
+    if (r->main->terminated) {
+        /*
+         * trigger connection event handler if the request was
+         * terminated
+         */
 
-        while (p < last && *p != ',' && *p != ' ') { p++; }
+        c->write->handler(c->write);
 
-        name.len = p - name.data;
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
 
-        if (name.len == 0) {
-            break;
+#endif
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = file->thread_ctx;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        if (ngx_http_complex_value(r, clcf->thread_pool_value, &name)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache vary: %V", &name);
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
 
-        ngx_md5_update(&md5, name.data, name.len);
-        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
 
-        ngx_http_file_cache_vary_header(r, &md5, &name);
+    task->event.data = r;
+    task->event.handler = ngx_http_cache_thread_event_handler;
 
-        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    ngx_md5_final(hash, &md5);
+    ngx_add_timer(&task->event, 60000);
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
-    ngx_str_t *name)
+ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 {
-    size_t            len;
-    u_char           *p, *start, *last;
-    ngx_uint_t        i, multiple, normalize;
-    ngx_list_part_t  *part;
-    ngx_table_elt_t  *header;
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
 
-    multiple = 0;
-    normalize = 0;
+    r = ev->data;
+    c = r->connection;
 
-    if (name->len == sizeof("Accept-Charset") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
-                           sizeof("Accept-Charset") - 1) == 0)
-    {
-        normalize = 1;
+    ngx_http_set_log_request(c->log, r);
 
-    } else if (name->len == sizeof("Accept-Encoding") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
-                           sizeof("Accept-Encoding") - 1) == 0)
-    {
-        normalize = 1;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache thread: \"%V?%V\"", &r->uri, &r->args);
 
-    } else if (name->len == sizeof("Accept-Language") - 1
-        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
-                           sizeof("Accept-Language") - 1) == 0)
-    {
-        normalize = 1;
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "thread operation took too long");
+        ev->timedout = 0;
+        return;
     }
 
-    part = &r->headers_in.headers.part;
-    header = part->elts;
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
 
-    for (i = 0; /* void */ ; i++) {
+    r->main->blocked--;
+    r->aio = 0;
 
-        if (i >= part->nelts) {
-            if (part->next == NULL) {
-                break;
+    if (r->main->terminated) {
+        /*
+         * trigger connection event handler if the request was
+         * terminated
+         */
+
+        c->write->handler(c->write);
+
+    } else {
+        r->write_event_handler(r);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_int_t                     rc;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    fcn = c->node;
+
+    if (fcn == NULL) {
+        fcn = ngx_http_file_cache_lookup(shard, c->key);
+
+        if (fcn && fcn->exists) {
+            shard->sh->hits++;
+
+        } else {
+            shard->sh->misses++;
+        }
+
+        if (shard->sh->sketch) {
+            ngx_http_file_cache_sketch_add(shard, c->key);
+        }
+    }
+
+    if (fcn) {
+        ngx_queue_remove(&fcn->queue);
+
+        if (c->node == NULL) {
+            fcn->uses++;
+            fcn->count++;
+        }
+
+        if (fcn->error) {
+
+            if (fcn->valid_sec < ngx_time()) {
+                goto renew;
             }
 
-            part = part->next;
-            header = part->elts;
-            i = 0;
+            rc = NGX_OK;
+
+            goto done;
         }
 
-        if (header[i].hash == 0) {
-            continue;
+        if (fcn->exists || fcn->uses >= c->min_uses) {
+
+            if (!fcn->exists
+                && fcn->count == 1
+                && c->node == NULL
+                && ngx_http_file_cache_admit(cache, shard, c) != NGX_OK)
+            {
+                rc = NGX_AGAIN;
+                goto done;
+            }
+
+            c->exists = fcn->exists;
+            if (fcn->body_start && !c->update_variant) {
+                c->body_start = fcn->body_start;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        rc = NGX_AGAIN;
+
+        goto done;
+    }
+
+    fcn = ngx_slab_calloc_locked(shard->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(shard);
+
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+
+        (void) ngx_http_file_cache_forced_expire(cache, shard);
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
+
+        fcn = ngx_slab_calloc_locked(shard->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", shard->shpool->log_ctx);
+            rc = NGX_ERROR;
+            goto failed;
         }
+    }
+
+    shard->sh->count++;
+
+    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_insert(&shard->sh->rbtree, &fcn->node);
+
+    fcn->uses = 1;
+    fcn->count = 1;
+
+    if (c->min_uses <= 1
+        && ngx_http_file_cache_admit(cache, shard, c) != NGX_OK)
+    {
+        rc = NGX_AGAIN;
+        goto done;
+    }
+
+renew:
+
+    rc = NGX_DECLINED;
+
+    if (fcn->memory) {
+        ngx_http_file_cache_memory_free(shard, fcn);
+    }
+
+    fcn->valid_msec = 0;
+    fcn->error = 0;
+    fcn->exists = 0;
+    fcn->valid_sec = 0;
+    fcn->u.uniq = 0;
+    fcn->body_start = 0;
+    fcn->fs_size = 0;
+    fcn->packed = 0;
+
+done:
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
+
+    c->uniq = fcn->packed ? 0 : fcn->u.uniq;
+    c->error = fcn->error;
+    c->node = fcn;
+
+    /* segments referenced by nodes are not reused */
+
+    c->packed = fcn->packed;
+    c->offset = 0;
+
+    if (fcn->packed) {
+        c->segment = ngx_http_file_cache_packed_id(cache, shard,
+                                                   fcn->u.record.segment);
+        c->offset = fcn->u.record.offset;
+        c->length = fcn->v.length;
+    }
+
+failed:
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (c->file.name.len) {
+        return NGX_OK;
+    }
+
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_shard_t *shard, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_http_file_cache_hash_init(ngx_http_file_cache_hash_t *hash,
+    ngx_uint_t type)
+{
+    hash->type = type;
+
+    if (type == NGX_HTTP_CACHE_KEY_MURMUR3) {
+        ngx_murmur_hash3_init(&hash->u.murmur3);
+
+    } else {
+        ngx_md5_init(&hash->u.md5);
+    }
+}
+
+
+static void
+ngx_http_file_cache_hash_update(ngx_http_file_cache_hash_t *hash,
+    const void *data, size_t size)
+{
+    if (hash->type == NGX_HTTP_CACHE_KEY_MURMUR3) {
+        ngx_murmur_hash3_update(&hash->u.murmur3, data, size);
+
+    } else {
+        ngx_md5_update(&hash->u.md5, data, size);
+    }
+}
+
+
+static void
+ngx_http_file_cache_hash_final(u_char *result,
+    ngx_http_file_cache_hash_t *hash)
+{
+    if (hash->type == NGX_HTTP_CACHE_KEY_MURMUR3) {
+        ngx_murmur_hash3_final(result, &hash->u.murmur3);
+
+    } else {
+        ngx_md5_final(result, &hash->u.md5);
+    }
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char                      *p, *last;
+    ngx_str_t                    name;
+    ngx_http_file_cache_hash_t   ctx;
+    u_char                       buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_http_file_cache_hash_init(&ctx, r->cache->file_cache->key_hash);
+    ngx_http_file_cache_hash_update(&ctx, r->cache->main,
+                                    NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') { p++; }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache vary: %V", &name);
+
+        ngx_http_file_cache_hash_update(&ctx, name.data, name.len);
+        ngx_http_file_cache_hash_update(&ctx, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &ctx, &name);
+
+        ngx_http_file_cache_hash_update(&ctx, (u_char *) CRLF,
+                                        sizeof(CRLF) - 1);
+    }
+
+    ngx_http_file_cache_hash_final(hash, &ctx);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r,
+    ngx_http_file_cache_hash_t *hash, ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    if (name->len == sizeof("Accept-Charset") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                           sizeof("Accept-Charset") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Encoding") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                           sizeof("Accept-Encoding") - 1) == 0)
+    {
+        normalize = 1;
+
+    } else if (name->len == sizeof("Accept-Language") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                           sizeof("Accept-Language") - 1) == 0)
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_http_file_cache_hash_update(hash, (u_char *) ",",
+                                                sizeof(",") - 1);
+            }
+
+            ngx_http_file_cache_hash_update(hash, header[i].value.data,
+                                            header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        /* normalize spaces */
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') { p++; }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_http_file_cache_hash_update(hash, (u_char *) ",",
+                                                sizeof(",") - 1);
+            }
+
+            ngx_http_file_cache_hash_update(hash, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_shard_t  *shard;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    shard = ngx_http_file_cache_shard(c->file_cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    c->secondary = 1;
+    c->file.name.len = 0;
+    c->body_start = c->buffer_size;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = ngx_http_file_cache_version(c->file_cache);
+    h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_uint_t                    wakeup;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * if the variant hash doesn't match one we used as a secondary
+     * cache key, switch back to the original key
+     */
+
+    cache = c->file_cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache main key");
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    wakeup = c->node->waiters;
+
+    c->node->count--;
+    c->node->updating = 0;
+    c->node->waiters = 0;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    if (wakeup) {
+        ngx_http_file_cache_wakeup(r->connection->log);
+    }
+
+    c->file.name.len = 0;
+    c->update_variant = 1;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                         fs_size, offset, prev_offset;
+    size_t                        length, prev_length;
+    uint64_t                      prev_id;
+    ngx_int_t                     rc;
+    ngx_uint_t                    slot, prev_slot, prev, prev_file, wakeup;
+    ngx_file_uniq_t               uniq;
+    ngx_file_info_t               fi;
+    ngx_http_cache_t             *c;
+    ngx_ext_rename_file_t         ext;
+    ngx_http_file_cache_t        *cache;
+    ngx_http_file_cache_shard_t  *shard;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    cache = c->file_cache;
+
+    c->updated = 1;
+    c->updating = 0;
+
+    uniq = 0;
+    fs_size = 0;
+
+    slot = 0;
+    offset = 0;
+    length = 0;
+
+    rc = NGX_DECLINED;
+
+    /* a response read while being written is kept in its file */
+
+    if (cache->packed_max && !c->fill_shared) {
+        rc = ngx_http_file_cache_packed_store(r, tf, &slot, &offset, &length);
+    }
+
+    if (rc == NGX_OK) {
+        fs_size = (ngx_http_file_cache_record_size(length) + cache->bsize - 1)
+                  / cache->bsize;
+        goto update;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   tf->file.name.data, c->file.name.data);
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+    if (rc == NGX_OK) {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+update:
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    /*
+     * a packed record replaced is freed, as well as a cache file
+     * replaced with a packed record
+     */
+
+    prev = (rc == NGX_OK && c->node->exists && c->node->packed);
+    prev_file = (rc == NGX_OK && length && c->node->exists
+                 && !c->node->packed);
+
+    prev_slot = c->node->u.record.segment;
+    prev_id = prev ? ngx_http_file_cache_packed_id(cache, shard, prev_slot) : 0;
+    prev_offset = c->node->u.record.offset;
+    prev_length = c->node->v.length;
+
+    if (c->node->memory) {
+        ngx_http_file_cache_memory_free(shard, c->node);
+    }
+
+    c->node->count--;
+    c->node->error = 0;
+    c->node->body_start = c->body_start;
+
+    shard->sh->size += fs_size - c->node->fs_size;
+    c->node->fs_size = fs_size;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+        c->node->indexed = 0;
+
+        c->node->packed = length ? 1 : 0;
+
+        if (length) {
+            c->node->u.record.segment = slot;
+            c->node->u.record.offset = offset;
+
+            c->node->filling = 0;
+            c->node->v.length = length;
+
+        } else {
+            c->node->u.uniq = uniq;
+        }
+
+    } else if (!c->node->packed) {
+        c->node->u.uniq = 0;
+    }
+
+    if (c->fill_shared && c->node->v.fill == c->fill) {
+        c->node->filling = 0;
+    }
+
+    wakeup = c->node->waiters;
+
+    c->node->updating = 0;
+    c->node->waiters = 0;
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    if (wakeup) {
+        ngx_http_file_cache_wakeup(r->connection->log);
+    }
+
+    if (length) {
+        ngx_http_file_cache_packed_release(cache, slot, 0);
+    }
+
+    if (prev) {
+        ngx_http_file_cache_packed_free(cache, prev_slot, prev_id, prev_offset,
+                                        prev_length);
+    }
+
+    if (prev_file && ngx_delete_file(c->file.name.data) == NGX_FILE_ERROR
+        && ngx_errno != NGX_ENOENT)
+    {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", c->file.name.data);
+    }
+}
+
+
+void
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    uint32_t                      fill;
+    ngx_int_t                     n;
+    ngx_uint_t                    wakeup;
+    ngx_msec_t                    now;
+    ngx_http_cache_t             *c;
+    ngx_http_file_cache_shard_t  *shard;
+
+    c = r->cache;
+
+    if (!c->updating || !c->file_cache->read_while_write) {
+        return;
+    }
+
+    now = ngx_current_msec;
+
+    if (c->fill_shared) {
+
+        /* the lock is kept while the response is being written */
+
+        if ((ngx_msec_int_t) (c->lock_time - now)
+            > (ngx_msec_int_t) (c->lock_age / 2))
+        {
+            return;
+        }
+
+        fill = c->fill;
+
+    } else {
+
+        /* the response is shared once its header is written */
+
+        if (tf->file.fd == NGX_INVALID_FILE
+            || tf->offset < (off_t) c->body_start
+            || tf->file.name.len != c->file.name.len + 1 + 10)
+        {
+            return;
+        }
+
+        n = ngx_atoi(tf->file.name.data + c->file.name.len + 1, 10);
+        if (n == NGX_ERROR) {
+            return;
+        }
+
+        fill = (uint32_t) n;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: %uD", fill);
+
+    shard = ngx_http_file_cache_shard(c->file_cache, c->key);
+
+    wakeup = 0;
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    if (c->node->updating && c->node->lock_time == c->lock_time) {
+        c->node->lock_time = now + c->lock_age;
+        c->lock_time = c->node->lock_time;
+
+        if (!c->fill_shared) {
+
+            if (c->node->packed) {
+                /* the fill number takes the place of the record length */
+                ngx_shmtx_unlock(&shard->shpool->mutex);
+                return;
+            }
+
+            c->node->filling = 1;
+            c->node->v.fill = fill;
+
+            wakeup = c->node->waiters;
+            c->node->waiters = 0;
+        }
+    }
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    c->fill = fill;
+    c->fill_shared = 1;
+
+    if (wakeup) {
+        ngx_http_file_cache_wakeup(r->connection->log);
+    }
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_memory_t  *m;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->packed ? c->segment_name : c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing; a packed record is only checked by its header
+     */
+
+    if (!c->packed) {
+
+        if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", file.name.data);
+            goto done;
+        }
+
+        if (c->uniq != ngx_file_uniq(&fi)
+            || c->length != ngx_file_size(&fi))
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" changed",
+                           file.name.data);
+            goto done;
+        }
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), c->offset);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != ngx_http_file_cache_version(c->file_cache)
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || (size_t) h.header_start != c->header_start
+        || (size_t) h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /*
+     * update cache file header with new data,
+     * notably h.valid_sec and h.date
+     */
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+
+    h.version = ngx_http_file_cache_version(c->file_cache);
+    h.valid_sec = c->valid_sec;
+    h.updating_sec = c->updating_sec;
+    h.error_sec = c->error_sec;
+    h.last_modified = c->last_modified;
+    h.date = c->date;
+    h.crc32 = c->crc32;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.header_start = (u_short) c->header_start;
+    h.body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h.etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h.vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    (void) ngx_write_file(&file, (u_char *) &h,
+                          sizeof(ngx_http_file_cache_header_t), c->offset);
+
+    shard = ngx_http_file_cache_shard(c->file_cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    m = c->node->memory;
+
+    if (m && m->len == (size_t) c->length
+        && c->node->packed == c->packed
+        && (!c->packed || c->node->u.record.offset == c->offset))
+    {
+        ngx_memcpy(m->data, &h, sizeof(ngx_http_file_cache_header_t));
+    }
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+    if (b->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (c->filling) {
+        c->wait_event.handler = ngx_http_file_cache_fill_handler;
+        c->wait_event.data = r;
+        c->wait_event.log = r->connection->log;
+
+        r->write_event_handler = ngx_http_file_cache_fill_write_handler;
+
+        return ngx_http_file_cache_fill_send(r, c);
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    if (c->memory) {
+        b->pos = c->buf->start + c->body_start;
+        b->last = c->buf->start + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1 : 0;
+        b->sync = (b->last_buf || b->memory) ? 0 : 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
+    b->file_pos = c->offset + c->body_start;
+    b->file_last = c->offset + c->length;
+
+    b->in_file = (c->length - c->body_start) ? 1 : 0;
+    b->sync = (b->last_buf || b->in_file) ? 0 : 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->packed ? c->segment_name : c->file.name;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                    wakeup;
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    shard = ngx_http_file_cache_shard(c->file_cache, c->key);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    wakeup = 0;
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        wakeup = fcn->waiters;
+
+        fcn->updating = 0;
+        fcn->waiters = 0;
+    }
+
+    if (c->fill_shared && fcn->v.fill == c->fill) {
+        fcn->filling = 0;
+    }
+
+    if (c->refresh) {
+        fcn->refresh = 0;
+        (void) ngx_atomic_fetch_add(&c->file_cache->sh->refresh_active, -1);
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&shard->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(shard->shpool, fcn);
+        shard->sh->count--;
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    if (wakeup) {
+        ngx_http_file_cache_wakeup(c->file.log);
+    }
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->wait_event.posted) {
+        ngx_delete_posted_event(&c->wait_event);
+    }
+
+    if (c->wait_queued) {
+        ngx_queue_remove(&c->wait_queue);
+        c->wait_queued = 0;
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_memory_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_memory_t  *m;
+
+    shard = ngx_http_file_cache_shard(c->file_cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    m = c->node->memory;
+
+    if (m == NULL) {
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, m->len);
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->buf->pos, m->data, m->len);
+
+    ngx_queue_remove(&m->queue);
+    ngx_queue_insert_head(&shard->sh->memory_queue, &m->queue);
+
+    c->length = m->len;
+    c->fs_size = c->node->fs_size;
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory: %uz", c->length);
+
+    c->memory = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_memory_add(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    u_char                        *p;
+    size_t                         size;
+    ssize_t                        n;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_node_t    *fcn;
+    ngx_http_file_cache_shard_t   *shard;
+    ngx_http_file_cache_memory_t  *m;
+
+    cache = c->file_cache;
+    fcn = c->node;
+
+    /* unlocked checks are rechecked below */
+
+    if (c->length > (off_t) cache->memory_max
+        || fcn->uses < cache->memory_min_uses
+        || fcn->memory)
+    {
+        return;
+    }
+
+    if (c->buf->last - c->buf->pos >= c->length) {
+        p = c->buf->pos;
+
+    } else {
+        p = ngx_pnalloc(r->pool, (size_t) c->length);
+        if (p == NULL) {
+            return;
+        }
+
+        n = ngx_read_file(&c->file, p, (size_t) c->length, c->offset);
+
+        if (n != c->length) {
+            return;
+        }
+    }
+
+    size = offsetof(ngx_http_file_cache_memory_t, data) + (size_t) c->length;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    /* the file may have been replaced since it was opened */
+
+    if (fcn->memory || !fcn->exists || fcn->packed != c->packed
+        || (!c->packed && fcn->u.uniq != c->uniq))
+    {
+        goto done;
+    }
+
+    if (c->packed
+        && (fcn->u.record.offset != c->offset
+            || ngx_http_file_cache_packed_id(cache, shard,
+                                             fcn->u.record.segment)
+               != c->segment))
+    {
+        goto done;
+    }
+
+    m = ngx_http_file_cache_memory_alloc(cache, shard, size);
+    if (m == NULL) {
+        goto done;
+    }
+
+    m->node = fcn;
+    m->len = (size_t) c->length;
+    ngx_memcpy(m->data, p, m->len);
+
+    ngx_queue_insert_head(&shard->sh->memory_queue, &m->queue);
+
+    fcn->memory = m;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory add: %uz", m->len);
+
+done:
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+}
+
+
+static ngx_http_file_cache_memory_t *
+ngx_http_file_cache_memory_alloc(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, size_t size)
+{
+    size_t                         charge, limit;
+    ngx_queue_t                   *q;
+    ngx_http_file_cache_memory_t  *m;
+
+    charge = ngx_http_file_cache_memory_charge(size);
+    limit = cache->memory_size / cache->nshards;
+
+    if (charge > limit) {
+        return NULL;
+    }
+
+    /*
+     * the least recently used bodies are evicted to fit the memory size,
+     * or when the zone is exhausted
+     */
+
+    for ( ;; ) {
+
+        if (shard->sh->memory_size + charge <= limit) {
+            m = ngx_slab_alloc_locked(shard->shpool, size);
+
+            if (m) {
+                shard->sh->memory_size += charge;
+                return m;
+            }
+        }
+
+        if (ngx_queue_empty(&shard->sh->memory_queue)) {
+            return NULL;
+        }
+
+        q = ngx_queue_last(&shard->sh->memory_queue);
+        m = ngx_queue_data(q, ngx_http_file_cache_memory_t, queue);
+
+        ngx_http_file_cache_memory_free(shard, m->node);
+    }
+}
+
+
+static void
+ngx_http_file_cache_memory_free(ngx_http_file_cache_shard_t *shard,
+    ngx_http_file_cache_node_t *fcn)
+{
+    size_t                         size;
+    ngx_http_file_cache_memory_t  *m;
+
+    m = fcn->memory;
+
+    ngx_queue_remove(&m->queue);
+
+    size = offsetof(ngx_http_file_cache_memory_t, data) + m->len;
+    shard->sh->memory_size -= ngx_http_file_cache_memory_charge(size);
+
+    ngx_slab_free_locked(shard->shpool, m);
+
+    fcn->memory = NULL;
+}
+
+
+static size_t
+ngx_http_file_cache_memory_charge(size_t size)
+{
+    size_t  n;
+
+    /* the slab allocator uses whole pages for large allocations */
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_align(size, ngx_pagesize);
+    }
+
+    for (n = 8; n < size; n <<= 1) { /* void */ }
+
+    return n;
+}
+
+
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_shard_t *shard, u_char *key)
+{
+    u_char                    *sketch;
+    uint32_t                   hash[4];
+    ngx_uint_t                 i, c, min, n[4];
+    ngx_http_file_cache_sh_t  *sh;
+
+    /*
+     * a count-min sketch with four 4-bit counters per key, the counters
+     * are selected by the words of the key, which is already a hash
+     */
+
+    sh = shard->sh;
+    sketch = sh->sketch;
+
+    ngx_memcpy(hash, key, sizeof(hash));
+
+    min = NGX_HTTP_FILE_CACHE_SKETCH_MAX;
+
+    for (i = 0; i < 4; i++) {
+        n[i] = hash[i] & sh->sketch_mask;
+
+        c = ngx_http_file_cache_sketch_get(sketch, n[i]);
+
+        if (c < min) {
+            min = c;
+        }
+    }
+
+    if (min < NGX_HTTP_FILE_CACHE_SKETCH_MAX) {
+
+        /* conservative update: only the smallest counters are incremented */
+
+        for (i = 0; i < 4; i++) {
+            if (ngx_http_file_cache_sketch_get(sketch, n[i]) == min) {
+                ngx_http_file_cache_sketch_inc(sketch, n[i]);
+            }
+        }
+    }
+
+    /* aging: all counters are halved after 10 samples per counter */
+
+    if (++sh->sketch_samples < 10 * (sh->sketch_mask + 1)) {
+        return;
+    }
+
+    for (i = 0; i <= sh->sketch_mask >> 1; i++) {
+        sketch[i] = (sketch[i] >> 1) & 0x77;
+    }
+
+    sh->sketch_samples /= 2;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_sketch_freq(ngx_http_file_cache_shard_t *shard,
+    u_char *key)
+{
+    u_char      *sketch;
+    uint32_t     hash[4];
+    ngx_uint_t   i, n, min;
+
+    sketch = shard->sh->sketch;
+
+    ngx_memcpy(hash, key, sizeof(hash));
+
+    min = NGX_HTTP_FILE_CACHE_SKETCH_MAX;
+
+    for (i = 0; i < 4; i++) {
+        n = hash[i] & shard->sh->sketch_mask;
+        min = ngx_min(min, ngx_http_file_cache_sketch_get(sketch, n));
+    }
+
+    return min;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_admit(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_http_cache_t *c)
+{
+    off_t                        max_size;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_sh_t    *sh;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    sh = shard->sh;
+    if (sh->sketch == NULL || ngx_queue_empty(&sh->queue)) {
+        return NGX_OK;
+    }
+
+    /* admission is only limited when an entry is to be evicted for it */
+
+    max_size = cache->max_size / cache->nshards;
+
+    if (sh->size < max_size - max_size / 16
+        && sh->count < sh->watermark)
+    {
+        return NGX_OK;
+    }
+
+    q = ngx_queue_last(&sh->queue);
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    if (ngx_http_file_cache_sketch_freq(shard, c->key)
+        > ngx_http_file_cache_sketch_freq(shard, key))
+    {
+        return NGX_OK;
+    }
+
+    sh->rejected++;
+
+    return NGX_DECLINED;
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
+    ngx_path_t                  *path;
+    ngx_queue_t                 *q, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    wait = 10;
+    tries = 20;
+    sentinel = NULL;
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    for ( ;; ) {
+        if (ngx_queue_empty(&shard->sh->queue)) {
+            break;
+        }
+
+        q = ngx_queue_last(&shard->sh->queue);
+
+        if (q == sentinel) {
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, shard, q, name);
+            shard->sh->evicted++;
+            wait = 0;
+            break;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+        if (sentinel == NULL) {
+            sentinel = q;
+        }
+
+        if (--tries) {
+            continue;
+        }
+
+        wait = 1;
+        break;
+    }
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_path_t                  *path;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        if (ngx_queue_empty(&shard->sh->queue)) {
+            wait = 10;
+            break;
+        }
+
+        if (ngx_http_file_cache_manager_busy(cache)) {
+            wait = 0;
+            break;
+        }
+
+        q = ngx_queue_last(&shard->sh->queue);
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, shard, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_queue_t *q, u_char *name)
+{
+    u_char                      *p;
+    off_t                        offset;
+    size_t                       len;
+    uint64_t                     id;
+    ngx_int_t                    rc;
+    ngx_err_t                    err;
+    ngx_uint_t                   slot;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->memory) {
+        ngx_http_file_cache_memory_free(shard, fcn);
+    }
+
+    if (fcn->exists && fcn->packed) {
+        shard->sh->size -= fcn->fs_size;
+
+        slot = fcn->u.record.segment;
+        id = ngx_http_file_cache_packed_id(cache, shard, slot);
+        offset = fcn->u.record.offset;
+        len = fcn->v.length;
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+
+        ngx_http_file_cache_packed_free(cache, slot, id, offset, len);
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+
+        /* the node does not refer to the segment anymore */
+
+        fcn->exists = 0;
+        fcn->packed = 0;
+        fcn->fs_size = 0;
+
+    } else if (fcn->exists) {
+        shard->sh->size -= fcn->fs_size;
+
+        path = cache->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        rc = NGX_DECLINED;
+
+#if (NGX_THREADS)
+
+        /*
+         * the node is freed right away, and the file is deleted
+         * by a thread unless it was replaced meanwhile
+         */
+
+        if (cache->manager_pool && fcn->count == 0) {
+            rc = ngx_http_file_cache_delete_post(cache, fcn, name);
+        }
+
+#endif
+
+        if (rc != NGX_OK) {
+            fcn->count++;
+            fcn->deleting = 1;
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+
+            if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+                err = ngx_errno;
+
+                /* a file from the index may have been removed since saved */
+
+                if (err != NGX_ENOENT || !fcn->indexed) {
+                    ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                                  ngx_delete_file_n " \"%s\" failed", name);
+                }
+            }
+
+            ngx_shmtx_lock(&shard->shpool->mutex);
+            fcn->count--;
+            fcn->deleting = 0;
+        }
+    }
+
+    if (fcn->count == 0) {
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&shard->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(shard->shpool, fcn);
+        shard->sh->count--;
+    }
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_file_cache_delete_post(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, u_char *name)
+{
+    size_t                             len;
+    ngx_path_t                        *path;
+    ngx_thread_task_t                 *task;
+    ngx_http_file_cache_delete_ctx_t  *ctx;
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    task = cache->manager_tasks;
+
+    if (task) {
+        cache->manager_tasks = task->next;
+        ctx = task->ctx;
+
+    } else {
+        task = ngx_thread_task_alloc(ngx_cycle->pool,
+                                     sizeof(ngx_http_file_cache_delete_ctx_t)
+                                     + len + 1);
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx = task->ctx;
+
+        ctx->cache = cache;
+        ctx->name = (u_char *) (ctx + 1);
+
+        task->handler = ngx_http_file_cache_delete_thread;
+        task->event.handler = ngx_http_file_cache_delete_event_handler;
+        task->event.data = task;
+        task->event.log = ngx_cycle->log;
+    }
+
+    ngx_memcpy(ctx->name, name, len + 1);
+
+    ctx->uniq = fcn->u.uniq;
+    ctx->indexed = fcn->indexed;
+
+    if (ngx_thread_task_post(cache->manager_pool, task) != NGX_OK) {
+        task->next = cache->manager_tasks;
+        cache->manager_tasks = task;
+        return NGX_ERROR;
+    }
+
+    cache->manager_queue++;
+    cache->sh->manager_queue = cache->manager_queue;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_delete_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_file_cache_delete_ctx_t *ctx = data;
+
+    ngx_file_info_t  fi;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http file cache delete thread: \"%s\"", ctx->name);
+
+    ctx->err = 0;
+
+    /* a file with the same name may have been stored after the node freed */
+
+    if (ctx->uniq) {
+        if (ngx_file_info(ctx->name, &fi) == NGX_FILE_ERROR) {
+            ctx->err = ngx_errno;
+            ctx->failed = ngx_file_info_n;
+            return;
+        }
+
+        if (ngx_file_uniq(&fi) != ctx->uniq) {
+            return;
+        }
+    }
+
+    if (ngx_delete_file(ctx->name) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+        ctx->failed = ngx_delete_file_n;
+    }
+}
+
+
+static void
+ngx_http_file_cache_delete_event_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t                 *task;
+    ngx_http_file_cache_t             *cache;
+    ngx_http_file_cache_delete_ctx_t  *ctx;
+
+    task = ev->data;
+    ctx = task->ctx;
+    cache = ctx->cache;
+
+    if (ctx->err && (ctx->err != NGX_ENOENT || !ctx->indexed)) {
+        ngx_log_error(NGX_LOG_CRIT, ev->log, ctx->err,
+                      "%s \"%s\" failed", ctx->failed, ctx->name);
+    }
+
+    task->next = cache->manager_tasks;
+    cache->manager_tasks = task;
+
+    cache->manager_queue--;
+    cache->sh->manager_queue = cache->manager_queue;
+    cache->sh->manager_deleted++;
+}
+
+#endif
+
+
+static ngx_uint_t
+ngx_http_file_cache_manager_busy(ngx_http_file_cache_t *cache)
+{
+#if (NGX_THREADS)
+
+    if (cache->manager_pool
+        && cache->manager_queue >= cache->manager_queue_max)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache manager queue full: %ui",
+                       cache->manager_queue);
+        return 1;
+    }
+
+#endif
+
+    return 0;
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t                         size, free, max_size;
+    time_t                        wait, n;
+    ngx_msec_t                    elapsed, next;
+    ngx_uint_t                    i, count, watermark;
+    ngx_http_file_cache_shard_t  *shard;
+
+#if (NGX_THREADS)
+
+    /* the pool is only started in the cache manager process */
+
+    if (cache->manager_pool
+        && ngx_thread_pool_start((ngx_cycle_t *) ngx_cycle,
+                                 cache->manager_pool)
+           != NGX_OK)
+    {
+        cache->manager_pool = NULL;
+    }
+
+#endif
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    /* shards are expired starting from a different one each time */
+
+    wait = 10;
+
+    for (i = 0; i < cache->nshards; i++) {
+        shard = &cache->shards[(cache->manager_shard + i) % cache->nshards];
+
+        n = ngx_http_file_cache_expire(cache, shard);
+
+        if (n < wait) {
+            wait = n;
+        }
+
+        if (n == 0) {
+            break;
+        }
+    }
+
+    cache->manager_shard++;
+
+    next = (ngx_msec_t) wait * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    max_size = cache->max_size / cache->nshards;
+
+    for ( ;; ) {
+        shard = NULL;
+
+        for (i = 0; i < cache->nshards; i++) {
+            ngx_shmtx_lock(&cache->shards[i].shpool->mutex);
+
+            size = cache->shards[i].sh->size;
+            count = cache->shards[i].sh->count;
+            watermark = cache->shards[i].sh->watermark;
+
+            ngx_shmtx_unlock(&cache->shards[i].shpool->mutex);
+
+            ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache size: %O c:%ui w:%i s:%ui",
+                           size, count, (ngx_int_t) watermark, i);
+
+            if (size >= max_size || count >= watermark) {
+                shard = &cache->shards[i];
+                break;
+            }
+        }
+
+        if (shard == NULL) {
+
+            if (!cache->min_free) {
+                break;
+            }
+
+            free = ngx_fs_available(cache->path->name.data);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache free: %O", free);
+
+            if (free > cache->min_free) {
+                break;
+            }
+
+            shard = &cache->shards[cache->manager_shard++ % cache->nshards];
+        }
+
+        if (ngx_http_file_cache_manager_busy(cache)) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache, shard);
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
+    }
+
+done:
+
+    if (cache->packed
+        && ngx_http_file_cache_packed_compact(cache) == NGX_AGAIN
+        && next > cache->manager_sleep)
+    {
+        next = cache->manager_sleep;
+    }
+
+    if (cache->index.len && !cache->sh->cold) {
+        if (ngx_http_file_cache_index_save(cache) == NGX_AGAIN
+            && next > cache->manager_sleep)
+        {
+            next = cache->manager_sleep;
+        }
+    }
+
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M q:%uA",
+                   cache->files, elapsed, next, cache->sh->manager_queue);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t           size;
+    ngx_uint_t      i;
+    ngx_tree_ctx_t  tree;
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    if (cache->index.len) {
+        switch (ngx_http_file_cache_index_load(cache)) {
+
+        case NGX_OK:
+
+            /*
+             * the cache is usable as is, the walk below only adds files
+             * written after the index was saved
+             */
+
+            cache->sh->cold = 0;
+            break;
+
+        case NGX_ABORT:
+            cache->sh->loading = 0;
+            return;
+        }
+    }
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    size = 0;
+
+    for (i = 0; i < cache->nshards; i++) {
+        size += cache->shards[i].sh->size;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    size_t                  len;
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    /* the index may be kept in the cache directory */
+
+    if (cache->index.len
+        && (ngx_strcmp(path->data, cache->index.data) == 0
+            || ngx_strcmp(path->data, cache->index_temp.data) == 0))
+    {
+        return NGX_OK;
+    }
+
+    /* segments of the packed storage are kept in the cache directory */
+
+    len = cache->path->name.len;
+
+    if (path->len == len + NGX_HTTP_FILE_CACHE_PACKED_NAME_LEN
+        && ngx_strncmp(path->data + len, "/packed.", 8) == 0)
+    {
+        if (ngx_http_file_cache_packed_load(cache, path) != NGX_OK) {
+            (void) ngx_http_file_cache_delete_file(ctx, path);
+        }
+
+    } else if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    c.uniq = ctx->uniq;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t   *fcn;
+    ngx_http_file_cache_shard_t  *shard;
+
+    shard = ngx_http_file_cache_shard(cache, c->key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(shard, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc_locked(shard->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(shard);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", shard->shpool->log_ctx);
+            }
 
-        if (header[i].key.len != name->len) {
-            continue;
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+            return NGX_ERROR;
         }
 
-        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
-            continue;
-        }
+        shard->sh->count++;
 
-        if (!normalize) {
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+        ngx_rbtree_insert(&shard->sh->rbtree, &fcn->node);
 
-            multiple = 1;
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
 
-            continue;
-        }
+        /* the identity lets the manager threads check the file on deletion */
 
-        /* normalize spaces */
+        fcn->u.uniq = c->uniq;
 
-        p = header[i].value.data;
-        last = p + header[i].value.len;
+        shard->sh->size += c->fs_size;
 
-        while (p < last) {
+    } else if (!cache->sh->cold) {
 
-            while (p < last && (*p == ' ' || *p == ',')) { p++; }
+        /* the node is either from the index or already in use */
 
-            start = p;
+        fcn->indexed = 0;
 
-            while (p < last && *p != ',' && *p != ' ') { p++; }
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+        return NGX_OK;
 
-            len = p - start;
+    } else {
+        ngx_queue_remove(&fcn->queue);
+    }
 
-            if (len == 0) {
-                break;
-            }
+    fcn->expire = ngx_time() + cache->inactive;
 
-            if (multiple) {
-                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
-            }
+    ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
 
-            ngx_md5_update(md5, start, len);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
-            multiple = 1;
-        }
-    }
+    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
-    ngx_http_file_cache_t  *cache;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache reopen");
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-    if (c->secondary) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has incorrect vary hash",
-                      c->file.name.data);
-        return NGX_DECLINED;
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
     }
 
-    cache = c->file_cache;
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
-    c->node->count--;
-    c->node = NULL;
-
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
+}
 
-    c->secondary = 1;
-    c->file.name.len = 0;
-    c->body_start = c->buffer_size;
 
-    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+static void
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_shard_t *shard)
+{
+    shard->sh->watermark = shard->sh->count - shard->sh->count / 8;
 
-    return ngx_http_file_cache_open(r);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", shard->sh->watermark);
 }
 
 
-ngx_int_t
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+static ngx_int_t
+ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache)
 {
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+    size_t                               len;
+    ssize_t                              n;
+    ngx_uint_t                           i;
+    ngx_msec_t                           elapsed;
+    ngx_file_t                          *file;
+    ngx_rbtree_node_t                   *node, *root, *sentinel;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_shard_t         *shard;
+    ngx_http_file_cache_index_entry_t   *e;
+    ngx_http_file_cache_index_header_t   h;
+    ngx_http_file_cache_index_entry_t    entries[NGX_HTTP_FILE_CACHE_INDEX_BATCH];
+
+    file = &cache->index_file;
+
+    if (file->fd == NGX_INVALID_FILE) {
+
+        if (ngx_time() < cache->index_next) {
+            return NGX_OK;
+        }
 
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
+        cache->index_next = ngx_time() + cache->index_interval;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
+        file->name = cache->index_temp;
+        file->log = ngx_cycle->log;
 
-    c = r->cache;
+        file->fd = ngx_open_file(file->name.data, NGX_FILE_WRONLY,
+                                 NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
-    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+        if (file->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", file->name.data);
+            return NGX_OK;
+        }
 
-    h->version = NGX_HTTP_CACHE_VERSION;
-    h->valid_sec = c->valid_sec;
-    h->updating_sec = c->updating_sec;
-    h->error_sec = c->error_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+        file->offset = sizeof(ngx_http_file_cache_index_header_t);
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h->etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+        cache->index_shard = 0;
+        cache->index_shard_nodes = 0;
+        cache->index_nodes = 0;
+        cache->index_entries = 0;
     }
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+    /*
+     * the trees of the shards are saved one by one in batches in the key
+     * order, and each batch starts after the last key seen, so the tree
+     * may change in between
+     */
+
+    len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+
+    for ( ;; ) {
+        i = 0;
+
+        shard = &cache->shards[cache->index_shard];
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
+
+        if (cache->index_shard_nodes) {
+            node = ngx_http_file_cache_index_next(shard, cache->index_key);
+
+        } else {
+            root = shard->sh->rbtree.root;
+            sentinel = shard->sh->rbtree.sentinel;
+
+            node = (root == sentinel) ? NULL : ngx_rbtree_min(root, sentinel);
         }
 
-        h->vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+        while (node && i < NGX_HTTP_FILE_CACHE_INDEX_BATCH) {
+            fcn = (ngx_http_file_cache_node_t *) node;
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
-    }
+            ngx_memcpy(cache->index_key, (u_char *) &node->key,
+                       sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&cache->index_key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       len);
 
-    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
-        return NGX_ERROR;
-    }
+            cache->index_shard_nodes++;
+            cache->index_nodes++;
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
+            /* packed entries are loaded from the segments */
 
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+            if (fcn->exists && !fcn->error && !fcn->packed) {
+                e = &entries[i++];
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
-    }
+                ngx_memzero(e, sizeof(ngx_http_file_cache_index_entry_t));
 
-    *p = LF;
+                ngx_memcpy(e->key, cache->index_key, NGX_HTTP_CACHE_KEY_LEN);
+                e->uniq = fcn->u.uniq;
+                e->expire = fcn->expire;
+                e->valid_sec = fcn->valid_sec;
+                e->body_start = fcn->body_start;
+                e->fs_size = fcn->fs_size;
+                e->uses = fcn->uses;
+                e->valid_msec = fcn->valid_msec;
+            }
 
-    return NGX_OK;
-}
+            node = ngx_rbtree_next(&shard->sh->rbtree, node);
+        }
 
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
-static ngx_int_t
-ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_t  *cache;
+        if (i) {
+            n = ngx_write_file(file, (u_char *) entries,
+                               i * sizeof(ngx_http_file_cache_index_entry_t),
+                               file->offset);
+            if (n == NGX_ERROR) {
+                goto failed;
+            }
 
-    if (!c->secondary) {
-        return NGX_OK;
-    }
+            cache->index_entries += i;
+        }
 
-    if (c->vary.len
-        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
-    {
-        return NGX_OK;
-    }
+        if (node == NULL) {
 
-    /*
-     * if the variant hash doesn't match one we used as a secondary
-     * cache key, switch back to the original key
-     */
+            if (++cache->index_shard == cache->nshards) {
+                break;
+            }
 
-    cache = c->file_cache;
+            cache->index_shard_nodes = 0;
+        }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache main key");
+        if (ngx_quit || ngx_terminate) {
+            return NGX_AGAIN;
+        }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_time_update();
 
-    c->node->count--;
-    c->node->updating = 0;
-    c->node = NULL;
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (elapsed >= cache->manager_threshold) {
+            return NGX_AGAIN;
+        }
+    }
 
-    c->file.name.len = 0;
-    c->update_variant = 1;
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_index_header_t));
 
-    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+    h.version = NGX_HTTP_FILE_CACHE_INDEX_VERSION;
+    h.entry_size = sizeof(ngx_http_file_cache_index_entry_t);
+    h.bsize = cache->bsize;
+    h.entries = cache->index_entries;
+    h.time = ngx_time();
+    ngx_memcpy(h.level, cache->path->level, NGX_MAX_PATH_LEVEL);
 
-    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
-        return NGX_ERROR;
+    if (ngx_write_file(file, (u_char *) &h, sizeof(h), 0) == NGX_ERROR) {
+        goto failed;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
-        return NGX_ERROR;
+    if (ngx_close_file(file->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file->name.data);
     }
 
-    return NGX_OK;
-}
+    file->fd = NGX_INVALID_FILE;
 
+    if (ngx_rename_file(cache->index_temp.data, cache->index.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      cache->index_temp.data, cache->index.data);
+        return NGX_OK;
+    }
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
-{
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
-    ngx_http_file_cache_t  *cache;
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index saved: %ui of %ui",
+                   cache->index_entries, cache->index_nodes);
 
-    c = r->cache;
+    return NGX_OK;
 
-    if (c->updated) {
-        return;
+failed:
+
+    if (ngx_close_file(file->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file->name.data);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    file->fd = NGX_INVALID_FILE;
 
-    cache = c->file_cache;
+    if (ngx_delete_file(file->name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", file->name.data);
+    }
 
-    c->updated = 1;
-    c->updating = 0;
+    return NGX_OK;
+}
 
-    uniq = 0;
-    fs_size = 0;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+static ngx_rbtree_node_t *
+ngx_http_file_cache_index_next(ngx_http_file_cache_shard_t *shard, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *next, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+    /* the first node with the key greater than the given one */
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    if (rc == NGX_OK) {
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
+    next = NULL;
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+    while (node != sentinel) {
 
-            rc = NGX_ERROR;
+        if (node_key < node->key) {
+            next = node;
+            node = node->left;
+            continue;
+        }
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
         }
-    }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        /* node_key == node->key */
 
-    c->node->count--;
-    c->node->error = 0;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
+        fcn = (ngx_http_file_cache_node_t *) node;
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
-    }
+        if (rc < 0) {
+            next = node;
+            node = node->left;
 
-    c->node->updating = 0;
+        } else {
+            node = node->right;
+        }
+    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return next;
 }
 
 
-void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+static ngx_int_t
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
-
-    c = r->cache;
+    size_t                               len;
+    ssize_t                              n;
+    ngx_int_t                            rc;
+    ngx_err_t                            err;
+    ngx_uint_t                           i, loaded;
+    ngx_file_t                           file;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_shard_t         *shard;
+    ngx_http_file_cache_index_entry_t   *e;
+    ngx_http_file_cache_index_header_t   h;
+    ngx_http_file_cache_index_entry_t    entries[NGX_HTTP_FILE_CACHE_INDEX_BATCH];
 
     ngx_memzero(&file, sizeof(ngx_file_t));
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    file.name = cache->index;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
     if (file.fd == NGX_INVALID_FILE) {
         err = ngx_errno;
 
-        /* cache file may have been deleted */
-
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
         }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
-        return;
+        return NGX_DECLINED;
     }
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+    rc = NGX_DECLINED;
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+    n = ngx_read_file(&file, (u_char *) &h, sizeof(h), 0);
+
+    if (n == NGX_ERROR) {
         goto done;
     }
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
+    if ((size_t) n != sizeof(h)
+        || h.version != NGX_HTTP_FILE_CACHE_INDEX_VERSION
+        || h.entry_size != sizeof(ngx_http_file_cache_index_entry_t)
+        || h.bsize != cache->bsize
+        || ngx_memcmp(h.level, cache->path->level, NGX_MAX_PATH_LEVEL) != 0)
     {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" changed",
-                       file.name.data);
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache index \"%s\" does not match the cache, ignored",
+                      file.name.data);
         goto done;
     }
 
-    n = ngx_read_file(&file, (u_char *) &h,
-                      sizeof(ngx_http_file_cache_header_t), 0);
+    len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+    loaded = 0;
 
-    if (n == NGX_ERROR) {
-        goto done;
-    }
+    for ( ;; ) {
+        n = ngx_read_file(&file, (u_char *) entries, sizeof(entries),
+                          file.offset);
 
-    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
-        goto done;
-    }
+        if (n == NGX_ERROR) {
+            goto done;
+        }
 
-    if (h.version != NGX_HTTP_CACHE_VERSION
-        || h.last_modified != c->last_modified
-        || h.crc32 != c->crc32
-        || (size_t) h.header_start != c->header_start
-        || (size_t) h.body_start != c->body_start)
-    {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache \"%s\" content changed",
-                       file.name.data);
-        goto done;
-    }
+        n /= sizeof(ngx_http_file_cache_index_entry_t);
 
-    /*
-     * update cache file header with new data,
-     * notably h.valid_sec and h.date
-     */
+        if (n == 0) {
+            break;
+        }
 
-    ngx_memzero(&h, sizeof(ngx_http_file_cache_header_t));
+        for (i = 0; i < (ngx_uint_t) n; i++) {
+            e = &entries[i];
 
-    h.version = NGX_HTTP_CACHE_VERSION;
-    h.valid_sec = c->valid_sec;
-    h.updating_sec = c->updating_sec;
-    h.error_sec = c->error_sec;
-    h.last_modified = c->last_modified;
-    h.date = c->date;
-    h.crc32 = c->crc32;
-    h.valid_msec = (u_short) c->valid_msec;
-    h.header_start = (u_short) c->header_start;
-    h.body_start = (u_short) c->body_start;
+            shard = ngx_http_file_cache_shard(cache, e->key);
 
-    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
-        h.etag_len = (u_char) c->etag.len;
-        ngx_memcpy(h.etag, c->etag.data, c->etag.len);
-    }
+            ngx_shmtx_lock(&shard->shpool->mutex);
 
-    if (c->vary.len) {
-        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
-            /* should not happen */
-            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
-        }
+            if (ngx_http_file_cache_lookup(shard, e->key)) {
+                ngx_shmtx_unlock(&shard->shpool->mutex);
+                continue;
+            }
 
-        h.vary_len = (u_char) c->vary.len;
-        ngx_memcpy(h.vary, c->vary.data, c->vary.len);
+            fcn = ngx_slab_calloc_locked(shard->shpool,
+                                         sizeof(ngx_http_file_cache_node_t));
+            if (fcn == NULL) {
+                ngx_http_file_cache_set_watermark(shard);
 
-        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
-        ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+                ngx_shmtx_unlock(&shard->shpool->mutex);
+
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "could not allocate node%s",
+                              shard->shpool->log_ctx);
+
+                rc = NGX_OK;
+                goto done;
+            }
+
+            ngx_memcpy((u_char *) &fcn->node.key, e->key,
+                       sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(fcn->key, &e->key[sizeof(ngx_rbtree_key_t)], len);
+
+            ngx_rbtree_insert(&shard->sh->rbtree, &fcn->node);
+
+            fcn->uses = e->uses;
+            fcn->valid_msec = e->valid_msec;
+            fcn->exists = 1;
+            fcn->indexed = 1;
+            fcn->u.uniq = e->uniq;
+            fcn->expire = e->expire;
+            fcn->valid_sec = e->valid_sec;
+            fcn->body_start = e->body_start;
+            fcn->fs_size = e->fs_size;
+
+            ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
+
+            shard->sh->count++;
+            shard->sh->size += e->fs_size;
+
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+
+            loaded++;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            rc = NGX_ABORT;
+            goto done;
+        }
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %ui entries loaded from index",
+                  &cache->path->name, loaded);
+
+    rc = NGX_OK;
 
 done:
 
     if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
                       ngx_close_file_n " \"%s\" failed", file.name.data);
     }
+
+    return rc;
 }
 
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
+static ngx_http_file_cache_packed_t *
+ngx_http_file_cache_packed_create(ngx_http_file_cache_t *cache)
 {
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
-
-    c = r->cache;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
-
-    /* we need to allocate all before the header would be sent */
+    size_t                         size;
+    ngx_time_t                    *tp;
+    ngx_http_file_cache_packed_t  *packed;
 
-    b = ngx_calloc_buf(r->pool);
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+    size = sizeof(ngx_http_file_cache_packed_t)
+           + (cache->packed_segments - 1)
+             * sizeof(ngx_http_file_cache_segment_t);
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    packed = ngx_slab_calloc(cache->shpool, size);
+    if (packed == NULL) {
+        return NULL;
     }
 
-    rc = ngx_http_send_header(r);
-
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
-    }
+    /*
+     * segment identifiers start from the current time in milliseconds,
+     * so segments created after a restart do not reuse names of the files
+     * left from the previous run
+     */
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    tp = ngx_timeofday();
 
-    b->in_file = (c->length - c->body_start) ? 1 : 0;
-    b->last_buf = (r == r->main) ? 1 : 0;
-    b->last_in_chain = 1;
-    b->sync = (b->last_buf || b->in_file) ? 0 : 1;
+    packed->next_id = ((uint64_t) tp->sec * 1000 + tp->msec) << 12;
+    packed->active = NGX_CONF_UNSET_UINT;
+    packed->nsegments = cache->packed_segments;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+    return packed;
+}
 
-    out.buf = b;
-    out.next = NULL;
 
-    return ngx_http_output_filter(r, &out);
+static u_char *
+ngx_http_file_cache_packed_name(ngx_http_file_cache_t *cache, u_char *name,
+    uint64_t id)
+{
+    return ngx_sprintf(name, "%V/packed.%016xL%Z", &cache->path->name, id);
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_packed_alloc(ngx_http_file_cache_t *cache, size_t size,
+    ngx_uint_t *slot, off_t *offset, uint64_t *id)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_uint_t                      i;
+    ngx_http_file_cache_packed_t   *packed;
+    ngx_http_file_cache_segment_t  *seg;
 
-    if (c->updated || c->node == NULL) {
-        return;
-    }
+    packed = cache->packed;
 
-    cache = c->file_cache;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    if (packed->active != NGX_CONF_UNSET_UINT) {
+        seg = &packed->segments[packed->active];
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        if (seg->size + (off_t) size <= cache->packed_segment) {
+            goto found;
+        }
+    }
 
-    fcn = c->node;
-    fcn->count--;
+    /* the active segment is full, it is sealed and a new one is started */
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
+    for (i = 0; i < packed->nsegments; i++) {
+        if (packed->segments[i].id == 0) {
+            break;
+        }
     }
 
-    if (c->error) {
-        fcn->error = c->error;
+    if (i == packed->nsegments) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+        if (cache->fail_time != ngx_time()) {
+            cache->fail_time = ngx_time();
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "cache \"%V\" has too many packed segments",
+                          &cache->shm_zone->shm.name);
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
+        return NGX_DECLINED;
     }
 
+    seg = &packed->segments[i];
+
+    seg->id = packed->next_id++;
+    seg->size = 0;
+    seg->live = 0;
+    seg->writers = 0;
+
+    packed->active = i;
+
+found:
+
+    *slot = packed->active;
+    *offset = seg->size;
+    *id = seg->id;
+
+    seg->size += size;
+    seg->live += size;
+    seg->writers++;
+
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    c->updated = 1;
-    c->updating = 0;
+    return NGX_OK;
+}
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
-            }
-        }
-    }
+static void
+ngx_http_file_cache_packed_release(ngx_http_file_cache_t *cache,
+    ngx_uint_t slot, off_t dead)
+{
+    ngx_http_file_cache_segment_t  *seg;
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    seg = &cache->packed->segments[slot];
+
+    seg->writers--;
+    seg->live -= dead;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static uint64_t
+ngx_http_file_cache_packed_id(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_shard_t *shard, ngx_uint_t slot)
+{
+    uint64_t  id;
+
+    /*
+     * segments are changed under the zone lock, while the shard lock is
+     * held here; with a single shard the two are the same
+     */
+
+    if (shard->shpool == cache->shpool) {
+        return cache->packed->segments[slot].id;
     }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    id = cache->packed->segments[slot].id;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return id;
 }
 
 
-static void
-ngx_http_file_cache_cleanup(void *data)
+static ngx_int_t
+ngx_http_file_cache_packed_write(ngx_http_file_cache_t *cache, u_char *buf,
+    size_t size, ngx_uint_t *slot, off_t *offset, uint64_t *id)
 {
-    ngx_http_cache_t  *c = data;
+    ssize_t     n;
+    ngx_file_t  file;
 
-    if (c->updated) {
-        return;
+    /*
+     * the segment is not compacted until the record is released,
+     * that is, until a node refers to the record
+     */
+
+    if (ngx_http_file_cache_packed_alloc(cache, size, slot, offset, id)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+    file.name.len = cache->path->name.len
+                    + NGX_HTTP_FILE_CACHE_PACKED_NAME_LEN;
+    file.name.data = ngx_alloc(file.name.len + 1, ngx_cycle->log);
+    if (file.name.data == NULL) {
+        goto failed;
+    }
+
+    (void) ngx_http_file_cache_packed_name(cache, file.name.data, *id);
+
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                            NGX_FILE_CREATE_OR_OPEN, NGX_FILE_OWNER_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        ngx_free(file.name.data);
+        goto failed;
     }
 
-    ngx_http_file_cache_free(c, NULL);
-}
+#if (NGX_HAVE_POSIX_FALLOCATE)
 
+    if (*offset == 0
+        && ngx_preallocate_file(file.fd, cache->packed_segment)
+           == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, ngx_errno,
+                      ngx_preallocate_file_n " \"%s\" failed",
+                      file.name.data);
+    }
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+#endif
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    n = ngx_write_file(&file, buf, size, *offset);
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    ngx_free(file.name.data);
+
+    if (n != (ssize_t) size) {
+        goto failed;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    return NGX_OK;
 
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
+failed:
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    /*
+     * a failed write may leave a gap which stops the loader
+     * from reading the rest of the segment
+     */
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
+    ngx_http_file_cache_packed_release(cache, *slot, size);
 
-        q = ngx_queue_last(&cache->sh->queue);
+    return NGX_DECLINED;
+}
 
-        if (q == sentinel) {
-            break;
-        }
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+static ngx_int_t
+ngx_http_file_cache_packed_store(ngx_http_request_t *r, ngx_temp_file_t *tf,
+    ngx_uint_t *slot, off_t *offset, size_t *length)
+{
+    u_char                        *buf;
+    off_t                          size, record;
+    ssize_t                        n;
+    uint64_t                       id;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_record_t  *rec;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    c = r->cache;
+    cache = c->file_cache;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
-        }
+    if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+        return NGX_DECLINED;
+    }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+    size = ngx_file_size(&fi);
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    if (size > (off_t) cache->packed_max) {
+        return NGX_DECLINED;
+    }
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    record = ngx_http_file_cache_record_size(size);
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    buf = ngx_pcalloc(r->pool, record);
+    if (buf == NULL) {
+        return NGX_DECLINED;
+    }
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    rec = (ngx_http_file_cache_record_t *) buf;
 
-        if (sentinel == NULL) {
-            sentinel = q;
-        }
+    rec->magic = NGX_HTTP_FILE_CACHE_RECORD_LIVE;
+    rec->length = (uint32_t) size;
+    ngx_memcpy(rec->key, c->key, NGX_HTTP_CACHE_KEY_LEN);
 
-        if (--tries) {
-            continue;
-        }
+    n = ngx_read_file(&tf->file, buf + sizeof(ngx_http_file_cache_record_t),
+                      (size_t) size, 0);
 
-        wait = 1;
-        break;
+    if (n != size) {
+        return NGX_DECLINED;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    if (ngx_http_file_cache_packed_write(cache, buf, (size_t) record, slot,
+                                         offset, &id)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
 
-    ngx_free(name);
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache packed: %O at %ui:%O of \"%s\"",
+                   size, *slot, *offset, tf->file.name.data);
 
-    return wait;
+    if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", tf->file.name.data);
+    }
+
+    *offset += sizeof(ngx_http_file_cache_record_t);
+    *length = (size_t) size;
+
+    return NGX_OK;
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static void
+ngx_http_file_cache_packed_free(ngx_http_file_cache_t *cache, ngx_uint_t slot,
+    uint64_t id, off_t offset, size_t length)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+    uint32_t                        magic;
+    ngx_err_t                       err;
+    ngx_file_t                      file;
+    ngx_http_file_cache_segment_t  *seg;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+    seg = &cache->packed->segments[slot];
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+    file.name.len = cache->path->name.len
+                    + NGX_HTTP_FILE_CACHE_PACKED_NAME_LEN;
+    file.name.data = ngx_alloc(file.name.len + 1, ngx_cycle->log);
+    if (file.name.data == NULL) {
+        goto done;
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
-
-    now = ngx_time();
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
-    for ( ;; ) {
-
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
-            break;
-        }
+    (void) ngx_http_file_cache_packed_name(cache, file.name.data, id);
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
-
-        q = ngx_queue_last(&cache->sh->queue);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache packed free: \"%s\" %O",
+                   file.name.data, offset);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    file.log = ngx_cycle->log;
 
-        wait = fcn->expire - now;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY, NGX_FILE_OPEN, 0);
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        /* the segment may have been compacted */
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
         }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+        ngx_free(file.name.data);
+        goto done;
+    }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    /* the record is marked as dead, so it is skipped by the loader */
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    magic = NGX_HTTP_FILE_CACHE_RECORD_DEAD;
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    (void) ngx_write_file(&file, (u_char *) &magic, sizeof(uint32_t),
+                          offset - sizeof(ngx_http_file_cache_record_t));
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
 
-next:
+    ngx_free(file.name.data);
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+done:
 
-        ngx_time_update();
+    /* the segment may have been compacted and its slot reused */
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
-        }
+    if (seg->id == id) {
+        seg->live -= ngx_http_file_cache_record_size(length);
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
-
-    return wait;
 }
 
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+static ngx_int_t
+ngx_http_file_cache_packed_load(ngx_http_file_cache_t *cache, ngx_str_t *path)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    u_char                         *p;
+    off_t                           size, offset, record, live, pos;
+    ssize_t                         n;
+    uint64_t                        id;
+    ngx_int_t                       c;
+    ngx_uint_t                      i, slot;
+    ngx_file_t                      file;
+    ngx_file_info_t                 fi;
+    ngx_http_file_cache_packed_t   *packed;
+    ngx_http_file_cache_segment_t  *seg;
+    ngx_http_file_cache_record_t    rec;
+
+    packed = cache->packed;
+
+    if (packed == NULL) {
+        return NGX_ERROR;
+    }
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    id = 0;
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    for (p = path->data + path->len - 16; p < path->data + path->len; p++) {
+        c = ngx_hextoi(p, 1);
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+        if (c == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        id = (id << 4) + c;
+    }
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+    file.name = *path;
+    file.log = ngx_cycle->log;
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+    file.fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", path->data);
+        return NGX_OK;
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", path->data);
+        goto close;
     }
-}
 
+    size = ngx_file_size(&fi);
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+    /*
+     * segments created after the start are already known;
+     * a segment being loaded is not compacted
+     */
 
-    off_t       size, free;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    slot = NGX_CONF_UNSET_UINT;
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    for (i = 0; i < packed->nsegments; i++) {
+        seg = &packed->segments[i];
 
-    if (next == 0) {
-        next = cache->manager_sleep;
-        goto done;
+        if (seg->id == id) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            goto close;
+        }
+
+        if (seg->id == 0 && slot == NGX_CONF_UNSET_UINT) {
+            slot = i;
+        }
     }
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    if (slot == NGX_CONF_UNSET_UINT) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache \"%V\" has too many packed segments",
+                      &cache->shm_zone->shm.name);
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+        if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", path->data);
+        }
+
+        return NGX_ERROR;
+    }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    seg = &packed->segments[slot];
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+    seg->id = id;
+    seg->size = size;
+    seg->live = 0;
+    seg->writers = 1;
 
-        if (size < cache->max_size && count < watermark) {
+    if (packed->next_id <= id) {
+        packed->next_id = id + 1;
+    }
 
-            if (!cache->min_free) {
-                break;
-            }
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-            free = ngx_fs_available(cache->path->name.data);
+    /* records are read up to the first one which is not valid */
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                           "http file cache free: %O", free);
+    offset = 0;
+    live = 0;
 
-            if (free > cache->min_free) {
-                break;
-            }
-        }
+    while (offset + (off_t) sizeof(ngx_http_file_cache_record_t) <= size) {
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        n = ngx_read_file(&file, (u_char *) &rec, sizeof(rec), offset);
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
+        if (n != sizeof(rec)) {
             break;
         }
 
-        if (ngx_quit || ngx_terminate) {
+        if (rec.magic != NGX_HTTP_FILE_CACHE_RECORD_LIVE
+            && rec.magic != NGX_HTTP_FILE_CACHE_RECORD_DEAD)
+        {
             break;
         }
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
+        record = ngx_http_file_cache_record_size(rec.length);
+
+        if (offset + record > size) {
             break;
         }
 
-        ngx_time_update();
-
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        pos = offset + sizeof(ngx_http_file_cache_record_t);
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
+        if (rec.magic == NGX_HTTP_FILE_CACHE_RECORD_LIVE
+            && ngx_http_file_cache_packed_add(cache, slot, rec.key, rec.length,
+                                              pos)
+               == NGX_OK)
+        {
+            live += record;
         }
+
+        offset += record;
     }
 
-done:
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache packed load: \"%s\" %O of %O",
+                   path->data, live, offset);
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+    seg->size = offset;
+    seg->live += live;
+    seg->writers--;
 
-    return next;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+close:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_file_cache_loader(void *data)
+static ngx_int_t
+ngx_http_file_cache_packed_add(ngx_http_file_cache_t *cache, ngx_uint_t slot,
+    u_char *key, size_t length, off_t offset)
 {
-    ngx_http_file_cache_t  *cache = data;
+    off_t                           fs_size;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_file_cache_shard_t    *shard;
+    ngx_http_file_cache_segment_t  *segments;
 
-    ngx_tree_ctx_t  tree;
+    segments = cache->packed->segments;
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
+    fs_size = (ngx_http_file_cache_record_size(length) + cache->bsize - 1)
+              / cache->bsize;
+
+    shard = ngx_http_file_cache_shard(cache, key);
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(shard, key);
+
+    if (fcn) {
+
+        /*
+         * a record of the key may be left in an older segment if the
+         * record was not marked as dead, the latest record is used
+         */
+
+        if (!fcn->exists
+            || !fcn->packed
+            || fcn->deleting
+            || ngx_http_file_cache_packed_id(cache, shard,
+                                             fcn->u.record.segment)
+               > segments[slot].id
+            || (fcn->u.record.segment == slot
+                && fcn->u.record.offset > offset))
+        {
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+        if (fcn->memory) {
+            ngx_http_file_cache_memory_free(shard, fcn);
+        }
+
+        goto found;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
+    fcn = ngx_slab_calloc_locked(shard->shpool,
+                                 sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_http_file_cache_set_watermark(shard);
+
+        if (cache->fail_time != ngx_time()) {
+            cache->fail_time = ngx_time();
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", shard->shpool->log_ctx);
+        }
+
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+        return NGX_ERROR;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    shard->sh->count++;
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    ngx_memcpy((u_char *) &fcn->node.key, key, sizeof(ngx_rbtree_key_t));
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ngx_memcpy(fcn->key, &key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
-    }
+    ngx_rbtree_insert(&shard->sh->rbtree, &fcn->node);
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    fcn->uses = 1;
+    fcn->exists = 1;
+    fcn->packed = 1;
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    fcn->expire = ngx_time() + cache->inactive;
 
+    ngx_queue_insert_head(&shard->sh->queue, &fcn->queue);
+
+found:
+
+    shard->sh->size += fs_size - fcn->fs_size;
+
+    fcn->fs_size = fs_size;
+    fcn->u.record.segment = slot;
+    fcn->u.record.offset = offset;
+    fcn->v.length = length;
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_packed_compact(ngx_http_file_cache_t *cache)
 {
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    u_char                         *buf;
+    off_t                           offset, record, end, pos;
+    ssize_t                         n;
+    uint64_t                        id;
+    ngx_err_t                       err;
+    ngx_int_t                       rc;
+    ngx_uint_t                      i, slot, found, moved;
+    ngx_msec_t                      elapsed;
+    ngx_file_t                      file;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_file_cache_shard_t    *shard;
+    ngx_http_file_cache_packed_t   *packed;
+    ngx_http_file_cache_segment_t  *seg;
+    ngx_http_file_cache_record_t    rec;
+
+    packed = cache->packed;
+
+    if (cache->compact_id == 0) {
 
-    cache = ctx->data;
+        /*
+         * a sealed segment with at least a half of it dead is compacted:
+         * records still in use are copied to the active segment, and
+         * the segment is removed
+         */
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        for (i = 0; i < packed->nsegments; i++) {
+            seg = &packed->segments[i];
+
+            if (seg->id
+                && i != packed->active
+                && seg->writers == 0
+                && seg->live * 2 <= seg->size)
+            {
+                cache->compact_slot = i;
+                cache->compact_id = seg->id;
+                cache->compact_offset = 0;
+                break;
+            }
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (cache->compact_id == 0) {
+            return NGX_OK;
+        }
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    seg = &packed->segments[cache->compact_slot];
+    end = seg->size;
 
-    } else {
-        ngx_time_update();
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache compact: %ui %O of %O at %O",
+                   cache->compact_slot, seg->live, end, cache->compact_offset);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_memzero(&file, sizeof(ngx_file_t));
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    file.name.len = cache->path->name.len
+                    + NGX_HTTP_FILE_CACHE_PACKED_NAME_LEN;
+    file.name.data = ngx_alloc(file.name.len + 1, ngx_cycle->log);
+    if (file.name.data == NULL) {
+        return NGX_OK;
+    }
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
+    (void) ngx_http_file_cache_packed_name(cache, file.name.data,
+                                           cache->compact_id);
+
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed", file.name.data);
+            ngx_free(file.name.data);
+            cache->compact_id = 0;
+            return NGX_OK;
         }
+
+        goto remove;
     }
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
-}
+    rc = NGX_OK;
+    offset = cache->compact_offset;
 
+    while (offset + (off_t) sizeof(ngx_http_file_cache_record_t) <= end) {
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
-    }
+        n = ngx_read_file(&file, (u_char *) &rec, sizeof(rec), offset);
 
-    return NGX_OK;
-}
+        if (n != sizeof(rec)
+            || (rec.magic != NGX_HTTP_FILE_CACHE_RECORD_LIVE
+                && rec.magic != NGX_HTTP_FILE_CACHE_RECORD_DEAD))
+        {
+            break;
+        }
 
+        record = ngx_http_file_cache_record_size(rec.length);
 
-static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
-{
-    ngx_msleep(cache->loader_sleep);
+        if (offset + record > end) {
+            break;
+        }
 
-    ngx_time_update();
+        if (rec.magic == NGX_HTTP_FILE_CACHE_RECORD_DEAD) {
+            offset += record;
+            continue;
+        }
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
-}
+        pos = offset + sizeof(ngx_http_file_cache_record_t);
 
+        shard = ngx_http_file_cache_shard(cache, rec.key);
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
-{
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+        fcn = ngx_http_file_cache_lookup(shard, rec.key);
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+        found = (fcn && fcn->exists && fcn->packed
+                 && fcn->u.record.segment == cache->compact_slot
+                 && fcn->u.record.offset == pos);
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
-    }
+        if (found && fcn->deleting) {
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
-    }
+            /* the node is being deleted, the segment is kept until then */
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+            rc = NGX_AGAIN;
+            break;
+        }
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+        if (!found) {
+            offset += record;
+            continue;
+        }
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+        buf = ngx_alloc((size_t) record, ngx_cycle->log);
+        if (buf == NULL) {
+            rc = NGX_AGAIN;
+            break;
+        }
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
+        n = ngx_read_file(&file, buf, (size_t) record, offset);
+
+        if (n != record
+            || ngx_http_file_cache_packed_write(cache, buf, (size_t) record,
+                                                &slot, &pos, &id)
+               != NGX_OK)
+        {
+            ngx_free(buf);
+            rc = NGX_AGAIN;
+            break;
         }
 
-        p += 2;
+        ngx_free(buf);
 
-        c.key[i] = (u_char) n;
-    }
+        pos += sizeof(ngx_http_file_cache_record_t);
 
-    return ngx_http_file_cache_add(cache, &c);
-}
+        /* the node may have changed while the record was copied */
 
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
-{
-    ngx_http_file_cache_node_t  *fcn;
+        fcn = ngx_http_file_cache_lookup(shard, rec.key);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        moved = (fcn && fcn->exists && fcn->packed && !fcn->deleting
+                 && fcn->u.record.segment == cache->compact_slot
+                 && fcn->u.record.offset
+                    == offset + (off_t) sizeof(ngx_http_file_cache_record_t));
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+        if (moved) {
+            fcn->u.record.segment = slot;
+            fcn->u.record.offset = pos;
+        }
 
-    if (fcn == NULL) {
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+        if (!moved) {
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+            /* the record is checked again */
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+            ngx_http_file_cache_packed_free(cache, slot, id, pos, rec.length);
+            ngx_http_file_cache_packed_release(cache, slot, 0);
+            continue;
         }
 
-        cache->sh->count++;
+        ngx_http_file_cache_packed_release(cache, slot, 0);
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        offset += record;
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        if (ngx_quit || ngx_terminate) {
+            rc = NGX_AGAIN;
+            break;
+        }
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        ngx_time_update();
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
 
-        cache->sh->size += c->fs_size;
+        if (elapsed >= cache->manager_threshold) {
+            rc = NGX_AGAIN;
+            break;
+        }
+    }
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
     }
 
-    fcn->expire = ngx_time() + cache->inactive;
+    if (rc == NGX_AGAIN) {
+        cache->compact_offset = offset;
+        ngx_free(file.name.data);
+        return NGX_AGAIN;
+    }
+
+    if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", file.name.data);
+    }
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+remove:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache compacted: \"%s\"", file.name.data);
 
-    return NGX_OK;
-}
+    ngx_free(file.name.data);
 
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+    seg = &packed->segments[cache->compact_slot];
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+    if (seg->id == cache->compact_id) {
+        seg->id = 0;
     }
 
-    return NGX_OK;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    cache->compact_id = 0;
+
+    /* other segments may need compaction as well */
+
+    return NGX_AGAIN;
 }
 
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_t *
+ngx_http_file_cache_from_path(ngx_path_t *path)
 {
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+    if (path->manager != ngx_http_file_cache_manager) {
+        return NULL;
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+    return path->data;
 }
 
 
@@ -2380,15 +5526,20 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     char  *confp = conf;
 
-    off_t                   max_size, min_free;
+    off_t                   max_size, min_free, packed_segment;
     u_char                 *last, *p;
-    time_t                  inactive;
+    time_t                  inactive, index_interval, refresh;
+    size_t                  memory_size, memory_max, sketch_size, packed_max,
+                            refresh_rate;
     ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files, manager_files;
+    ngx_str_t               s, name, index, manager_threads, *value;
+    ngx_int_t               loader_files, manager_files, memory_min_uses,
+                            shards, manager_queue, refresh_min_uses,
+                            refresh_concurrency;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, read_while_write, policy,
+                            key_hash, packed_segments;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2403,6 +5554,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     use_temp_path = 1;
+    read_while_write = 0;
 
     inactive = 600;
 
@@ -2414,6 +5566,28 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     manager_sleep = 50;
     manager_threshold = 200;
 
+    ngx_str_null(&manager_threads);
+    manager_queue = 64;
+
+    ngx_str_null(&index);
+    index_interval = 60;
+
+    memory_size = 0;
+    memory_max = 16384;
+    memory_min_uses = 2;
+
+    refresh = 0;
+    refresh_min_uses = 2;
+    refresh_concurrency = 8;
+    refresh_rate = 0;
+
+    policy = NGX_HTTP_CACHE_POLICY_LRU;
+    key_hash = NGX_HTTP_CACHE_KEY_MD5;
+    shards = 1;
+
+    packed_max = 0;
+    packed_segment = 4 * 1024 * 1024;
+
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
@@ -2489,6 +5663,25 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "read_while_write=", 17) == 0) {
+
+            if (ngx_strcmp(&value[i].data[17], "on") == 0) {
+                read_while_write = 1;
+
+            } else if (ngx_strcmp(&value[i].data[17], "off") == 0) {
+                read_while_write = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid read_while_write value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2660,6 +5853,247 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "manager_threads=", 16) == 0) {
+
+            manager_threads.len = value[i].len - 16;
+            manager_threads.data = value[i].data + 16;
+
+            if (manager_threads.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid manager_threads value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "manager_queue=", 14) == 0) {
+
+            manager_queue = ngx_atoi(value[i].data + 14, value[i].len - 14);
+            if (manager_queue == NGX_ERROR || manager_queue == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid manager_queue value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_tier=", 12) == 0) {
+
+            s.len = value[i].len - 12;
+            s.data = value[i].data + 12;
+
+            memory_size = ngx_parse_size(&s);
+            if (memory_size == (size_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_tier value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_tier_max=", 16) == 0) {
+
+            s.len = value[i].len - 16;
+            s.data = value[i].data + 16;
+
+            memory_max = ngx_parse_size(&s);
+            if (memory_max == (size_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_tier_max value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_tier_min_uses=", 21) == 0) {
+
+            memory_min_uses = ngx_atoi(value[i].data + 21, value[i].len - 21);
+            if (memory_min_uses == NGX_ERROR || memory_min_uses > 1023) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                      "invalid memory_tier_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            refresh = ngx_parse_time(&s, 1);
+            if (refresh == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid refresh value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh_min_uses=", 17) == 0) {
+
+            refresh_min_uses = ngx_atoi(value[i].data + 17, value[i].len - 17);
+            if (refresh_min_uses == NGX_ERROR || refresh_min_uses > 1023) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                          "invalid refresh_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh_concurrency=", 20) == 0) {
+
+            refresh_concurrency = ngx_atoi(value[i].data + 20,
+                                           value[i].len - 20);
+            if (refresh_concurrency == NGX_ERROR || refresh_concurrency == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid refresh_concurrency value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "refresh_rate=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            refresh_rate = ngx_parse_size(&s);
+            if (refresh_rate == (size_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid refresh_rate value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            index.len = value[i].len - 6;
+            index.data = value[i].data + 6;
+
+            if (ngx_conf_full_name(cf->cycle, &index, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "policy=", 7) == 0) {
+
+            if (ngx_strcmp(&value[i].data[7], "lru") == 0) {
+                policy = NGX_HTTP_CACHE_POLICY_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[7], "tinylfu") == 0) {
+                policy = NGX_HTTP_CACHE_POLICY_TINYLFU;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid policy \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "key_hash=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "md5") == 0) {
+                key_hash = NGX_HTTP_CACHE_KEY_MD5;
+
+            } else if (ngx_strcmp(&value[i].data[9], "murmur3") == 0) {
+                key_hash = NGX_HTTP_CACHE_KEY_MURMUR3;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid key_hash \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 64 || (shards & (shards - 1))) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards value \"%V\", "
+                                   "must be a power of two up to 64",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+            if (shards > 1) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"shards\" require atomic operations");
+                return NGX_CONF_ERROR;
+            }
+#endif
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "packed=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            packed_max = ngx_parse_size(&s);
+            if (packed_max == (size_t) NGX_ERROR
+                || packed_max > NGX_MAX_INT32_VALUE)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid packed value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "packed_segment=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            packed_segment = ngx_parse_offset(&s);
+            if (packed_segment <= 0
+                || packed_segment > (off_t) NGX_MAX_UINT32_VALUE)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid packed_segment value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -2672,6 +6106,15 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    /* readers find a response being written by the cache file name */
+
+    if (read_while_write && use_temp_path) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"read_while_write\" requires "
+                           "\"use_temp_path=off\"");
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -2684,10 +6127,135 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
 
+    if (manager_threads.len) {
+#if (NGX_THREADS)
+        cache->manager_pool = ngx_thread_pool_add(cf, &manager_threads);
+        if (cache->manager_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        cache->manager_queue_max = manager_queue;
+#else
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"manager_threads\" is unsupported "
+                           "on this platform");
+        return NGX_CONF_ERROR;
+#endif
+    }
+
+    /* bodies kept in memory are allocated from the keys zone */
+
+    cache->memory_size = memory_size;
+    cache->memory_max = memory_max;
+    cache->memory_min_uses = memory_min_uses;
+
+    cache->refresh = refresh;
+    cache->refresh_min_uses = refresh_min_uses;
+    cache->refresh_concurrency = refresh_concurrency;
+
+    /*
+     * "refresh_rate" is a budget shared by all refreshes of the cache,
+     * each of at most "refresh_concurrency" refreshes is limited to its share
+     */
+
+    if (refresh_rate) {
+        refresh_rate /= refresh_concurrency;
+        cache->refresh_rate = refresh_rate ? refresh_rate : 1;
+    }
+
+    if (index.len) {
+        cache->index = index;
+        cache->index_interval = index_interval;
+
+        cache->index_temp.len = index.len + sizeof(".tmp") - 1;
+        cache->index_temp.data = ngx_pnalloc(cf->pool,
+                                             cache->index_temp.len + 1);
+        if (cache->index_temp.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->index_temp.data, "%V.tmp%Z", &index);
+    }
+
+    cache->index_file.fd = NGX_INVALID_FILE;
+
+    if (shards > 1 && size / shards < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "keys zone \"%V\" is too small for %i shards",
+                           &name, shards);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the sketch of a shard has a counter per node which fits into it */
+
+    sketch_size = 0;
+
+    if (policy == NGX_HTTP_CACHE_POLICY_TINYLFU) {
+        sketch_size = 1024;
+
+        while (sketch_size
+               < size / shards / sizeof(ngx_http_file_cache_node_t))
+        {
+            sketch_size *= 2;
+        }
+    }
+
+    cache->policy = policy;
+    cache->key_hash = key_hash;
+    cache->sketch_size = sketch_size;
+    cache->nshards = shards;
+
+    /*
+     * responses up to the "packed" size are appended to segment files,
+     * there are enough segments for the cache of the maximum size
+     * with up to a half of each segment dead
+     */
+
+    packed_segments = 0;
+
+    if (packed_max) {
+
+        if (packed_segment
+            < (off_t) ngx_http_file_cache_record_size(packed_max))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"packed_segment\" is too small "
+                               "for \"packed\" responses");
+            return NGX_CONF_ERROR;
+        }
+
+        if (max_size == NGX_MAX_OFF_T_VALUE) {
+            packed_segments = 4096;
+
+        } else {
+            packed_segments = 2 * (ngx_uint_t) ngx_min(max_size
+                                                       / packed_segment,
+                                                       32768)
+                              + 16;
+        }
+    }
+
+    cache->packed_max = packed_max;
+    cache->packed_segment = packed_segment;
+    cache->packed_segments = packed_segments;
+
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
+    /* each shard is a separate slab pool with its own header */
+
+    size += memory_size + shards * sketch_size / 2;
+
+    if (packed_max) {
+        size += sizeof(ngx_http_file_cache_packed_t)
+                + packed_segments * sizeof(ngx_http_file_cache_segment_t);
+    }
+
+    if (shards > 1) {
+        size += shards * 2 * ngx_pagesize;
+    }
+
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
@@ -2704,6 +6272,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->data = cache;
 
     cache->use_temp_path = use_temp_path;
+    cache->read_while_write = read_while_write;
 
     cache->inactive = inactive;
     cache->max_size = max_size;
@@ -18,10 +18,28 @@ typedef struct {
 } ngx_http_huff_decode_code_t;
 
 
+/* a byte at a time table, built from the nibble one */
+
+typedef struct {
+    u_char  next;
+    u_char  flags;
+    u_char  sym[2];
+} ngx_http_huff_decode_byte_t;
+
+
+#define NGX_HTTP_HUFF_DECODE_EMIT      0x03
+#define NGX_HTTP_HUFF_DECODE_ENDING    0x04
+#define NGX_HTTP_HUFF_DECODE_ERROR     0x08
+
+
 static ngx_inline ngx_int_t ngx_http_huff_decode_bits(u_char *state,
     u_char *ending, ngx_uint_t bits, u_char **dst);
 
 
+static ngx_uint_t                   ngx_http_huff_decode_ready;
+static ngx_http_huff_decode_byte_t  ngx_http_huff_decode_bytes[256][256];
+
+
 static ngx_http_huff_decode_code_t  ngx_http_huff_decode_codes[256][16] =
 {
     /* 0 */
@@ -2639,43 +2657,97 @@ static ngx_http_huff_decode_code_t  ngx_http_huff_decode_codes[256][16] =
 };
 
 
+void
+ngx_http_huff_decode_init(void)
+{
+    u_char                        state, ending, *p;
+    ngx_uint_t                    i, ch;
+    ngx_http_huff_decode_byte_t  *code;
+
+    if (ngx_http_huff_decode_ready) {
+        return;
+    }
+
+    /*
+     * a byte consists of two nibble transitions, each emitting at most
+     * one symbol, as the shortest code is 5 bits long
+     */
+
+    for (i = 0; i < 256; i++) {
+        for (ch = 0; ch < 256; ch++) {
+            code = &ngx_http_huff_decode_bytes[i][ch];
+
+            state = (u_char) i;
+            ending = 0;
+            p = code->sym;
+
+            if (ngx_http_huff_decode_bits(&state, &ending, ch >> 4, &p)
+                != NGX_OK
+                || ngx_http_huff_decode_bits(&state, &ending, ch & 0xf, &p)
+                   != NGX_OK)
+            {
+                code->flags = NGX_HTTP_HUFF_DECODE_ERROR;
+                continue;
+            }
+
+            code->next = state;
+            code->flags = (u_char) (p - code->sym);
+
+            if (ending) {
+                code->flags |= NGX_HTTP_HUFF_DECODE_ENDING;
+            }
+        }
+    }
+
+    ngx_http_huff_decode_ready = 1;
+}
+
+
 ngx_int_t
 ngx_http_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     ngx_uint_t last, ngx_log_t *log)
 {
-    u_char  *end, ch, ending;
+    u_char                       *end, *d, ch, flags;
+    ngx_http_huff_decode_byte_t  *code;
 
     ch = 0;
-    ending = 1;
+    flags = NGX_HTTP_HUFF_DECODE_ENDING;
 
+    d = *dst;
     end = src + len;
 
     while (src != end) {
         ch = *src++;
 
-        if (ngx_http_huff_decode_bits(state, &ending, ch >> 4, dst)
-            != NGX_OK)
-        {
+        code = &ngx_http_huff_decode_bytes[*state][ch];
+        flags = code->flags;
+
+        if (flags & NGX_HTTP_HUFF_DECODE_ERROR) {
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch >> 4);
+                           "bad code 0x%Xd", *state, ch);
 
+            *dst = d;
             return NGX_ERROR;
         }
 
-        if (ngx_http_huff_decode_bits(state, &ending, ch & 0xf, dst)
-            != NGX_OK)
-        {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
-                           "http huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch & 0xf);
-
-            return NGX_ERROR;
+        switch (flags & NGX_HTTP_HUFF_DECODE_EMIT) {
+        case 2:
+            *d++ = code->sym[0];
+            *d++ = code->sym[1];
+            break;
+        case 1:
+            *d++ = code->sym[0];
+            break;
         }
+
+        *state = code->next;
     }
 
+    *dst = d;
+
     if (last) {
-        if (!ending) {
+        if (!(flags & NGX_HTTP_HUFF_DECODE_ENDING)) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http huffman decoding error: "
                            "incomplete code 0x%Xd", ch);
@@ -2690,7 +2762,6 @@ ngx_http_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
 }
 
 
-
 static ngx_inline ngx_int_t
 ngx_http_huff_decode_bits(u_char *state, u_char *ending, ngx_uint_t bits,
     u_char **dst)
@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
 
 static uint32_t  usual[] = {
     0x00000000, /* 0000 0000 0000 0000  0000 0000 0000 0000 */
@@ -98,6 +102,72 @@ static uint32_t  usual[] = {
 #endif
 
 
+#if (NGX_HAVE_SSE2)
+
+/*
+ * the fast paths below skip 16 bytes at a time up to the first byte
+ * the state machine has to look at; the tail is left to the state machine
+ */
+
+static ngx_inline u_char *
+ngx_http_parse_skip_uri(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  v, t;
+
+    /* stop at controls, space, "#" and DEL */
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((__m128i *) p);
+
+        t = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x20)), v);
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+
+        mask = _mm_movemask_epi8(t);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+static ngx_inline u_char *
+ngx_http_parse_skip_value(u_char *p, u_char *last)
+{
+    int      mask;
+    __m128i  v, t;
+
+    /* stop at space, CR, LF and NUL */
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((__m128i *) p);
+
+        t = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, _mm_set1_epi8(CR)));
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, _mm_set1_epi8(LF)));
+        t = _mm_or_si128(t, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+        mask = _mm_movemask_epi8(t);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+#endif
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 
 ngx_int_t
@@ -602,6 +672,9 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+#if (NGX_HAVE_SSE2)
+                p = ngx_http_parse_skip_uri(p + 1, b->last) - 1;
+#endif
                 break;
             }
 
@@ -1009,6 +1082,11 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
             case '\0':
                 r->header_end = p;
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+#if (NGX_HAVE_SSE2)
+            default:
+                p = ngx_http_parse_skip_value(p + 1, b->last) - 1;
+                break;
+#endif
             }
             break;
 
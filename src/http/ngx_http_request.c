@@ -3830,6 +3830,16 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
         }
     }
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+    /* the request memory may still be referenced by zerocopy sends */
+
+    if (r->connection->zerocopy) {
+        ngx_linux_zerocopy_abort(r->connection);
+    }
+
+#endif
+
     /* the various request strings were allocated from r->pool */
     ctx = log->data;
     ctx->request = NULL;
@@ -876,6 +876,10 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_ERROR;
         }
 
+        /* the cache is needed to hash the key */
+
+        r->cache->file_cache = cache;
+
         if (u->create_key(r) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -901,7 +905,6 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         c->body_start = u->conf->buffer_size;
         c->min_uses = u->conf->cache_min_uses;
-        c->file_cache = cache;
 
         switch (ngx_http_test_predicates(r, u->conf->cache_bypass)) {
 
@@ -964,6 +967,15 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     case NGX_OK:
         u->cache_status = NGX_HTTP_CACHE_HIT;
+
+        if (c->refresh) {
+            if (ngx_http_upstream_cache_background_update(r, u) == NGX_OK) {
+                r->cache->background = 1;
+
+            } else {
+                rc = NGX_ERROR;
+            }
+        }
     }
 
     switch (rc) {
@@ -1116,6 +1128,11 @@ ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return NGX_DONE;
         }
 
+        if (c->filling) {
+            /* the response is still being written */
+            r->single_range = 1;
+        }
+
         return ngx_http_cache_send(r);
     }
 
@@ -3437,6 +3454,15 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     p->pool = r->pool;
     p->log = c->log;
     p->limit_rate = ngx_http_complex_value_size(r, u->conf->limit_rate, 0);
+
+#if (NGX_HTTP_CACHE)
+    if (r->cache && r->cache->refreshing && r->cache->file_cache->refresh_rate
+        && (p->limit_rate == 0
+            || p->limit_rate > r->cache->file_cache->refresh_rate))
+    {
+        p->limit_rate = r->cache->file_cache->refresh_rate;
+    }
+#endif
     p->start_sec = ngx_time();
 
     p->cacheable = u->cacheable || u->store;
@@ -4403,6 +4429,9 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
             } else if (p->upstream_error) {
                 ngx_http_file_cache_free(r->cache, p->temp_file);
+
+            } else {
+                ngx_http_file_cache_fill(r, p->temp_file);
             }
         }
 
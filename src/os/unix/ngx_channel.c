@@ -150,7 +150,25 @@ ngx_read_channel(ngx_socket_t s, ngx_channel_t *ch, size_t size, ngx_log_t *log)
 
 #if (NGX_HAVE_MSGHDR_MSG_CONTROL)
 
-    if (ch->command == NGX_CMD_OPEN_CHANNEL) {
+    if (ch->command == NGX_CMD_PASS_CONNECTION
+        && ((size_t) msg.msg_controllen < CMSG_LEN(sizeof(int))
+            || cmsg.cm.cmsg_len < (socklen_t) CMSG_LEN(sizeof(int))))
+    {
+        /*
+         * the kernel drops the descriptor if it cannot be installed,
+         * e.g., at RLIMIT_NOFILE; only the message is lost then
+         */
+
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "recvmsg() returned no passed connection descriptor");
+
+        ch->fd = -1;
+        return n;
+    }
+
+    if (ch->command == NGX_CMD_OPEN_CHANNEL
+        || ch->command == NGX_CMD_PASS_CONNECTION)
+    {
 
         if (cmsg.cm.cmsg_len < (socklen_t) CMSG_LEN(sizeof(int))) {
             ngx_log_error(NGX_LOG_ALERT, log, 0,
@@ -179,7 +197,19 @@ ngx_read_channel(ngx_socket_t s, ngx_channel_t *ch, size_t size, ngx_log_t *log)
 
 #else
 
-    if (ch->command == NGX_CMD_OPEN_CHANNEL) {
+    if (ch->command == NGX_CMD_PASS_CONNECTION
+        && msg.msg_accrightslen != sizeof(int))
+    {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "recvmsg() returned no passed connection descriptor");
+
+        ch->fd = -1;
+        return n;
+    }
+
+    if (ch->command == NGX_CMD_OPEN_CHANNEL
+        || ch->command == NGX_CMD_PASS_CONNECTION)
+    {
         if (msg.msg_accrightslen != sizeof(int)) {
             ngx_log_error(NGX_LOG_ALERT, log, 0,
                           "recvmsg() returned no ancillary data");
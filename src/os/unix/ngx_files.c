@@ -830,6 +830,26 @@ ngx_read_ahead(ngx_fd_t fd, size_t n)
 #endif
 
 
+#if (NGX_HAVE_POSIX_FALLOCATE)
+
+ngx_int_t
+ngx_preallocate_file(ngx_fd_t fd, off_t size)
+{
+    int  err;
+
+    err = posix_fallocate(fd, 0, size);
+
+    if (err == 0) {
+        return 0;
+    }
+
+    ngx_set_errno(err);
+    return NGX_FILE_ERROR;
+}
+
+#endif
+
+
 #if (NGX_HAVE_O_DIRECT)
 
 ngx_int_t
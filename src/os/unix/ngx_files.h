@@ -284,6 +284,7 @@ ngx_de_info(u_char *name, ngx_dir_t *dir)
 #define ngx_de_fs_size(dir)                                                  \
     ngx_max((dir)->info.st_size, (dir)->info.st_blocks * 512)
 #define ngx_de_mtime(dir)        (dir)->info.st_mtime
+#define ngx_de_uniq(dir)         (dir)->info.st_ino
 
 
 ngx_int_t ngx_open_glob(ngx_glob_t *gl);
@@ -323,6 +324,14 @@ ngx_int_t ngx_read_ahead(ngx_fd_t fd, size_t n);
 #endif
 
 
+#if (NGX_HAVE_POSIX_FALLOCATE)
+
+ngx_int_t ngx_preallocate_file(ngx_fd_t fd, off_t size);
+#define ngx_preallocate_file_n   "posix_fallocate()"
+
+#endif
+
+
 #if (NGX_HAVE_O_DIRECT)
 
 ngx_int_t ngx_directio_on(ngx_fd_t fd);
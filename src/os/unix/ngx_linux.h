@@ -12,5 +12,9 @@
 ngx_chain_t *ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in,
     off_t limit);
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+void ngx_linux_zerocopy_abort(ngx_connection_t *c);
+#endif
+
 
 #endif /* _NGX_LINUX_H_INCLUDED_ */
@@ -97,6 +97,9 @@ extern ssize_t sendfile(int s, int fd, int32_t *offset, size_t size);
 #include <sys/eventfd.h>
 #endif
 #include <sys/syscall.h>
+#if (NGX_HAVE_IO_URING)
+#include <linux/io_uring.h>
+#endif
 #if (NGX_HAVE_FILE_AIO)
 #include <linux/aio_abi.h>
 typedef struct iocb  ngx_aiocb_t;
@@ -111,6 +114,10 @@ typedef struct iocb  ngx_aiocb_t;
 #include <netinet/udp.h>
 #endif
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#endif
+
 
 #define NGX_LISTEN_BACKLOG        511
 
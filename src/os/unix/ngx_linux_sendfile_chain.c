@@ -25,6 +25,47 @@ static ssize_t ngx_linux_sendfile_thread(ngx_connection_t *c, ngx_buf_t *file,
 static void ngx_linux_sendfile_thread_handler(void *data, ngx_log_t *log);
 #endif
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+#define NGX_ZEROCOPY_MIN_SIZE  16384
+#define NGX_ZEROCOPY_SENDS     32
+
+
+/*
+ * The memory sent with MSG_ZEROCOPY cannot be reused until the kernel
+ * reports the send completion via the socket error queue.  Such data are
+ * kept in the chain returned to the caller, so the buffers are not freed
+ * or recycled, and are skipped on the next calls.  The sends are numbered
+ * by the kernel sequentially starting from 0, start[] keeps the position
+ * of each send not yet completed.
+ */
+
+struct ngx_zerocopy_s {
+    off_t          sent;
+    off_t          released;
+
+    uint32_t       next;
+    uint32_t       lowest;
+    uint32_t       done;
+
+    off_t          start[NGX_ZEROCOPY_SENDS];
+
+    ngx_buf_t      buf;
+    ngx_chain_t    link;
+
+    unsigned       disabled:1;
+};
+
+
+static ssize_t ngx_linux_zerocopy_writev(ngx_connection_t *c,
+    ngx_iovec_t *vec);
+static ngx_int_t ngx_linux_zerocopy_complete(ngx_connection_t *c);
+static ngx_chain_t *ngx_linux_zerocopy_update(ngx_connection_t *c,
+    ngx_chain_t *in, size_t sent);
+static ngx_chain_t *ngx_linux_zerocopy_skip(ngx_connection_t *c,
+    ngx_chain_t *in);
+#endif
+
 
 /*
  * On Linux up to 2.4.21 sendfile() (syscall #187) works with 32-bit
@@ -66,6 +107,23 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         return in;
     }
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+    if (c->zerocopy) {
+        if (ngx_linux_zerocopy_complete(c) != NGX_OK) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        in = ngx_linux_zerocopy_update(c, in, 0);
+
+        if (in && ngx_linux_zerocopy_skip(c, in) == NULL) {
+            /* wait for the completion of the sends still in progress */
+            wev->ready = 0;
+            return in;
+        }
+    }
+
+#endif
 
     /* the maximum limit size is 2G-1 - the page size */
 
@@ -82,9 +140,19 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
     for ( ;; ) {
         prev_send = send;
 
+        cl = in;
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+        if (c->zerocopy) {
+            cl = ngx_linux_zerocopy_skip(c, in);
+        }
+
+#endif
+
         /* create the iovec and coalesce the neighbouring bufs */
 
-        cl = ngx_output_chain_to_iovec(&header, in, limit - send, c->log);
+        cl = ngx_output_chain_to_iovec(&header, cl, limit - send, c->log);
 
         if (cl == NGX_CHAIN_ERROR) {
             return NGX_CHAIN_ERROR;
@@ -188,7 +256,11 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             sent = (n == NGX_AGAIN) ? 0 : n;
 
         } else {
+#if (NGX_HAVE_MSG_ZEROCOPY)
+            n = ngx_linux_zerocopy_writev(c, &header);
+#else
             n = ngx_writev(c, &header);
+#endif
 
             if (n == NGX_ERROR) {
                 return NGX_CHAIN_ERROR;
@@ -199,7 +271,18 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 
         c->sent += sent;
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+        if (c->zerocopy) {
+            in = ngx_linux_zerocopy_update(c, in, sent);
+
+        } else {
+            in = ngx_chain_update_sent(in, sent);
+        }
+
+#else
         in = ngx_chain_update_sent(in, sent);
+#endif
 
         if (n == NGX_AGAIN) {
             wev->ready = 0;
@@ -221,6 +304,15 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             send = prev_send + sent;
         }
 
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+        if (c->zerocopy && in && ngx_linux_zerocopy_skip(c, in) == NULL) {
+            wev->ready = 0;
+            return in;
+        }
+
+#endif
+
         if (send >= limit || in == NULL) {
             return in;
         }
@@ -434,3 +526,316 @@ again:
 }
 
 #endif /* NGX_THREADS */
+
+
+#if (NGX_HAVE_MSG_ZEROCOPY)
+
+static ssize_t
+ngx_linux_zerocopy_writev(ngx_connection_t *c, ngx_iovec_t *vec)
+{
+    int              zerocopy;
+    ssize_t          n;
+    ngx_err_t        err;
+    struct msghdr    msg;
+    ngx_zerocopy_t  *zc;
+
+    zc = c->zerocopy;
+
+    /*
+     * the completions are reported with EPOLLERR, which is expected
+     * to be delivered to the write handler with edge-triggered events
+     */
+
+    if (!c->tcp_zerocopy
+        || vec->size < NGX_ZEROCOPY_MIN_SIZE
+        || !(ngx_event_flags & NGX_USE_CLEAR_EVENT))
+    {
+        return ngx_writev(c, vec);
+    }
+
+    if (zc == NULL) {
+        zc = ngx_pcalloc(c->pool, sizeof(ngx_zerocopy_t));
+        if (zc == NULL) {
+            return NGX_ERROR;
+        }
+
+        c->zerocopy = zc;
+
+        zerocopy = 1;
+
+        if (setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY,
+                       (const void *) &zerocopy, sizeof(int))
+            == -1)
+        {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, ngx_socket_errno,
+                           "setsockopt(SO_ZEROCOPY) failed");
+            zc->disabled = 1;
+        }
+    }
+
+    if (zc->disabled || zc->next - zc->lowest == NGX_ZEROCOPY_SENDS) {
+        return ngx_writev(c, vec);
+    }
+
+    ngx_memzero(&msg, sizeof(struct msghdr));
+
+    msg.msg_iov = vec->iovs;
+    msg.msg_iovlen = vec->count;
+
+eintr:
+
+    n = sendmsg(c->fd, &msg, MSG_ZEROCOPY);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "sendmsg: %z of %uz zerocopy:%uD", n, vec->size, zc->next);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        switch (err) {
+        case NGX_EAGAIN:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmsg() not ready");
+            return NGX_AGAIN;
+
+        case NGX_EINTR:
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmsg() was interrupted");
+            goto eintr;
+
+        case NGX_ENOBUFS:
+            /* the socket optmem limit is reached */
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "sendmsg(MSG_ZEROCOPY) failed");
+            return ngx_writev(c, vec);
+
+        default:
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmsg() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    if (n > 0) {
+        zc->start[zc->next % NGX_ZEROCOPY_SENDS] = zc->sent;
+        zc->next++;
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_linux_zerocopy_complete(ngx_connection_t *c)
+{
+    char                       msg_control[CMSG_SPACE(
+                                   sizeof(struct sock_extended_err)
+                                   + sizeof(struct sockaddr_in6))];
+    ssize_t                    n;
+    uint32_t                   k, id, last;
+    ngx_err_t                  err;
+    struct msghdr              msg;
+    struct cmsghdr            *cmsg;
+    ngx_zerocopy_t            *zc;
+    struct sock_extended_err  *ee;
+
+    zc = c->zerocopy;
+
+    while (zc->lowest != zc->next) {
+
+        ngx_memzero(&msg, sizeof(struct msghdr));
+
+        msg.msg_control = msg_control;
+        msg.msg_controllen = sizeof(msg_control);
+
+        n = recvmsg(c->fd, &msg, MSG_ERRQUEUE);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                return NGX_OK;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            c->write->error = 1;
+            ngx_connection_error(c, err, "recvmsg(MSG_ERRQUEUE) failed");
+            return NGX_ERROR;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg);
+             cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == IPPROTO_IP
+                  && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == IPPROTO_IPV6
+                     && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+
+            ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "zerocopy completed: %uD-%uD code:%d",
+                           ee->ee_info, ee->ee_data, ee->ee_code);
+
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                /* the kernel had to copy the data, e.g., on loopback */
+                zc->disabled = 1;
+            }
+
+            /* the range may be reported in any order relative to others */
+
+            last = ee->ee_data - ee->ee_info;
+
+            for (k = 0; k <= last && k < NGX_ZEROCOPY_SENDS; k++) {
+                id = ee->ee_info + k - zc->lowest;
+
+                if (id < zc->next - zc->lowest) {
+                    zc->done |= (uint32_t) 1 << id;
+                }
+            }
+
+            while (zc->done & 1) {
+                zc->done >>= 1;
+                zc->lowest++;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * If a connection is closed, or its request is freed, with sends still in
+ * progress, e.g., after send_timeout or an error, the memory referenced
+ * by the kernel is about to be freed.  The connection is aborted instead:
+ * disconnecting the socket purges its send queue, and the socket itself
+ * stays open until it is closed as usual.
+ */
+
+void
+ngx_linux_zerocopy_abort(ngx_connection_t *c)
+{
+    struct sockaddr  sa;
+    ngx_zerocopy_t  *zc;
+
+    zc = c->zerocopy;
+
+    if (zc->lowest == zc->next) {
+        return;
+    }
+
+    if (ngx_linux_zerocopy_complete(c) == NGX_OK && zc->lowest == zc->next) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "aborting connection with %uD zerocopy sends in progress",
+                  zc->next - zc->lowest);
+
+    ngx_memzero(&sa, sizeof(struct sockaddr));
+    sa.sa_family = AF_UNSPEC;
+
+    if (connect(c->fd, &sa, sizeof(struct sockaddr)) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_socket_errno,
+                      "connect(AF_UNSPEC) failed");
+    }
+
+    zc->lowest = zc->next;
+    zc->done = 0;
+
+    c->error = 1;
+}
+
+
+static ngx_chain_t *
+ngx_linux_zerocopy_update(ngx_connection_t *c, ngx_chain_t *in, size_t sent)
+{
+    off_t            released;
+    ngx_zerocopy_t  *zc;
+
+    zc = c->zerocopy;
+
+    zc->sent += sent;
+
+    /* everything sent before the first send in progress can be released */
+
+    if (zc->lowest == zc->next) {
+        released = zc->sent;
+
+    } else {
+        released = zc->start[zc->lowest % NGX_ZEROCOPY_SENDS];
+    }
+
+    in = ngx_chain_update_sent(in, released - zc->released);
+
+    zc->released = released;
+
+    return in;
+}
+
+
+static ngx_chain_t *
+ngx_linux_zerocopy_skip(ngx_connection_t *c, ngx_chain_t *in)
+{
+    off_t            size, held;
+    ngx_zerocopy_t  *zc;
+
+    zc = c->zerocopy;
+
+    held = zc->sent - zc->released;
+
+    if (held == 0) {
+        return in;
+    }
+
+    for ( /* void */ ; in; in = in->next) {
+
+        if (ngx_buf_special(in->buf)) {
+            continue;
+        }
+
+        size = ngx_buf_size(in->buf);
+
+        if (held >= size) {
+            held -= size;
+            continue;
+        }
+
+        if (held == 0) {
+            return in;
+        }
+
+        /* a copy of the partially held buf with the rest of the data */
+
+        zc->buf = *in->buf;
+
+        if (ngx_buf_in_memory(&zc->buf)) {
+            zc->buf.pos += (size_t) held;
+        }
+
+        if (zc->buf.in_file) {
+            zc->buf.file_pos += held;
+        }
+
+        zc->link.buf = &zc->buf;
+        zc->link.next = in->next;
+
+        return &zc->link;
+    }
+
+    return NULL;
+}
+
+#endif /* NGX_HAVE_MSG_ZEROCOPY */
@@ -52,6 +52,9 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+ngx_event_t  *ngx_wakeup_event;
+ngx_pass_connection_pt  ngx_pass_connection_handler;
+
 
 static u_char  master_process[] = "master process";
 
@@ -1064,6 +1067,13 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].pid = ch.pid;
             ngx_processes[ch.slot].channel[0] = ch.fd;
+
+            /* processes spawned later are woken up as well */
+
+            if (ch.slot >= ngx_last_process) {
+                ngx_last_process = ch.slot + 1;
+            }
+
             break;
 
         case NGX_CMD_CLOSE_CHANNEL:
@@ -1080,11 +1090,78 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_WAKEUP:
+
+            if (ngx_wakeup_event) {
+                ngx_post_event(ngx_wakeup_event, &ngx_posted_events);
+            }
+
+            break;
+
+        case NGX_CMD_PASS_CONNECTION:
+
+            ngx_log_debug3(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "get connection pid:%P tag:%i fd:%d",
+                           ch.pid, ch.slot, ch.fd);
+
+            if (ch.fd == -1) {
+                /* the descriptor was dropped by the kernel */
+                break;
+            }
+
+            if (ngx_pass_connection_handler) {
+                ngx_pass_connection_handler(ch.fd, ch.slot, ev->log);
+                break;
+            }
+
+            if (close(ch.fd) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+                              "close() passed connection failed");
+            }
+
+            break;
         }
     }
 }
 
 
+void
+ngx_wakeup_workers(ngx_log_t *log)
+{
+    ngx_int_t      n;
+    ngx_channel_t  ch;
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_WAKEUP;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = -1;
+
+    /*
+     * workers keep channels of other processes; if a message is lost,
+     * the process relies on its timers
+     */
+
+    for (n = 0; n < ngx_last_process; n++) {
+
+        if (n == ngx_process_slot
+            || ngx_processes[n].pid == -1
+            || ngx_processes[n].channel[0] == -1)
+        {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                       "wake up: %P s:%i", ngx_processes[n].pid, n);
+
+        (void) ngx_write_channel(ngx_processes[n].channel[0], &ch,
+                                 sizeof(ngx_channel_t), log);
+    }
+}
+
+
 static void
 ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data)
 {
@@ -1189,3 +1266,42 @@ ngx_cache_loader_process_handler(ngx_event_t *ev)
 
     exit(0);
 }
+
+
+ngx_int_t
+ngx_pass_connection(ngx_pid_t pid, ngx_socket_t s, ngx_int_t tag,
+    ngx_log_t *log)
+{
+    ngx_int_t      n;
+    ngx_channel_t  ch;
+
+    /*
+     * the socket is passed to another worker; the slot field carries
+     * a tag the receiver uses to find the owner of the connection
+     */
+
+    for (n = 0; n < ngx_last_process; n++) {
+
+        if (n == ngx_process_slot
+            || ngx_processes[n].pid != pid
+            || ngx_processes[n].channel[0] == -1)
+        {
+            continue;
+        }
+
+        ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+        ch.command = NGX_CMD_PASS_CONNECTION;
+        ch.pid = ngx_pid;
+        ch.slot = tag;
+        ch.fd = s;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_CORE, log, 0,
+                       "pass connection: %P s:%i fd:%d", pid, n, s);
+
+        return ngx_write_channel(ngx_processes[n].channel[0], &ch,
+                                 sizeof(ngx_channel_t), log);
+    }
+
+    return NGX_DECLINED;
+}
@@ -18,6 +18,8 @@
 #define NGX_CMD_QUIT           3
 #define NGX_CMD_TERMINATE      4
 #define NGX_CMD_REOPEN         5
+#define NGX_CMD_WAKEUP         6
+#define NGX_CMD_PASS_CONNECTION 7
 
 
 #define NGX_PROCESS_SINGLE     0
@@ -34,8 +36,15 @@ typedef struct {
 } ngx_cache_manager_ctx_t;
 
 
+typedef void (*ngx_pass_connection_pt)(ngx_socket_t s, ngx_int_t tag,
+    ngx_log_t *log);
+
+
 void ngx_master_process_cycle(ngx_cycle_t *cycle);
 void ngx_single_process_cycle(ngx_cycle_t *cycle);
+void ngx_wakeup_workers(ngx_log_t *log);
+ngx_int_t ngx_pass_connection(ngx_pid_t pid, ngx_socket_t s, ngx_int_t tag,
+    ngx_log_t *log);
 
 
 extern ngx_uint_t      ngx_process;
@@ -45,6 +54,8 @@ extern ngx_pid_t       ngx_new_binary;
 extern ngx_uint_t      ngx_inherited;
 extern ngx_uint_t      ngx_daemonized;
 extern ngx_uint_t      ngx_exiting;
+extern ngx_event_t    *ngx_wakeup_event;
+extern ngx_pass_connection_pt  ngx_pass_connection_handler;
 
 extern sig_atomic_t    ngx_reap;
 extern sig_atomic_t    ngx_sigio;
@@ -42,6 +42,9 @@ sig_atomic_t   ngx_reopen;
 sig_atomic_t   ngx_reconfigure;
 ngx_uint_t     ngx_exiting;
 
+ngx_event_t   *ngx_wakeup_event;
+ngx_pass_connection_pt  ngx_pass_connection_handler;
+
 
 HANDLE         ngx_master_process_event;
 char           ngx_master_process_event_name[NGX_PROCESS_SYNC_NAME];
@@ -24,10 +24,22 @@ void ngx_single_process_cycle(ngx_cycle_t *cycle);
 void ngx_close_handle(HANDLE h);
 
 
+/* there are no other workers to wake up or to pass connections to */
+
+#define ngx_wakeup_workers(log)
+#define ngx_pass_connection(pid, s, tag, log)  NGX_DECLINED
+
+
+typedef void (*ngx_pass_connection_pt)(ngx_socket_t s, ngx_int_t tag,
+    ngx_log_t *log);
+
+
 extern ngx_uint_t      ngx_process;
 extern ngx_uint_t      ngx_worker;
 extern ngx_pid_t       ngx_pid;
 extern ngx_uint_t      ngx_exiting;
+extern ngx_event_t    *ngx_wakeup_event;
+extern ngx_pass_connection_pt  ngx_pass_connection_handler;
 
 extern sig_atomic_t    ngx_quit;
 extern sig_atomic_t    ngx_terminate;
@@ -344,7 +344,8 @@ typedef struct {
         NULL)
 
 
-#define NGX_STREAM_WRITE_BUFFERED  0x10
+#define NGX_STREAM_WRITE_BUFFERED   0x10
+#define NGX_STREAM_SPLICE_BUFFERED 0x20
 
 
 ngx_int_t ngx_stream_add_listen(ngx_conf_t *cf,
@@ -32,6 +32,7 @@ typedef struct {
     ngx_flag_t                       next_upstream;
     ngx_flag_t                       proxy_protocol;
     ngx_flag_t                       half_close;
+    ngx_flag_t                       splice;
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
 
@@ -51,6 +52,7 @@ typedef struct {
     ngx_stream_complex_value_t      *ssl_certificate_key;
     ngx_ssl_cache_t                 *ssl_certificate_cache;
     ngx_array_t                     *ssl_passwords;
+    ngx_flag_t                       ssl_ktls;
     ngx_array_t                     *ssl_conf_commands;
 
     ngx_ssl_t                       *ssl;
@@ -61,6 +63,24 @@ typedef struct {
 } ngx_stream_proxy_srv_conf_t;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    int                              pipe[2];
+    size_t                           size;
+    size_t                           capacity;
+    unsigned                         disabled:1;
+} ngx_stream_proxy_splice_t;
+
+
+typedef struct {
+    /* indexed by from_upstream */
+    ngx_stream_proxy_splice_t        splice[2];
+} ngx_stream_proxy_ctx_t;
+
+#endif
+
+
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf);
@@ -79,6 +99,11 @@ static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_uint_t from_upstream, ngx_connection_t *src, ngx_connection_t *dst);
+static void ngx_stream_proxy_splice_cleanup(void *data);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -260,6 +285,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, half_close),
       NULL },
 
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -360,6 +392,13 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       0,
       NULL },
 
+    { ngx_string("proxy_ssl_ktls"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, ssl_ktls),
+      NULL },
+
     { ngx_string("proxy_ssl_conf_command"),
       NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_TAKE2,
       ngx_conf_set_keyval_slot,
@@ -1777,6 +1816,23 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        if (pscf->splice) {
+            rc = ngx_stream_proxy_splice(s, from_upstream, src, dst);
+
+            if (rc == NGX_ERROR) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                return;
+            }
+
+            if (rc == NGX_OK) {
+                break;
+            }
+        }
+
+#endif
+
         if (do_write && dst) {
 
             if (*out || *busy || dst->buffered) {
@@ -2015,6 +2071,317 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_uint_t from_upstream,
+    ngx_connection_t *src, ngx_connection_t *dst)
+{
+    int                           psize;
+    off_t                        *received, limit;
+    size_t                        size, limit_rate;
+    ssize_t                       n;
+    ngx_err_t                     err;
+    ngx_buf_t                    *b;
+    ngx_uint_t                   *packets;
+    ngx_msec_t                    delay;
+    ngx_chain_t                  *out, *busy;
+    ngx_connection_t             *c;
+    ngx_pool_cleanup_t           *cln;
+    ngx_stream_upstream_t        *u;
+    ngx_stream_proxy_ctx_t       *ctx;
+    ngx_stream_proxy_splice_t    *sp;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = s->connection;
+    u = s->upstream;
+
+    if (c->type != SOCK_STREAM || dst == NULL) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(c->pool, sizeof(ngx_stream_proxy_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->splice[0].pipe[0] = -1;
+        ctx->splice[0].pipe[1] = -1;
+        ctx->splice[1].pipe[0] = -1;
+        ctx->splice[1].pipe[1] = -1;
+
+        cln = ngx_pool_cleanup_add(c->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_stream_proxy_splice_cleanup;
+        cln->data = ctx;
+
+        ngx_stream_set_ctx(s, ctx, ngx_stream_proxy_module);
+    }
+
+    sp = &ctx->splice[from_upstream ? 1 : 0];
+
+    if (sp->disabled) {
+        return NGX_DECLINED;
+    }
+
+    if (from_upstream) {
+        b = &u->upstream_buf;
+        limit_rate = u->download_rate;
+        received = &u->received;
+        packets = &u->responses;
+        out = u->downstream_out;
+        busy = u->downstream_busy;
+
+    } else {
+        b = &u->downstream_buf;
+        limit_rate = u->upload_rate;
+        received = &s->received;
+        packets = &u->requests;
+        out = u->upstream_out;
+        busy = u->upstream_busy;
+    }
+
+    if (sp->size == 0) {
+
+        /* data already read into the buffer are to be sent first */
+
+        if (out || busy || dst->buffered || b->pos != b->last) {
+            return NGX_DECLINED;
+        }
+
+#if (NGX_STREAM_SSL)
+
+        /*
+         * with kernel TLS the socket carries plaintext, though the data
+         * already read by OpenSSL are to be processed by it
+         */
+
+        if (src->ssl) {
+            if (!src->ssl->ktls_recv) {
+                return NGX_DECLINED;
+            }
+
+#ifdef BIO_get_ktls_recv
+            if (SSL_has_pending(src->ssl->connection)) {
+                return NGX_DECLINED;
+            }
+#endif
+        }
+
+        if (dst->ssl && !dst->ssl->sendfile) {
+            return NGX_DECLINED;
+        }
+
+#endif
+    }
+
+    if (sp->pipe[0] == -1) {
+
+        if (pipe2(sp->pipe, O_NONBLOCK|O_CLOEXEC) == -1) {
+            ngx_log_error(NGX_LOG_ERR, c->log, ngx_errno, "pipe2() failed");
+
+            sp->pipe[0] = -1;
+            sp->pipe[1] = -1;
+            sp->disabled = 1;
+
+            return NGX_DECLINED;
+        }
+
+        pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+        psize = fcntl(sp->pipe[1], F_GETPIPE_SZ);
+
+        if (psize != -1 && (size_t) psize < pscf->buffer_size) {
+            psize = fcntl(sp->pipe[1], F_SETPIPE_SZ, (int) pscf->buffer_size);
+
+            if (psize == -1) {
+                ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, ngx_errno,
+                               "fcntl(F_SETPIPE_SZ) failed");
+
+                psize = fcntl(sp->pipe[1], F_GETPIPE_SZ);
+            }
+        }
+
+        sp->capacity = (psize == -1) ? 65536 : (size_t) psize;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy splice pipe: %d:%d %uz",
+                       sp->pipe[0], sp->pipe[1], sp->capacity);
+    }
+
+    for ( ;; ) {
+
+        if (sp->size) {
+
+            /* the pipe is only filled when empty, see below */
+
+            if (!dst->write->ready) {
+                break;
+            }
+
+            n = splice(sp->pipe[0], NULL, dst->fd, NULL, sp->size,
+                       SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice to fd:%d: %z", dst->fd, n);
+
+            if (n == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    dst->write->ready = 0;
+                    break;
+                }
+
+                if (err == NGX_EINTR) {
+                    continue;
+                }
+
+                dst->write->error = 1;
+                ngx_connection_error(dst, err, "splice() failed");
+                return NGX_ERROR;
+            }
+
+            sp->size -= n;
+            dst->sent += n;
+
+            if (sp->size == 0) {
+                dst->buffered &= ~NGX_STREAM_SPLICE_BUFFERED;
+            }
+
+            continue;
+        }
+
+        if (!src->read->ready || src->read->delayed || src->read->eof) {
+            break;
+        }
+
+        /*
+         * EAGAIN is only unambiguous for an empty pipe, so the pipe
+         * is filled with a single call
+         */
+
+        size = sp->capacity;
+
+        if (limit_rate) {
+            limit = (off_t) limit_rate * (ngx_time() - u->start_sec + 1)
+                    - *received;
+
+            if (limit <= 0) {
+                src->read->delayed = 1;
+                delay = (ngx_msec_t) (- limit * 1000 / limit_rate + 1);
+                ngx_add_timer(src->read, delay);
+                break;
+            }
+
+            if ((off_t) size > limit) {
+                size = (size_t) limit;
+            }
+        }
+
+        n = splice(src->fd, NULL, sp->pipe[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "splice from fd:%d: %z", src->fd, n);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EAGAIN) {
+                src->read->ready = 0;
+                break;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+#if (NGX_STREAM_SSL)
+
+            if (src->ssl) {
+
+                /* a TLS record other than data, let OpenSSL handle it */
+
+                ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, err,
+                               "stream proxy splice disabled");
+
+                sp->disabled = 1;
+                return NGX_DECLINED;
+            }
+
+#endif
+
+            ngx_connection_error(src, err, "splice() failed");
+            n = 0;
+        }
+
+        if (n == 0) {
+            src->read->ready = 0;
+            src->read->eof = 1;
+            break;
+        }
+
+        if (limit_rate) {
+            delay = (ngx_msec_t) (n * 1000 / limit_rate);
+
+            if (delay > 0) {
+                src->read->delayed = 1;
+                ngx_add_timer(src->read, delay);
+            }
+        }
+
+        if (from_upstream) {
+            if (u->state->first_byte_time == (ngx_msec_t) -1) {
+                u->state->first_byte_time = ngx_current_msec - u->start_time;
+            }
+        }
+
+        (*packets)++;
+        *received += n;
+
+        sp->size = n;
+        dst->buffered |= NGX_STREAM_SPLICE_BUFFERED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_proxy_splice_cleanup(void *data)
+{
+    ngx_stream_proxy_ctx_t  *ctx = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < 2; i++) {
+
+        if (ctx->splice[i].pipe[0] == -1) {
+            continue;
+        }
+
+        if (close(ctx->splice[i].pipe[0]) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          "close() pipe failed");
+        }
+
+        if (close(ctx->splice[i].pipe[1]) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          "close() pipe failed");
+        }
+    }
+}
+
+#endif
+
+
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
@@ -2217,6 +2584,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
     conf->half_close = NGX_CONF_UNSET;
+    conf->splice = NGX_CONF_UNSET;
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
@@ -2229,6 +2597,7 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->ssl_certificate_key = NGX_CONF_UNSET_PTR;
     conf->ssl_certificate_cache = NGX_CONF_UNSET_PTR;
     conf->ssl_passwords = NGX_CONF_UNSET_PTR;
+    conf->ssl_ktls = NGX_CONF_UNSET;
     conf->ssl_conf_commands = NGX_CONF_UNSET_PTR;
 #endif
 
@@ -2278,6 +2647,8 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->half_close, prev->half_close, 0);
 
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+
 #if (NGX_STREAM_SSL)
 
     if (ngx_stream_proxy_merge_ssl(cf, conf, prev) != NGX_OK) {
@@ -2321,6 +2692,8 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
         return NGX_CONF_ERROR;
     }
 
+    ngx_conf_merge_value(conf->ssl_ktls, prev->ssl_ktls, 0);
+
     ngx_conf_merge_ptr_value(conf->ssl_conf_commands,
                               prev->ssl_conf_commands, NULL);
 
@@ -2352,6 +2725,7 @@ ngx_stream_proxy_merge_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *conf,
         && conf->ssl_trusted_certificate.data == NULL
         && conf->ssl_crl.data == NULL
         && conf->ssl_session_reuse == NGX_CONF_UNSET
+        && conf->ssl_ktls == NGX_CONF_UNSET
         && conf->ssl_conf_commands == NGX_CONF_UNSET_PTR)
     {
         if (prev->ssl) {
@@ -2513,6 +2887,10 @@ ngx_stream_proxy_set_ssl(ngx_conf_t *cf, ngx_stream_proxy_srv_conf_t *pscf)
         return NGX_ERROR;
     }
 
+    if (ngx_ssl_ktls(cf, pscf->ssl, pscf->ssl_ktls) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     if (ngx_ssl_conf_commands(cf, pscf->ssl, pscf->ssl_conf_commands)
         != NGX_OK)
     {
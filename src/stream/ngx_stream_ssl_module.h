@@ -19,6 +19,7 @@ typedef struct {
 
     ngx_flag_t        prefer_server_ciphers;
     ngx_flag_t        reject_handshake;
+    ngx_flag_t        ktls;
 
     ngx_ssl_t         ssl;
 
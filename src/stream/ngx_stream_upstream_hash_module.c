@@ -22,12 +22,24 @@ typedef struct {
 } ngx_stream_upstream_chash_points_t;
 
 
+typedef struct {
+    ngx_uint_t                            size;
+    ngx_stream_upstream_rr_peer_t       **peer;
+    uint32_t                             *entry;
+} ngx_stream_upstream_maglev_t;
+
+
+#define NGX_STREAM_UPSTREAM_MAGLEV_SIZE  65537
+
+
 typedef struct {
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_uint_t                            config;
 #endif
     ngx_stream_complex_value_t            key;
     ngx_stream_upstream_chash_points_t   *points;
+    ngx_stream_upstream_maglev_t         *maglev;
+    ngx_uint_t                            maglev_size;
 } ngx_stream_upstream_hash_srv_conf_t;
 
 
@@ -63,6 +75,15 @@ static ngx_int_t ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
 static ngx_int_t ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_get_maglev_peer(
+    ngx_peer_connection_t *pc, void *data);
+
 static void *ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -113,10 +134,15 @@ static ngx_int_t
 ngx_stream_upstream_init_hash(ngx_conf_t *cf,
     ngx_stream_upstream_srv_conf_t *us)
 {
+    ngx_stream_upstream_rr_peers_t  *peers;
+
     if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
         return NGX_ERROR;
     }
 
+    peers = us->peer.data;
+    peers->read_mostly = 1;
+
     us->peer.init = ngx_stream_upstream_init_hash_peer;
 
     return NGX_OK;
@@ -687,6 +713,293 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+static ngx_int_t
+ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_rr_peers_t  *peers;
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    peers = us->peer.data;
+    peers->read_mostly = 1;
+
+    us->peer.init = ngx_stream_upstream_init_maglev_peer;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_stream_upstream_update_maglev(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    size_t                                size;
+    uint32_t                              hash;
+    ngx_uint_t                            i, k, n, m, w, *pos, *skip;
+    ngx_stream_upstream_maglev_t         *maglev;
+    ngx_stream_upstream_rr_peer_t        *peer;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+
+    if (hcf->maglev) {
+        ngx_free(hcf->maglev);
+        hcf->maglev = NULL;
+    }
+
+    peers = us->peer.data;
+
+    /*
+     * the lookup table size is a prime, so that any skip value walks
+     * through all of its entries; it does not depend on the peers, so
+     * a change of the peers only moves the keys of the entries changed
+     */
+
+    m = hcf->maglev_size;
+    n = peers->number;
+
+    size = sizeof(ngx_stream_upstream_maglev_t)
+           + sizeof(ngx_stream_upstream_rr_peer_t *) * n
+           + sizeof(uint32_t) * m;
+
+    maglev = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (maglev == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->peer = (ngx_stream_upstream_rr_peer_t **) &maglev[1];
+    maglev->entry = (uint32_t *) &maglev->peer[n];
+    maglev->size = m;
+
+    if (n == 0) {
+        maglev->size = 0;
+        hcf->maglev = maglev;
+        return NGX_OK;
+    }
+
+    pos = ngx_alloc(2 * n * sizeof(ngx_uint_t), ngx_cycle->log);
+    if (pos == NULL) {
+        if (pool == NULL) {
+            ngx_free(maglev);
+        }
+
+        return NGX_ERROR;
+    }
+
+    skip = &pos[n];
+
+    /*
+     * each peer walks the table in its own order, derived from the peer
+     * address, so the entries of other peers stay in place when a peer
+     * is added or removed
+     */
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        maglev->peer[i] = peer;
+
+        hash = ngx_crc32_long(peer->name.data, peer->name.len);
+        pos[i] = hash % m;
+
+        hash = ngx_murmur_hash2(peer->name.data, peer->name.len);
+        skip[i] = hash % (m - 1) + 1;
+    }
+
+    ngx_memset(maglev->entry, 0xff, sizeof(uint32_t) * m);
+
+    /* peers take turns claiming their next free entry, weight times each */
+
+    k = 0;
+
+    for ( ;; ) {
+        for (i = 0; i < n; i++) {
+            for (w = 0; w < (ngx_uint_t) maglev->peer[i]->weight; w++) {
+
+                while (maglev->entry[pos[i]] != (uint32_t) -1) {
+                    pos[i] = (pos[i] + skip[i]) % m;
+                }
+
+                maglev->entry[pos[i]] = i;
+
+                if (++k == m) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    ngx_free(pos);
+
+    hcf->maglev = maglev;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_init_maglev_peer(ngx_stream_session_t *s,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    ngx_stream_upstream_hash_peer_data_t  *hp;
+
+    if (ngx_stream_upstream_init_hash_peer(s, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->upstream->peer.get = ngx_stream_upstream_get_maglev_peer;
+
+    hp = s->upstream->peer.data;
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len);
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
+
+    if (hp->rrp.peers->config
+        && (hp->conf->maglev == NULL
+            || hp->conf->config != *hp->rrp.peers->config))
+    {
+        if (ngx_stream_upstream_update_maglev(NULL, us) != NGX_OK) {
+            ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+            return NGX_ERROR;
+        }
+
+        hp->conf->config = *hp->rrp.peers->config;
+    }
+
+    ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_stream_upstream_hash_peer_data_t *hp = data;
+
+    time_t                          now;
+    uintptr_t                       m;
+    ngx_uint_t                      n, p;
+    ngx_stream_upstream_maglev_t   *maglev;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "get maglev hash peer, try: %ui", pc->tries);
+
+    ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
+
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+        ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    if (hp->rrp.peers->number == 0) {
+        pc->name = hp->rrp.peers->name;
+        ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (hp->rrp.peers->config && hp->rrp.config != *hp->rrp.peers->config) {
+        pc->name = hp->rrp.peers->name;
+        ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+#endif
+
+    now = ngx_time();
+    maglev = hp->conf->maglev;
+
+    /*
+     * an unusable peer is replaced by the peer of the next entry,
+     * which spreads its keys evenly over the rest of the peers
+     */
+
+    for ( ;; ) {
+        p = maglev->entry[hp->hash % maglev->size];
+        peer = maglev->peer[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                       "maglev hash peer:%uD, peer:%ui", hp->hash, p);
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        ngx_stream_upstream_rr_peer_lock(hp->rrp.peers, peer);
+
+        if (peer->down) {
+            ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        break;
+
+    next:
+
+        hp->hash++;
+
+        if (++hp->tries > 20) {
+            ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+    ngx_stream_upstream_rr_peer_ref(hp->rrp.peers, peer);
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -698,6 +1011,8 @@ ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
+    conf->maglev_size = 0;
 
     return conf;
 }
@@ -708,6 +1023,7 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_stream_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                            n, i;
     ngx_str_t                           *value;
     ngx_stream_upstream_srv_conf_t      *uscf;
     ngx_stream_compile_complex_value_t   ccv;
@@ -745,11 +1061,38 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_stream_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "maglev") == 0) {
+        uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+        hcf->maglev_size = NGX_STREAM_UPSTREAM_MAGLEV_SIZE;
+
+    } else if (ngx_strncmp(value[2].data, "maglev=", 7) == 0) {
+
+        /* the table size must be a prime */
+
+        n = ngx_atoi(value[2].data + 7, value[2].len - 7);
+
+        if (n == NGX_ERROR || n < 2 || n > 16777216) {
+            goto invalid;
+        }
+
+        for (i = 2; i * i <= n; i++) {
+            if (n % i == 0) {
+                goto invalid;
+            }
+        }
+
+        uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+        hcf->maglev_size = n;
+
     } else {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
-        return NGX_CONF_ERROR;
+        goto invalid;
     }
 
     return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
 }
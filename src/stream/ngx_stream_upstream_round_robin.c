@@ -14,8 +14,38 @@
                                       + ((p)->next ? (p)->next->tries : 0))
 
 
+/*
+ * read mostly peers use reader slots, and their write lock is expensive:
+ * peers are selected under the read lock, and each peer is updated under
+ * its own lock instead
+ */
+
+#define ngx_stream_upstream_rr_peers_select_lock(peers)                       \
+                                                                              \
+    if (peers->read_mostly) {                                                 \
+        ngx_stream_upstream_rr_peers_rlock(peers);                            \
+                                                                              \
+    } else {                                                                  \
+        ngx_stream_upstream_rr_peers_wlock(peers);                            \
+    }
+
+#define ngx_stream_upstream_rr_select_peer_lock(peers, peer)                  \
+                                                                              \
+    if (peers->read_mostly) {                                                 \
+        ngx_stream_upstream_rr_peer_lock(peers, peer);                        \
+    }
+
+#define ngx_stream_upstream_rr_select_peer_unlock(peers, peer)                \
+                                                                              \
+    if (peers->read_mostly) {                                                 \
+        ngx_stream_upstream_rr_peer_unlock(peers, peer);                      \
+    }
+
+
 static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_get_peer(
     ngx_stream_upstream_rr_peer_data_t *rrp);
+static void ngx_stream_upstream_update_ewma(ngx_stream_upstream_rr_peer_t *peer,
+    ngx_msec_t time, ngx_msec_t decay);
 static void ngx_stream_upstream_notify_round_robin_peer(
     ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
 
@@ -442,6 +472,7 @@ ngx_stream_upstream_init_round_robin_peer(ngx_stream_session_t *s,
 
     rrp->peers = us->peer.data;
     rrp->current = NULL;
+    rrp->decay = 0;
 
     ngx_stream_upstream_rr_peers_rlock(rrp->peers);
 
@@ -580,6 +611,7 @@ ngx_stream_upstream_create_round_robin_peer(ngx_stream_session_t *s,
 
     rrp->peers = peers;
     rrp->current = NULL;
+    rrp->decay = 0;
     rrp->config = 0;
 
     if (rrp->peers->number <= 8 * sizeof(uintptr_t)) {
@@ -624,7 +656,7 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->connection = NULL;
 
     peers = rrp->peers;
-    ngx_stream_upstream_rr_peers_wlock(peers);
+    ngx_stream_upstream_rr_peers_select_lock(peers);
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     if (peers->config && rrp->config != *peers->config) {
@@ -635,11 +667,15 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     if (peers->single) {
         peer = peers->peer;
 
+        ngx_stream_upstream_rr_select_peer_lock(peers, peer);
+
         if (peer->down) {
+            ngx_stream_upstream_rr_select_peer_unlock(peers, peer);
             goto failed;
         }
 
         if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_stream_upstream_rr_select_peer_unlock(peers, peer);
             goto failed;
         }
 
@@ -667,6 +703,7 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
     peer->conns++;
 
+    ngx_stream_upstream_rr_select_peer_unlock(peers, peer);
     ngx_stream_upstream_rr_peers_unlock(peers);
 
     return NGX_OK;
@@ -694,7 +731,7 @@ failed:
             return rc;
         }
 
-        ngx_stream_upstream_rr_peers_wlock(peers);
+        ngx_stream_upstream_rr_peers_select_lock(peers);
     }
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
@@ -714,7 +751,7 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
 {
     time_t                          now;
     uintptr_t                       m;
-    ngx_int_t                       total;
+    ngx_int_t                       total, best_weight;
     ngx_uint_t                      i, n, p;
     ngx_stream_upstream_rr_peer_t  *peer, *best;
 
@@ -725,6 +762,7 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
 
 #if (NGX_SUPPRESS_WARN)
     p = 0;
+    best_weight = 0;
 #endif
 
     for (peer = rrp->peers->peer, i = 0;
@@ -738,7 +776,10 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
+        ngx_stream_upstream_rr_select_peer_lock(rrp->peers, peer);
+
         if (peer->down) {
+            ngx_stream_upstream_rr_select_peer_unlock(rrp->peers, peer);
             continue;
         }
 
@@ -746,10 +787,12 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             && peer->fails >= peer->max_fails
             && now - peer->checked <= peer->fail_timeout)
         {
+            ngx_stream_upstream_rr_select_peer_unlock(rrp->peers, peer);
             continue;
         }
 
         if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_stream_upstream_rr_select_peer_unlock(rrp->peers, peer);
             continue;
         }
 
@@ -760,16 +803,23 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             peer->effective_weight++;
         }
 
-        if (best == NULL || peer->current_weight > best->current_weight) {
+        if (best == NULL || peer->current_weight > best_weight) {
             best = peer;
+            best_weight = peer->current_weight;
             p = i;
         }
+
+        ngx_stream_upstream_rr_select_peer_unlock(rrp->peers, peer);
     }
 
     if (best == NULL) {
         return NULL;
     }
 
+    /* the best peer is returned locked, if selected under the read lock */
+
+    ngx_stream_upstream_rr_select_peer_lock(rrp->peers, best);
+
     rrp->current = best;
     ngx_stream_upstream_rr_peer_ref(rrp->peers, best);
 
@@ -795,6 +845,7 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_stream_upstream_rr_peer_data_t  *rrp = data;
 
     time_t                          now;
+    ngx_msec_t                      elapsed;
     ngx_stream_upstream_rr_peer_t  *peer;
 
     ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
@@ -847,6 +898,19 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
             peer->effective_weight = 0;
         }
 
+        if (rrp->decay) {
+
+            /* a failed attempt costs at least the decay time */
+
+            elapsed = ngx_current_msec - rrp->start_time;
+
+            if (elapsed < rrp->decay) {
+                elapsed = rrp->decay;
+            }
+
+            ngx_stream_upstream_update_ewma(peer, elapsed, rrp->decay);
+        }
+
     } else {
 
         /* mark peer live if check passed */
@@ -890,12 +954,47 @@ ngx_stream_upstream_notify_round_robin_peer(ngx_peer_connection_t *pc,
             peer->fails = 0;
         }
 
+        if (rrp->decay) {
+            ngx_stream_upstream_update_ewma(peer,
+                                            ngx_current_msec - rrp->start_time,
+                                            rrp->decay);
+        }
+
         ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
         ngx_stream_upstream_rr_peers_unlock(rrp->peers);
     }
 }
 
 
+static void
+ngx_stream_upstream_update_ewma(ngx_stream_upstream_rr_peer_t *peer,
+    ngx_msec_t time, ngx_msec_t decay)
+{
+    uint64_t    ewma, elapsed;
+    ngx_msec_t  now;
+
+    /*
+     * peak EWMA of connect times, in microseconds: a slower connect
+     * replaces the average at once, while faster ones are blended in
+     * with a weight of elapsed / (decay + elapsed), where elapsed is
+     * the time since the previous update
+     */
+
+    now = ngx_current_msec;
+
+    ewma = (uint64_t) time * 1000;
+    elapsed = now - peer->ewma_time;
+
+    if (ewma < peer->ewma) {
+        ewma = ((uint64_t) peer->ewma * decay + ewma * elapsed)
+               / (decay + elapsed);
+    }
+
+    peer->ewma = (ngx_uint_t) ewma;
+    peer->ewma_time = now;
+}
+
+
 #if (NGX_STREAM_SSL)
 
 static ngx_int_t
@@ -57,6 +57,9 @@ struct ngx_stream_upstream_rr_peer_s {
 
     ngx_uint_t                       down;
 
+    ngx_uint_t                       ewma;
+    ngx_msec_t                       ewma_time;
+
     void                            *ssl_session;
     int                              ssl_session_len;
 
@@ -66,6 +69,9 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_atomic_t                     lock;
     ngx_uint_t                       refs;
     ngx_stream_upstream_host_t      *host;
+
+    ngx_uint_t                       hc_fails;
+    ngx_uint_t                       hc_passes;
 #endif
 
     ngx_stream_upstream_rr_peer_t   *next;
@@ -81,6 +87,8 @@ struct ngx_stream_upstream_rr_peers_s {
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_slab_pool_t                 *shpool;
     ngx_atomic_t                     rwlock;
+    ngx_rwlock_slot_t               *readers;
+    ngx_uint_t                       nreaders;
     ngx_uint_t                      *config;
     ngx_stream_upstream_rr_peer_t   *resolve;
     ngx_stream_upstream_rr_peers_t  *zone_next;
@@ -91,6 +99,7 @@ struct ngx_stream_upstream_rr_peers_s {
 
     unsigned                         single:1;
     unsigned                         weighted:1;
+    unsigned                         read_mostly:1;
 
     ngx_str_t                       *name;
 
@@ -104,19 +113,31 @@ struct ngx_stream_upstream_rr_peers_s {
 
 #define ngx_stream_upstream_rr_peers_rlock(peers)                             \
                                                                               \
-    if (peers->shpool) {                                                      \
+    if (peers->readers) {                                                     \
+        ngx_rwlock_rlock_slots(&peers->rwlock, peers->readers,                \
+                               peers->nreaders);                              \
+                                                                              \
+    } else if (peers->shpool) {                                               \
         ngx_rwlock_rlock(&peers->rwlock);                                     \
     }
 
 #define ngx_stream_upstream_rr_peers_wlock(peers)                             \
                                                                               \
-    if (peers->shpool) {                                                      \
+    if (peers->readers) {                                                     \
+        ngx_rwlock_wlock_slots(&peers->rwlock, peers->readers,                \
+                               peers->nreaders);                              \
+                                                                              \
+    } else if (peers->shpool) {                                               \
         ngx_rwlock_wlock(&peers->rwlock);                                     \
     }
 
 #define ngx_stream_upstream_rr_peers_unlock(peers)                            \
                                                                               \
-    if (peers->shpool) {                                                      \
+    if (peers->readers) {                                                     \
+        ngx_rwlock_unlock_slots(&peers->rwlock, peers->readers,               \
+                                peers->nreaders);                             \
+                                                                              \
+    } else if (peers->shpool) {                                               \
         ngx_rwlock_unlock(&peers->rwlock);                                    \
     }
 
@@ -211,6 +232,8 @@ typedef struct {
     ngx_stream_upstream_rr_peer_t   *current;
     uintptr_t                       *tried;
     uintptr_t                        data;
+    ngx_msec_t                       decay;
+    ngx_msec_t                       start_time;
 } ngx_stream_upstream_rr_peer_data_t;
 
 